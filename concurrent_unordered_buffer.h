@@ -0,0 +1,281 @@
+#ifndef CONCURRENT_UNORDERED_BUFFER_H
+#define CONCURRENT_UNORDERED_BUFFER_H
+
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <exception>
+#include <unordered_map>
+#include <utility>
+
+#include "unordered_buffer.h"
+
+/**
+ * @brief unordered_buffer shared between threads, every operation takes a
+ * single mutex. The interface is value based (get copies the value out)
+ * because iterators and references into the buffer are only valid while
+ * the lock is held, use with() to run anything else under the lock.
+ *
+ * @tparam Key	Key type
+ * @tparam T	Value Type
+ * @tparam Hash	Hash class
+ * @tparam RNG	Random number generator used for replacement rolls
+ */
+template <class Key, class T, class Hash = std::hash<Key>,
+		 class RNG = std::default_random_engine>
+class concurrent_unordered_buffer
+{
+public:
+	typedef Key key_type;
+	typedef T mapped_type;
+	typedef Hash hasher;
+	typedef unordered_buffer<Key, T, Hash, RNG> buffer_type;
+
+	/**
+	 * @brief Constructor
+	 *
+	 * @param size	Number of buckets
+	 */
+	concurrent_unordered_buffer(size_t size = 1024) : m_buff(size) {};
+
+	concurrent_unordered_buffer(const concurrent_unordered_buffer&) = delete;
+	concurrent_unordered_buffer& operator=(
+			const concurrent_unordered_buffer&) = delete;
+
+	/**
+	 * @brief Look up a key and count a hit for it if it is stored.
+	 *
+	 * @param key	Key to look for
+	 * @param value	Output, set to a copy of the value if the key is found
+	 *
+	 * @return 		true if the key is stored
+	 */
+	bool get(const Key& key, T& value)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto it = m_buff.find(key);
+		if(it == m_buff.end())
+			return false;
+
+		m_buff.touch(key);
+		value = it->second;
+		return true;
+	};
+
+	/**
+	 * @brief Look up a key, and on a miss compute its value with 
+	 * loader(key) and insert it. Only one loader runs per key at a time:
+	 * threads that miss on a key that is already being loaded wait for that
+	 * load and share its value (or its exception) instead of calling the
+	 * loader themselves. The loader runs without the lock held.
+	 *
+	 * Loads in flight are tracked per bucket, if two different keys of one
+	 * bucket miss at the same time the second loads on its own.
+	 *
+	 * @tparam Loader	Callable taking the key and returning a T
+	 * @param key		Key to look for
+	 * @param loader	Function to produce the value on a miss
+	 *
+	 * @return 			The value, from the buffer or the loader (the value is
+	 * 					returned even if it loses its roll for the bucket)
+	 */
+	template <class Loader>
+	T get_or_load(const Key& key, Loader loader)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		auto it = m_buff.find(key);
+		if(it != m_buff.end()) {
+			m_buff.touch(key);
+			return it->second;
+		}
+
+		size_t b = m_buff.bucket(key);
+		auto fit = m_inflight.find(b);
+		if(fit != m_inflight.end() && fit->second->key == key) {
+			// someone else is loading this key, wait for their result
+			std::shared_ptr<flight> f = fit->second;
+			m_coalesced++;
+			f->cv.wait(lock, [&f]() { return f->done; });
+			if(f->error)
+				std::rethrow_exception(f->error);
+			return f->value;
+		}
+
+		std::shared_ptr<flight> f;
+		if(fit == m_inflight.end()) {
+			f = std::make_shared<flight>(key);
+			m_inflight[b] = f;
+		}
+		m_loads++;
+		lock.unlock();
+
+		T value;
+		try {
+			value = loader(key);
+		} catch(...) {
+			lock.lock();
+			finish(b, f, std::current_exception());
+			throw;
+		}
+
+		lock.lock();
+		m_buff.insert(std::make_pair(key, value));
+		if(f)
+			f->value = value;
+		finish(b, f, std::exception_ptr());
+		return value;
+	};
+
+	/**
+	 * @brief Number of loader calls made by get_or_load
+	 */
+	size_t loads() const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_loads;
+	};
+
+	/**
+	 * @brief Number of get_or_load misses that waited for another thread's
+	 * load instead of calling the loader
+	 */
+	size_t coalesced() const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_coalesced;
+	};
+
+	/**
+	 * @brief Probabilistic insert, see unordered_buffer::insert
+	 *
+	 * @param key
+	 * @param value
+	 *
+	 * @return 		true if the key was admitted
+	 */
+	bool insert(const Key& key, const T& value)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_buff.insert(std::make_pair(key, value)).second;
+	};
+
+	/**
+	 * @brief Remove a key.
+	 *
+	 * @param key	Key to remove
+	 *
+	 * @return 		1 if erased, 0 otherwise
+	 */
+	size_t erase(const Key& key)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_buff.erase(key);
+	};
+
+	/**
+	 * @brief Add hits to a stored key, see unordered_buffer::touch
+	 *
+	 * @param key	Key that was hit
+	 * @param hits	Number of hits
+	 *
+	 * @return 		true if the key is stored
+	 */
+	bool touch(const Key& key, int hits = 1)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_buff.touch(key, hits);
+	};
+
+	/**
+	 * @brief Add a batch of hits under a single lock.
+	 *
+	 * @tparam InputIterator	Iterator of (key, hits) pairs
+	 * @param first				First pair
+	 * @param last				One past the last pair
+	 *
+	 * @return 					Number of keys that were stored
+	 */
+	template <class InputIterator>
+	size_t touch(InputIterator first, InputIterator last)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		size_t n = 0;
+		for(auto it=first; it!=last; it++)
+			n += m_buff.touch(it->first, it->second);
+		return n;
+	};
+
+	/**
+	 * @brief Number of stored elements
+	 */
+	size_t size() const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_buff.size();
+	};
+
+	/**
+	 * @brief Remove all elements
+	 */
+	void clear()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_buff.clear();
+	};
+
+	/**
+	 * @brief Run a function on the underlying buffer while holding the lock,
+	 * e.g. to change settings or iterate.
+	 *
+	 * @param f	Function taking an unordered_buffer&
+	 *
+	 * @return 	Whatever f returns
+	 */
+	template <class F>
+	auto with(F f) -> decltype(f(std::declval<buffer_type&>()))
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return f(m_buff);
+	};
+
+private:
+	/**
+	 * @brief A load in progress, waiters hold a reference until it is done
+	 */
+	struct flight
+	{
+		flight(const Key& k) : key(k), done(false) {};
+
+		Key key;
+		T value;
+		bool done;
+		std::exception_ptr error;
+		std::condition_variable cv;
+	};
+
+	mutable std::mutex m_mutex;
+	buffer_type m_buff;
+
+	// loads in progress, by bucket
+	std::unordered_map<size_t, std::shared_ptr<flight>> m_inflight;
+	size_t m_loads = 0;
+	size_t m_coalesced = 0;
+
+	/**
+	 * @brief Publish the outcome of a load and wake its waiters, called with
+	 * the lock held. f is NULL for loads that were not tracked.
+	 */
+	void finish(size_t b, const std::shared_ptr<flight>& f,
+			std::exception_ptr error)
+	{
+		if(!f)
+			return;
+
+		f->error = error;
+		f->done = true;
+		m_inflight.erase(b);
+		f->cv.notify_all();
+	};
+};
+
+#endif //CONCURRENT_UNORDERED_BUFFER_H
@@ -0,0 +1,120 @@
+#include <utility>
+#include <iostream>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <stdexcept>
+#include "concurrent_unordered_buffer.h"
+#include "thread_local_front.h"
+
+using std::cerr;
+using std::endl;
+
+typedef concurrent_unordered_buffer<int, double> shared_buffer;
+
+int main()
+{
+	const int NHOT = 100;
+	const int NTHREADS = 4;
+	const int NGETS = 20000;
+
+	// hits in the front only reach the shared buffer on flush
+	{
+		shared_buffer shared(1024);
+		shared.insert(1, 1.5);
+		thread_local_front<shared_buffer, 16> front(shared);
+
+		double value = 0;
+		for(int ii=0; ii<100; ii++)
+			front.get(1, value);
+
+		int before = shared.with([](shared_buffer::buffer_type& b) {
+				return b.priority(1); });
+		front.flush();
+		int after = shared.with([](shared_buffer::buffer_type& b) {
+				return b.priority(1); });
+		cerr << "Priority before flush: " << before << " after: " << after
+			<< endl;
+		if(value != 1.5 || before != 2 || after != 101) {
+			cerr << "Front hits were not batched" << endl;
+			return 1;
+		}
+	}
+
+	// threads missing on the same key share one load
+	{
+		shared_buffer shared(1024);
+		std::atomic<int> calls(0);
+		std::atomic<int> wrong(0);
+		auto slow = [&calls](int key) {
+			calls++;
+			std::this_thread::sleep_for(std::chrono::milliseconds(50));
+			return key*2.;
+		};
+
+		std::vector<std::thread> threads;
+		for(int tt=0; tt<8; tt++) {
+			threads.push_back(std::thread([&]() {
+				if(shared.get_or_load(7, slow) != 14.)
+					wrong++;
+			}));
+		}
+		for(auto& th : threads)
+			th.join();
+
+		// a failing load reaches the caller and is not cached
+		bool threw = false;
+		try {
+			shared.get_or_load(8, [](int) -> double {
+					throw std::runtime_error("backend down"); });
+		} catch(std::runtime_error& e) {
+			threw = true;
+		}
+
+		cerr << "Loads: " << calls << " for 8 threads, " << shared.coalesced()
+			<< " coalesced" << endl;
+		if(calls != 1 || wrong || !threw || shared.get_or_load(8, slow) != 16.) {
+			cerr << "Loads were not coalesced" << endl;
+			return 1;
+		}
+	}
+
+	// every thread's hits end up in the shared buffer, none are lost
+	shared_buffer shared(4096);
+	for(int kk=0; kk<NHOT; kk++)
+		shared.insert(kk, kk*.5);
+
+	std::vector<std::thread> threads;
+	for(int tt=0; tt<NTHREADS; tt++) {
+		threads.push_back(std::thread([&shared, tt]() {
+			thread_local_front<shared_buffer> front(shared, 1000);
+			double value = 0;
+			for(int ii=0; ii<NGETS; ii++) {
+				int key = ii%NHOT;
+				if(!front.get(key, value) || value != key*.5)
+					cerr << "Bad value for " << key << endl;
+
+				// cold misses from every thread
+				if(ii%10 == 0)
+					front.get(NHOT + tt*NGETS + ii, value);
+			}
+		}));
+	}
+	for(auto& th : threads)
+		th.join();
+
+	int expect = 1 + NTHREADS*NGETS/NHOT;
+	int wrong = shared.with([&](shared_buffer::buffer_type& b) {
+		int n = 0;
+		for(int kk=0; kk<NHOT; kk++)
+			n += (b.priority(kk) != expect);
+		return n;
+	});
+	cerr << NHOT-wrong << "/" << NHOT << " hot keys with priority " << expect
+		<< endl;
+	if(wrong)
+		return 1;
+
+	return 0;
+}
@@ -0,0 +1,278 @@
+#ifndef FINGERPRINT_UNORDERED_BUFFER_H
+#define FINGERPRINT_UNORDERED_BUFFER_H
+
+#include <string>
+#include <utility>
+#include <stdexcept>
+#include <type_traits>
+#include <cstring>
+#include <cstdint>
+
+#include "unordered_buffer.h"
+
+/**
+ * @brief Default fingerprint function: hashes the characters of a
+ * std::string, or the bytes of a trivially copyable key (so such keys must
+ * not contain uninitialized padding). Supply your own for other key types,
+ * with the same signature.
+ */
+template <class Key>
+struct unordered_buffer_fingerprinter
+{
+	static_assert(std::is_trivially_copyable<Key>::value,
+			"the default fingerprinter hashes raw bytes, supply a "
+			"fingerprinter for this key type");
+
+	void operator()(const Key& key, uint64_t out[2], int lanes) const
+	{
+		unordered_buffer_hash_bytes(&key, sizeof(Key), out, lanes);
+	};
+};
+
+template <>
+struct unordered_buffer_fingerprinter<std::string>
+{
+	void operator()(const std::string& key, uint64_t out[2], int lanes) const
+	{
+		unordered_buffer_hash_bytes(key.data(), key.size(), out, lanes);
+	};
+};
+
+/**
+ * @brief 128-bit fingerprint
+ */
+struct unordered_buffer_fp128
+{
+	uint64_t lo;
+	uint64_t hi;
+
+	bool operator==(const unordered_buffer_fp128& other) const {
+		return lo == other.lo && hi == other.hi;
+	};
+};
+
+/**
+ * @brief unordered_buffer that stores a 64 or 128-bit fingerprint of each key
+ * instead of the key itself, for keys that are large (e.g. multi-KB request
+ * signatures) or slow to compare. A bucket then costs the value plus 8 or 16
+ * bytes whatever the size of the key, and every key comparison is one or two
+ * integer compares. The key is hashed once per operation.
+ *
+ * The price is false positives: two keys with the same fingerprint are the
+ * same key to the buffer. A lookup of a key that isn't stored returns
+ * another key's value with probability about size()/2^Bits, not 2^-Bits:
+ * the bucket is picked from the fingerprint itself, so the key only meets
+ * occupants that already share its bucket bits, and the compare is in
+ * effect against every stored fingerprint. With a million entries that is
+ * about 2^-44 per absent lookup in 64-bit mode (one wrong value in some
+ * 10^13 misses), and 2^-108 with 128 bits. Over a lifetime of n distinct
+ * keys the chance that any two of them ever share a fingerprint is about
+ * n^2 / 2^(Bits+1): for a billion keys about 3% with 64 bits, and 1.5e-21
+ * with 128 bits. Choose Bits = 128 where a wrong value must never be
+ * served.
+ *
+ * Lookups and inserts take the full key; iteration and the settings are on
+ * buffer(), whose keys are fingerprints.
+ *
+ * @tparam Key			Key type
+ * @tparam T			Value Type
+ * @tparam Bits			Fingerprint size, 64 or 128
+ * @tparam Fingerprinter	Fingerprint function, see
+ * 						unordered_buffer_fingerprinter
+ * @tparam RNG			Random number generator used for replacement rolls
+ */
+template <class Key, class T, size_t Bits = 64,
+		 class Fingerprinter = unordered_buffer_fingerprinter<Key>,
+		 class RNG = std::default_random_engine>
+class fingerprint_unordered_buffer
+{
+	static_assert(Bits == 64 || Bits == 128,
+			"fingerprints are 64 or 128 bits");
+
+public:
+	typedef typename std::conditional<Bits == 64, uint64_t,
+			unordered_buffer_fp128>::type fingerprint_type;
+
+	/**
+	 * @brief Bucket hash of a fingerprint, its (already well mixed) low
+	 * 64 bits. Picking the bucket from any function of the fingerprint
+	 * spends log2(bucket_count()) of its bits, see the class comment.
+	 */
+	struct fingerprint_hash
+	{
+		size_t operator()(uint64_t fp) const {
+			return (size_t)fp;
+		};
+
+		size_t operator()(const unordered_buffer_fp128& fp) const {
+			return (size_t)fp.lo;
+		};
+	};
+
+	typedef unordered_buffer<fingerprint_type, T, fingerprint_hash, RNG>
+		buffer_type;
+
+	/**
+	 * @brief Constructor
+	 *
+	 * @param size	Number of buckets
+	 */
+	fingerprint_unordered_buffer(size_t size = 1024) : m_buff(size) {};
+
+	/**
+	 * @brief Fingerprint of a key
+	 *
+	 * @param key	Key
+	 *
+	 * @return 		Fingerprint
+	 */
+	fingerprint_type fingerprint(const Key& key) const
+	{
+		uint64_t out[2];
+		m_fingerprinter(key, out, Bits/64);
+		return make(out);
+	};
+
+	/**
+	 * @brief Probabilistic insert, see unordered_buffer::insert
+	 *
+	 * @param key
+	 * @param value
+	 *
+	 * @return 		true if the key was admitted (or already stored)
+	 */
+	bool insert(const Key& key, const T& value)
+	{
+		return m_buff.insert(std::make_pair(fingerprint(key), value)).second;
+	};
+
+	/**
+	 * @brief Look up a key, counting a hit, and insert a default value on a
+	 * miss. See unordered_buffer::operator[]
+	 *
+	 * @param key	Key
+	 *
+	 * @return 		Value
+	 */
+	T& operator[](const Key& key)
+	{
+		return m_buff[fingerprint(key)];
+	};
+
+	/**
+	 * @brief Find a key without changing priorities
+	 *
+	 * @param key	Key to look for
+	 *
+	 * @return 		Pointer to the value, NULL if the key isn't stored
+	 */
+	T* find(const Key& key)
+	{
+		auto it = m_buff.find(fingerprint(key));
+		return it == m_buff.end() ? NULL : &it->second;
+	};
+
+	const T* find(const Key& key) const
+	{
+		auto it = m_buff.find(fingerprint(key));
+		return it == m_buff.cend() ? NULL : &it->second;
+	};
+
+	/**
+	 * @brief Value of a key, throws std::out_of_range if it isn't stored
+	 */
+	const T& at(const Key& key) const
+	{
+		return m_buff.at(fingerprint(key));
+	};
+
+	/**
+	 * @brief 1 if the key is stored, 0 otherwise
+	 */
+	size_t count(const Key& key) const
+	{
+		return m_buff.count(fingerprint(key));
+	};
+
+	/**
+	 * @brief Remove a key
+	 *
+	 * @return 		1 if erased, 0 otherwise
+	 */
+	size_t erase(const Key& key)
+	{
+		return m_buff.erase(fingerprint(key));
+	};
+
+	/**
+	 * @brief Add hits to a stored key, see unordered_buffer::touch
+	 */
+	bool touch(const Key& key, int hits = 1)
+	{
+		return m_buff.touch(fingerprint(key), hits);
+	};
+
+	/**
+	 * @brief Priority of a stored key, 0 if it isn't stored
+	 */
+	int priority(const Key& key) const
+	{
+		return m_buff.priority(fingerprint(key));
+	};
+
+	size_t size() const
+	{
+		return m_buff.size();
+	};
+
+	bool empty() const
+	{
+		return m_buff.empty();
+	};
+
+	void clear()
+	{
+		m_buff.clear();
+	};
+
+	size_t memory_usage() const
+	{
+		return m_buff.memory_usage();
+	};
+
+	/**
+	 * @brief The underlying buffer, keyed by fingerprint, for settings and
+	 * iteration
+	 */
+	buffer_type& buffer()
+	{
+		return m_buff;
+	};
+
+	const buffer_type& buffer() const
+	{
+		return m_buff;
+	};
+
+private:
+	buffer_type m_buff;
+	Fingerprinter m_fingerprinter;
+
+	static uint64_t make(const uint64_t out[2], uint64_t*)
+	{
+		return out[0];
+	};
+
+	static unordered_buffer_fp128 make(const uint64_t out[2],
+			unordered_buffer_fp128*)
+	{
+		return unordered_buffer_fp128{out[0], out[1]};
+	};
+
+	static fingerprint_type make(const uint64_t out[2])
+	{
+		return make(out, (fingerprint_type*)NULL);
+	};
+};
+
+#endif //FINGERPRINT_UNORDERED_BUFFER_H
@@ -0,0 +1,91 @@
+#include <utility>
+#include <iostream>
+#include <string>
+#include <unordered_set>
+#include "fingerprint_unordered_buffer.h"
+
+using std::cerr;
+using std::endl;
+
+/**
+ * @brief A multi-KB key that differs from its neighbours in a single
+ * character somewhere in the middle
+ */
+std::string signature(size_t ii)
+{
+	std::string s(2048, 'x');
+	s.replace(1000, 20, std::to_string(ii));
+	return s;
+}
+
+/**
+ * @brief Store keys, check them back and look for false positives among
+ * keys that were never stored
+ */
+template <class Buffer>
+bool check(Buffer& buff, const char* name)
+{
+	const size_t N = 2000;
+	for(size_t ii=0; ii<N; ii++)
+		buff.insert(signature(ii), (int)ii);
+
+	size_t found = 0, wrong = 0, fp = 0;
+	for(size_t ii=0; ii<N; ii++) {
+		const int* v = buff.find(signature(ii));
+		if(v) {
+			found++;
+			wrong += (*v != (int)ii);
+		}
+	}
+	for(size_t ii=N; ii<100*N; ii++)
+		fp += buff.count(signature(ii));
+
+	std::string key = signature(1);
+	buff.touch(key, 10);
+	int pri = buff.priority(key);
+	buff.erase(key);
+
+	cerr << name << ": " << found << "/" << N << " stored, " 
+		<< buff.memory_usage()/buff.buffer().bucket_count() 
+		<< " bytes per bucket" << endl;
+	return found == buff.size() + 1 && found > N/2 && !wrong && !fp &&
+		pri == 11 && !buff.count(key);
+}
+
+int main()
+{
+	fingerprint_unordered_buffer<std::string, int> fp64(4096);
+	fingerprint_unordered_buffer<std::string, int, 128> fp128(4096);
+	if(!check(fp64, "64-bit") || !check(fp128, "128-bit")) {
+		cerr << "Fingerprint lookups are wrong" << endl;
+		return 1;
+	}
+
+	// compare to storing the strings
+	unordered_buffer<std::string, int> full(4096);
+	for(size_t ii=0; ii<2000; ii++)
+		full.insert(std::make_pair(signature(ii), (int)ii));
+	size_t bytes = full.memory_usage();
+	for(auto it=full.begin(); it!=full.end(); ++it)
+		bytes += it->first.capacity();
+	cerr << "Full keys: " << bytes/full.bucket_count() << " bytes per bucket"
+		<< endl;
+
+	// every single bit flip changes both lanes
+	std::unordered_set<uint64_t> lo, hi;
+	std::string base(100, 'a');
+	for(size_t ii=0; ii<base.size()*8; ii++) {
+		std::string s = base;
+		s[ii/8] ^= (char)(1 << (ii%8));
+		auto f = fp128.fingerprint(s);
+		lo.insert(f.lo);
+		hi.insert(f.hi);
+	}
+	if(lo.size() != base.size()*8 || hi.size() != base.size()*8 ||
+			fp64.fingerprint(base) == fp64.fingerprint(base + '\0')) {
+		cerr << "Fingerprints collide" << endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,488 @@
+#ifndef FROZEN_UNORDERED_BUFFER_H
+#define FROZEN_UNORDERED_BUFFER_H
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <utility>
+#include <stdexcept>
+#include <type_traits>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "unordered_buffer.h"
+
+/**
+ * @brief Immutable copy of an unordered_buffer's contents for read only
+ * phases, indexed by a minimal perfect hash (hash and displace, as in CHD).
+ * Keys are hashed into small groups; each group stores a displacement that
+ * sends its keys to distinct free positions, so the n keys occupy exactly n
+ * contiguous key/value pairs. A lookup reads one displacement and compares
+ * one pair: no probing, no collisions and no priorities.
+ *
+ * Build one with freeze(buffer). With trivially copyable Key and T it can be
+ * written to a flat file with save() and opened again with the path
+ * constructor, which maps the file read only instead of loading it (Hash
+ * must then give the same result in every process, as std::hash of integers
+ * does).
+ *
+ * @tparam Key	Key type
+ * @tparam T	Value Type
+ * @tparam Hash	Hash class
+ */
+template <class Key, class T, class Hash = std::hash<Key>>
+class frozen_unordered_buffer
+{
+public:
+	/**
+	 * @brief Stored key/value pair
+	 */
+	struct Item
+	{
+		Key key;
+		T value;
+	};
+
+	/**
+	 * @brief Build from the elements of a buffer (expired elements are left
+	 * out). Takes under a microsecond per element.
+	 *
+	 * @param buff	Buffer to copy
+	 */
+	template <class RNG>
+	frozen_unordered_buffer(const unordered_buffer<Key, T, Hash, RNG>& buff)
+		: m_map(NULL), m_mapbytes(0), m_seed(SEED)
+	{
+		std::vector<Item> items;
+		items.reserve(buff.size());
+		for(auto it=buff.cbegin(); it!=buff.cend(); it++) {
+			// iteration still shows expired elements, lookups don't
+			if(buff.count(it->first))
+				items.push_back(Item{it->first, it->second});
+		}
+		build(items);
+	};
+
+	/**
+	 * @brief Map a file written by save(), read only. The file must not be
+	 * changed while it is mapped (save() replaces files by renaming, which
+	 * is safe).
+	 *
+	 * @param path	File to map
+	 */
+	frozen_unordered_buffer(const std::string& path)
+		: m_map(NULL), m_mapbytes(0)
+	{
+		static_assert(std::is_trivially_copyable<Key>::value &&
+				std::is_trivially_copyable<T>::value,
+				"mapped files hold raw bytes, Key and T must be trivially "
+				"copyable");
+
+		int fd = open(path.c_str(), O_RDONLY);
+		if(fd < 0)
+			fail("open", path);
+
+		struct stat st;
+		if(fstat(fd, &st) != 0) {
+			close(fd);
+			fail("fstat", path);
+		}
+		m_mapbytes = st.st_size;
+		if(m_mapbytes < sizeof(Header)) {
+			close(fd);
+			throw std::runtime_error("frozen_unordered_buffer " + path +
+					" is not a frozen buffer");
+		}
+
+		m_map = mmap(NULL, m_mapbytes, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if(m_map == MAP_FAILED) {
+			m_map = NULL;
+			fail("mmap", path);
+		}
+
+		const Header* h = (const Header*)m_map;
+		if(h->magic != MAGIC || h->keysize != sizeof(Key) ||
+				h->valuesize != sizeof(T) || h->itemsize != sizeof(Item) ||
+				m_mapbytes != file_size(h->size, h->groups)) {
+			munmap(m_map, m_mapbytes);
+			throw std::runtime_error("frozen_unordered_buffer " + path +
+					" has a different layout or is truncated");
+		}
+
+		m_size = h->size;
+		m_groups = h->groups;
+		m_seed = h->seed;
+		m_disp = (const uint32_t*)((const char*)m_map + sizeof(Header));
+		m_items = (const Item*)((const char*)m_map +
+				items_offset(m_groups));
+	};
+
+	frozen_unordered_buffer(frozen_unordered_buffer&& other) : m_map(NULL)
+	{
+		*this = std::move(other);
+	};
+
+	frozen_unordered_buffer& operator=(frozen_unordered_buffer&& other)
+	{
+		if(this == &other)
+			return *this;
+		unmap();
+		m_owndisp = std::move(other.m_owndisp);
+		m_ownitems = std::move(other.m_ownitems);
+		m_map = other.m_map;
+		m_mapbytes = other.m_mapbytes;
+		m_size = other.m_size;
+		m_groups = other.m_groups;
+		m_seed = other.m_seed;
+		m_disp = m_map ? other.m_disp : m_owndisp.data();
+		m_items = m_map ? other.m_items : m_ownitems.data();
+		other.m_map = NULL;
+		other.m_ownitems.clear();
+		other.m_owndisp.clear();
+		other.build(other.m_ownitems);
+		return *this;
+	};
+
+	frozen_unordered_buffer(const frozen_unordered_buffer&) = delete;
+	frozen_unordered_buffer& operator=(const frozen_unordered_buffer&) = delete;
+
+	~frozen_unordered_buffer()
+	{
+		unmap();
+	};
+
+	/**
+	 * @brief Look up a key.
+	 *
+	 * @param key	Key to look for
+	 *
+	 * @return 		Pointer to the value, NULL if the key isn't stored
+	 */
+	const T* find(const Key& key) const
+	{
+		if(m_size == 0)
+			return NULL;
+		uint64_t h = unordered_buffer_mix(m_hasher(key), m_seed);
+		const Item& item = m_items[place(h, m_disp[group(h)], m_size)];
+		return item.key == key ? &item.value : NULL;
+	};
+
+	/**
+	 * @brief Value of a key, throws std::out_of_range if it isn't stored
+	 *
+	 * @param key	Key to look for
+	 *
+	 * @return 		Value
+	 */
+	const T& at(const Key& key) const
+	{
+		const T* v = find(key);
+		if(!v)
+			throw std::out_of_range("Key Not Found");
+		return *v;
+	};
+
+	/**
+	 * @brief 1 if the key is stored, 0 otherwise
+	 */
+	size_t count(const Key& key) const
+	{
+		return find(key) ? 1 : 0;
+	};
+
+	/**
+	 * @brief Number of stored pairs
+	 */
+	size_t size() const
+	{
+		return m_size;
+	};
+
+	bool empty() const
+	{
+		return m_size == 0;
+	};
+
+	/**
+	 * @brief Bytes used by the pairs and the displacement table
+	 */
+	size_t memory_usage() const
+	{
+		return m_size*sizeof(Item) + m_groups*sizeof(uint32_t);
+	};
+
+	/**
+	 * @brief Call f(key, value) for every stored pair, in no particular
+	 * order.
+	 */
+	template <class F>
+	void for_each(F f) const
+	{
+		for(size_t ii=0; ii<m_size; ii++)
+			f(m_items[ii].key, m_items[ii].value);
+	};
+
+	/**
+	 * @brief Write to a file that the path constructor can map. The file is
+	 * written next to the target and renamed over it, so processes that
+	 * have the old file mapped keep a consistent copy.
+	 *
+	 * @param path	File to write
+	 */
+	void save(const std::string& path) const
+	{
+		static_assert(std::is_trivially_copyable<Key>::value &&
+				std::is_trivially_copyable<T>::value,
+				"saved files hold raw bytes, Key and T must be trivially "
+				"copyable");
+
+		Header h;
+		memset(&h, 0, sizeof(h));
+		h.magic = MAGIC;
+		h.keysize = sizeof(Key);
+		h.valuesize = sizeof(T);
+		h.itemsize = sizeof(Item);
+		h.size = m_size;
+		h.groups = m_groups;
+		h.seed = m_seed;
+
+		std::string tmp = path + ".tmp";
+		int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if(fd < 0)
+			fail("open", tmp);
+
+		std::vector<char> pad(items_offset(m_groups) - sizeof(Header) -
+				m_groups*sizeof(uint32_t), 0);
+		if(!put(fd, &h, sizeof(h)) ||
+				!put(fd, m_disp, m_groups*sizeof(uint32_t)) ||
+				!put(fd, pad.data(), pad.size()) ||
+				!put(fd, m_items, m_size*sizeof(Item)) || fsync(fd) != 0) {
+			int err = errno;
+			close(fd);
+			unlink(tmp.c_str());
+			errno = err;
+			fail("write", tmp);
+		}
+		close(fd);
+		if(rename(tmp.c_str(), path.c_str()) != 0)
+			fail("rename", path);
+	};
+
+private:
+	struct Header
+	{
+		uint64_t magic;
+		uint32_t keysize;
+		uint32_t valuesize;
+		uint32_t itemsize;
+		uint32_t unused;
+		uint64_t size;
+		uint64_t groups;
+		uint64_t seed;
+	};
+
+	static const uint64_t MAGIC = 0x6675626e657a6f72ULL;
+	static const uint64_t SEED = 0x243f6a8885a308d3ULL;
+
+	// average keys per displacement group, more is smaller but slower to
+	// build
+	static const size_t GROUP_SIZE = 4;
+
+	std::vector<uint32_t> m_owndisp;
+	std::vector<Item> m_ownitems;
+	void* m_map;
+	size_t m_mapbytes;
+
+	const uint32_t* m_disp;
+	const Item* m_items;
+	size_t m_size;
+	size_t m_groups;
+	uint64_t m_seed;
+	Hash m_hasher;
+
+	/**
+	 * @brief Position of a key given its hash and its group's displacement
+	 */
+	static size_t place(uint64_t h, uint32_t disp, size_t n)
+	{
+		return reduce(unordered_buffer_mix(h, disp*0x9e3779b97f4a7c15ULL), n);
+	};
+
+	/**
+	 * @brief Map a hash onto [0, n) with a multiply instead of a division
+	 * (uses the high bits of the hash)
+	 */
+	static size_t reduce(uint64_t h, size_t n)
+	{
+		return (size_t)(((unsigned __int128)h * n) >> 64);
+	};
+
+	/**
+	 * @brief Displacement group of a hash, from its low bits (place() 
+	 * remixes the hash, so the two are independent)
+	 */
+	size_t group(uint64_t h) const
+	{
+		return reduce(h << 32 | h >> 32, m_groups);
+	};
+
+	/**
+	 * @brief Build the perfect hash. Groups are placed largest first, each
+	 * trying displacements until all of its keys land on free positions.
+	 */
+	void build(std::vector<Item>& items)
+	{
+		m_size = items.size();
+		m_groups = m_size/GROUP_SIZE + 1;
+		m_owndisp.assign(m_groups, 0);
+
+		std::vector<uint64_t> hashes(m_size);
+		std::vector<size_t> start(m_groups+1, 0);
+		for(size_t ii=0; ii<m_size; ii++) {
+			hashes[ii] = unordered_buffer_mix(m_hasher(items[ii].key), m_seed);
+			start[group(hashes[ii]) + 1]++;
+		}
+
+		// members of each group, contiguous
+		for(size_t gg=0; gg<m_groups; gg++)
+			start[gg+1] += start[gg];
+		std::vector<size_t> members(m_size);
+		std::vector<size_t> fill(start.begin(), start.end()-1);
+		for(size_t ii=0; ii<m_size; ii++)
+			members[fill[group(hashes[ii])]++] = ii;
+
+		std::vector<size_t> order(m_groups);
+		for(size_t gg=0; gg<m_groups; gg++)
+			order[gg] = gg;
+		std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+			return start[a+1]-start[a] > start[b+1]-start[b]; });
+
+		std::vector<bool> taken(m_size, false);
+		std::vector<size_t> pos;
+		for(size_t oo=0; oo<m_groups; oo++) {
+			size_t gg = order[oo];
+			size_t first = start[gg], last = start[gg+1];
+			if(first == last)
+				break;
+
+			for(size_t ii=first; ii<last; ii++) {
+				for(size_t jj=first; jj<ii; jj++) {
+					if(hashes[members[ii]] == hashes[members[jj]])
+						throw std::invalid_argument("frozen_unordered_buffer: "
+								"two keys have the same hash");
+				}
+			}
+
+			for(uint64_t d=0; ; d++) {
+				if(d > UINT32_MAX)
+					throw std::runtime_error("frozen_unordered_buffer: no "
+							"displacement found");
+
+				pos.clear();
+				bool ok = true;
+				for(size_t ii=first; ii<last && ok; ii++) {
+					size_t p = place(hashes[members[ii]], (uint32_t)d, m_size);
+					ok = !taken[p] &&
+						std::find(pos.begin(), pos.end(), p) == pos.end();
+					pos.push_back(p);
+				}
+				if(!ok)
+					continue;
+
+				m_owndisp[gg] = (uint32_t)d;
+				for(size_t ii=0; ii<pos.size(); ii++)
+					taken[pos[ii]] = true;
+				break;
+			}
+		}
+
+		// move every pair to its position
+		std::vector<Item> placed;
+		placed.reserve(m_size);
+		std::vector<size_t> where(m_size);
+		for(size_t ii=0; ii<m_size; ii++) {
+			uint64_t h = hashes[ii];
+			where[place(h, m_owndisp[group(h)], m_size)] = ii;
+		}
+		for(size_t pp=0; pp<m_size; pp++)
+			placed.push_back(std::move(items[where[pp]]));
+		m_ownitems.swap(placed);
+
+		m_disp = m_owndisp.data();
+		m_items = m_ownitems.data();
+	};
+
+	/**
+	 * @brief Offset of the pairs in a file, after the header and the
+	 * displacements, rounded up to a cache line
+	 */
+	static size_t items_offset(size_t groups)
+	{
+		return (sizeof(Header) + groups*sizeof(uint32_t) + 63)/64*64;
+	};
+
+	static size_t file_size(size_t size, size_t groups)
+	{
+		return items_offset(groups) + size*sizeof(Item);
+	};
+
+	static bool put(int fd, const void* data, size_t bytes)
+	{
+		const char* p = (const char*)data;
+		while(bytes > 0) {
+			ssize_t n = write(fd, p, bytes);
+			if(n < 0 && errno == EINTR)
+				continue;
+			if(n <= 0)
+				return false;
+			p += n;
+			bytes -= n;
+		}
+		return true;
+	};
+
+	void unmap()
+	{
+		if(m_map)
+			munmap(m_map, m_mapbytes);
+		m_map = NULL;
+	};
+
+	static void fail(const char* what, const std::string& path)
+	{
+		int err = errno;
+		throw std::runtime_error(std::string("frozen_unordered_buffer ") +
+				what + " " + path + ": " + strerror(err));
+	};
+};
+
+template <class Key, class T, class Hash>
+const uint64_t frozen_unordered_buffer<Key,T,Hash>::MAGIC;
+template <class Key, class T, class Hash>
+const uint64_t frozen_unordered_buffer<Key,T,Hash>::SEED;
+template <class Key, class T, class Hash>
+const size_t frozen_unordered_buffer<Key,T,Hash>::GROUP_SIZE;
+
+/**
+ * @brief Build a frozen (immutable, perfect hashed) copy of a buffer, see
+ * frozen_unordered_buffer.
+ *
+ * @param buff	Buffer to copy
+ *
+ * @return 		Frozen copy
+ */
+template <class Key, class T, class Hash, class RNG>
+frozen_unordered_buffer<Key, T, Hash> freeze(
+		const unordered_buffer<Key, T, Hash, RNG>& buff)
+{
+	return frozen_unordered_buffer<Key, T, Hash>(buff);
+}
+
+#endif //FROZEN_UNORDERED_BUFFER_H
@@ -0,0 +1,95 @@
+#include <utility>
+#include <iostream>
+#include <string>
+#include <cstdio>
+#include <unistd.h>
+#include "frozen_unordered_buffer.h"
+
+using std::cerr;
+using std::endl;
+
+struct record
+{
+	uint64_t a;
+	uint64_t b;
+};
+
+/**
+ * @brief Check that a frozen buffer holds exactly the pairs of the buffer
+ * it was made from, and nothing else.
+ */
+template <class Frozen, class Buffer>
+bool same(const Frozen& frozen, const Buffer& buff)
+{
+	size_t n = 0;
+	for(auto it=buff.cbegin(); it!=buff.cend(); it++) {
+		const record* v = frozen.find(it->first);
+		if(!v || v->a != it->second.a || v->b != it->second.b)
+			return false;
+		n++;
+	}
+	for(uint64_t kk=0; kk<100000; kk++) {
+		if(frozen.count(kk) != buff.count(kk))
+			return false;
+	}
+	return n == frozen.size();
+}
+
+int main()
+{
+	unordered_buffer<uint64_t, record> buff(50000);
+	buff.seed(7);
+	for(uint64_t ii=0; ii<80000; ii++) {
+		record rec = {ii, ii*3};
+		buff.insert(std::make_pair(ii*13 % 100000, rec));
+	}
+
+	auto frozen = freeze(buff);
+	cerr << "Froze " << frozen.size() << " elements into " 
+		<< frozen.memory_usage() << " bytes" << endl;
+	if(!same(frozen, buff)) {
+		cerr << "Frozen buffer differs from the original" << endl;
+		return 1;
+	}
+
+	// write it out and map it back
+	std::string path = "/tmp/frozen_unordered_buffer_test_" + 
+		std::to_string(getpid());
+	frozen.save(path);
+	{
+		frozen_unordered_buffer<uint64_t, record> mapped(path);
+		if(!same(mapped, buff)) {
+			cerr << "Mapped file differs from the original" << endl;
+			unlink(path.c_str());
+			return 1;
+		}
+
+		bool threw = false;
+		try {
+			frozen_unordered_buffer<uint64_t, uint64_t> wrong(path);
+		} catch(std::runtime_error& e) {
+			threw = true;
+		}
+		if(!threw) {
+			cerr << "Mapped a file with the wrong layout" << endl;
+			unlink(path.c_str());
+			return 1;
+		}
+	}
+	unlink(path.c_str());
+
+	// values that aren't trivially copyable, and the empty case
+	unordered_buffer<std::string, std::string> names(64);
+	names.insert(std::make_pair(std::string("a"), std::string("apple")));
+	names.insert(std::make_pair(std::string("b"), std::string("banana")));
+	auto fnames = freeze(names);
+	unordered_buffer<std::string, std::string> none(64);
+	auto fnone = freeze(none);
+	if(fnames.size() != names.size() || fnames.at("b") != "banana" ||
+			fnames.count("c") || !fnone.empty() || fnone.find("a")) {
+		cerr << "Frozen strings are wrong" << endl;
+		return 1;
+	}
+
+	return 0;
+}
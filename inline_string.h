@@ -0,0 +1,219 @@
+#ifndef INLINE_STRING_H
+#define INLINE_STRING_H
+
+#include <string>
+#include <functional>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+
+#include "unordered_buffer.h"
+
+/**
+ * @brief Byte string that keeps up to N bytes inside the object and only
+ * goes to the heap for longer ones. As the key or value of an
+ * unordered_buffer the bytes then sit in the bucket itself: storing or
+ * replacing a short string is a copy into the bucket with no allocation,
+ * and comparing keys doesn't follow a pointer. Pick N so the common strings
+ * fit, e.g. 23 or 55 (the object is N rounded up to 8, plus 8 bytes).
+ *
+ * A heap string keeps its buffer when assigned a shorter heap string, and
+ * frees it when assigned one that fits inline.
+ *
+ * @tparam N	Inline capacity in bytes, at least 16
+ */
+template <size_t N>
+class inline_string
+{
+	static_assert(N >= sizeof(char*) + sizeof(size_t),
+			"inline_string needs room for a heap pointer and capacity");
+
+public:
+	inline_string() : m_size(0) {};
+
+	inline_string(const char* s)
+		: m_size(0)
+	{
+		assign(s, strlen(s));
+	};
+
+	inline_string(const char* s, size_t len)
+		: m_size(0)
+	{
+		assign(s, len);
+	};
+
+	inline_string(const std::string& s)
+		: m_size(0)
+	{
+		assign(s.data(), s.size());
+	};
+
+	inline_string(const inline_string& other)
+		: m_size(0)
+	{
+		assign(other.data(), other.size());
+	};
+
+	/**
+	 * @brief Move constructor, takes over a heap buffer
+	 */
+	inline_string(inline_string&& other)
+		: m_size(0)
+	{
+		steal(other);
+	};
+
+	~inline_string()
+	{
+		if(onheap())
+			delete[] m_heap.ptr;
+	};
+
+	inline_string& operator=(const inline_string& other)
+	{
+		if(this != &other)
+			assign(other.data(), other.size());
+		return *this;
+	};
+
+	inline_string& operator=(inline_string&& other)
+	{
+		if(this == &other)
+			return *this;
+		if(!other.onheap()) {
+			assign(other.data(), other.size());
+		} else {
+			if(onheap())
+				delete[] m_heap.ptr;
+			m_size = 0;
+			steal(other);
+		}
+		return *this;
+	};
+
+	/**
+	 * @brief Replace the contents, allocating only if the string is longer
+	 * than N and than the current heap buffer
+	 *
+	 * @param s		Bytes
+	 * @param len	Number of bytes
+	 */
+	void assign(const char* s, size_t len)
+	{
+		if(len <= N) {
+			// s may point into the heap buffer, which shares the inline bytes
+			char* old = onheap() ? m_heap.ptr : NULL;
+			memmove(m_inline, s, len);
+			delete[] old;
+		} else if(onheap() && m_heap.cap >= len) {
+			memmove(m_heap.ptr, s, len);
+		} else {
+			char* p = new char[len];
+			memcpy(p, s, len);
+			if(onheap())
+				delete[] m_heap.ptr;
+			m_heap.ptr = p;
+			m_heap.cap = len;
+		}
+		m_size = len;
+	};
+
+	const char* data() const
+	{
+		return onheap() ? m_heap.ptr : m_inline;
+	};
+
+	size_t size() const
+	{
+		return m_size;
+	};
+
+	bool empty() const
+	{
+		return m_size == 0;
+	};
+
+	/**
+	 * @brief Whether the bytes are inline (no heap buffer)
+	 */
+	bool is_inline() const
+	{
+		return !onheap();
+	};
+
+	/**
+	 * @brief Copy into a std::string
+	 */
+	std::string str() const
+	{
+		return std::string(data(), m_size);
+	};
+
+	friend bool operator==(const inline_string& a, const inline_string& b)
+	{
+		return a.m_size == b.m_size && memcmp(a.data(), b.data(),
+				a.m_size) == 0;
+	};
+
+	friend bool operator!=(const inline_string& a, const inline_string& b)
+	{
+		return !(a == b);
+	};
+
+	friend bool operator<(const inline_string& a, const inline_string& b)
+	{
+		int c = memcmp(a.data(), b.data(), std::min(a.m_size, b.m_size));
+		return c < 0 || (c == 0 && a.m_size < b.m_size);
+	};
+
+private:
+	size_t m_size;
+	union {
+		char m_inline[N];
+		struct {
+			char* ptr;
+			size_t cap;
+		} m_heap;
+	};
+
+	bool onheap() const
+	{
+		return m_size > N;
+	};
+
+	/**
+	 * @brief Take another string's contents, leaving it empty. Assumes this
+	 * one holds no heap buffer.
+	 */
+	void steal(inline_string& other)
+	{
+		if(other.onheap()) {
+			m_heap = other.m_heap;
+			m_size = other.m_size;
+			other.m_size = 0;
+		} else {
+			assign(other.data(), other.size());
+		}
+	};
+};
+
+namespace std {
+
+/**
+ * @brief Hash of the bytes of an inline_string
+ */
+template <size_t N>
+struct hash<inline_string<N>>
+{
+	size_t operator()(const inline_string<N>& s) const
+	{
+		uint64_t out[2];
+		unordered_buffer_hash_bytes(s.data(), s.size(), out, 1);
+		return (size_t)out[0];
+	};
+};
+
+}
+
+#endif //INLINE_STRING_H
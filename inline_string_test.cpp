@@ -0,0 +1,77 @@
+#include <utility>
+#include <iostream>
+#include <string>
+#include <cstdlib>
+#include <new>
+#include "inline_string.h"
+
+using std::cerr;
+using std::endl;
+
+// count heap allocations, short strings must not make any
+static size_t allocations = 0;
+
+void* operator new(size_t n)
+{
+	allocations++;
+	void* p = malloc(n ? n : 1);
+	if(!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void* p) noexcept
+{
+	free(p);
+}
+
+typedef inline_string<23> istr;
+
+int main()
+{
+	// inline and heap strings, and moving between the two
+	istr a("short"), b(std::string(40, 'z'));
+	istr c = b;
+	istr d(std::move(c));
+	c = a;
+	b = istr("tiny");
+	if(a.str() != "short" || !a.is_inline() || d.str() != std::string(40, 'z') ||
+			d.is_inline() || c != a || b.str() != "tiny" || !b.is_inline() ||
+			!(a < d) || std::hash<istr>()(a) != std::hash<istr>()(c)) {
+		cerr << "inline_string is wrong" << endl;
+		return 1;
+	}
+
+	// a full buffer with short keys and values: after warm up, inserts that
+	// replace, hit or lose never allocate
+	const size_t BUCKETS = 1024;
+	std::vector<std::pair<istr, istr>> items;
+	for(size_t ii=0; ii<8*BUCKETS; ii++) {
+		std::string s = "session:" + std::to_string(1000000+ii);
+		items.push_back(std::make_pair(istr(s), istr("value:" + s)));
+	}
+
+	unordered_buffer<istr, istr> buff(BUCKETS);
+	buff.seed(3);
+	for(size_t ii=0; ii<items.size(); ii++)
+		buff.insert(items[ii]);
+	size_t before = allocations;
+	size_t occupied = buff.size();
+	for(size_t rr=0; rr<20; rr++) {
+		for(size_t ii=0; ii<items.size(); ii++)
+			buff.insert(items[(ii*7919 + rr)%items.size()]);
+	}
+	size_t steady = allocations - before - (buff.size() - occupied);
+
+	size_t correct = 0;
+	for(auto it=buff.begin(); it!=buff.end(); ++it)
+		correct += (it->second.str() == "value:" + it->first.str());
+	cerr << buff.size() << " elements, " << steady 
+		<< " allocations in steady state" << endl;
+	if(steady != 0 || correct != buff.size()) {
+		cerr << "Steady state inserts allocated" << endl;
+		return 1;
+	}
+
+	return 0;
+}
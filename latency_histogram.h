@@ -0,0 +1,245 @@
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <stdexcept>
+#include <cmath>
+#include <cstdint>
+
+/**
+ * @brief Log-linear histogram of operation latencies in nanoseconds, for
+ * tail percentiles rather than averages. Each power of two is split into 16
+ * linear buckets, so a recorded value is known within 1/16 (6.25%) from 16ns
+ * up and exactly below. It takes 8KB whatever the range.
+ *
+ * Timing an operation costs two clock reads, about as much as a buffer
+ * lookup, so a histogram samples: with an interval of n only every n-th
+ * timer on it reads the clock. A histogram is not thread safe; give each
+ * thread its own and merge() them when reporting, merging loses nothing.
+ *
+ * @code
+ * latency_histogram finds(64);
+ * for(...) {
+ * 	latency_histogram::timer t(finds);
+ * 	buff.find(key);
+ * }
+ * finds.quantile(0.99);
+ * @endcode
+ */
+class latency_histogram
+{
+public:
+	/**
+	 * @brief Times a scope if its histogram picks it for sampling and
+	 * records the elapsed time when destroyed.
+	 */
+	class timer
+	{
+	public:
+		timer(latency_histogram& hist) : m_hist(hist), m_on(hist.sample())
+		{
+			if(m_on)
+				m_start = clock::now();
+		};
+
+		~timer()
+		{
+			if(m_on) {
+				m_hist.record((uint64_t)std::chrono::duration_cast<
+						std::chrono::nanoseconds>(clock::now() - m_start)
+						.count());
+			}
+		};
+
+		timer(const timer&) = delete;
+		timer& operator=(const timer&) = delete;
+
+	private:
+		latency_histogram& m_hist;
+		bool m_on;
+		std::chrono::steady_clock::time_point m_start;
+	};
+
+	/**
+	 * @brief Constructor
+	 *
+	 * @param interval	Time one in this many timers, 1 to time all
+	 */
+	latency_histogram(uint64_t interval = 1)
+		: m_counts(BUCKETS, 0), m_total(0), m_min(UINT64_MAX), m_max(0),
+		m_sum(0)
+	{
+		sampling(interval);
+	};
+
+	/**
+	 * @brief Change the sampling interval, see timer
+	 *
+	 * @param interval	Time one in this many timers, at least 1
+	 */
+	void sampling(uint64_t interval)
+	{
+		if(interval == 0)
+			throw std::invalid_argument("Sampling interval must be positive");
+		m_interval = interval;
+		m_countdown = interval;
+	};
+
+	uint64_t sampling() const
+	{
+		return m_interval;
+	};
+
+	/**
+	 * @brief Whether the next operation should be timed, counts down the
+	 * sampling interval.
+	 */
+	bool sample()
+	{
+		if(--m_countdown > 0)
+			return false;
+		m_countdown = m_interval;
+		return true;
+	};
+
+	/**
+	 * @brief Add a measurement
+	 *
+	 * @param ns	Latency in nanoseconds
+	 * @param n		Number of times it was measured
+	 */
+	void record(uint64_t ns, uint64_t n = 1)
+	{
+		m_counts[index(ns)] += n;
+		m_total += n;
+		m_sum += (double)ns*n;
+		m_min = std::min(m_min, ns);
+		m_max = std::max(m_max, ns);
+	};
+
+	/**
+	 * @brief Add another histogram's measurements to this one, e.g. to
+	 * combine per thread histograms.
+	 */
+	void merge(const latency_histogram& other)
+	{
+		for(size_t ii=0; ii<BUCKETS; ii++)
+			m_counts[ii] += other.m_counts[ii];
+		m_total += other.m_total;
+		m_sum += other.m_sum;
+		m_min = std::min(m_min, other.m_min);
+		m_max = std::max(m_max, other.m_max);
+	};
+
+	/**
+	 * @brief Latency at or below which a fraction q of the measurements
+	 * fall, to within a bucket (the bucket's upper bound, at most max()).
+	 *
+	 * @param q	Fraction, e.g. 0.99 for the 99th percentile
+	 *
+	 * @return 	Nanoseconds, 0 if nothing was recorded
+	 */
+	uint64_t quantile(double q) const
+	{
+		if(m_total == 0)
+			return 0;
+
+		uint64_t rank = (uint64_t)std::max(1., std::ceil(q*m_total));
+		uint64_t seen = 0;
+		for(size_t ii=0; ii<BUCKETS; ii++) {
+			seen += m_counts[ii];
+			if(seen >= rank)
+				return std::min(upper(ii), m_max);
+		}
+		return m_max;
+	};
+
+	/**
+	 * @brief Number of measurements
+	 */
+	uint64_t count() const
+	{
+		return m_total;
+	};
+
+	/**
+	 * @brief Mean latency in nanoseconds, 0 if nothing was recorded
+	 */
+	double mean() const
+	{
+		return m_total ? m_sum/m_total : 0;
+	};
+
+	/**
+	 * @brief Smallest measurement, 0 if nothing was recorded
+	 */
+	uint64_t min() const
+	{
+		return m_total ? m_min : 0;
+	};
+
+	/**
+	 * @brief Largest measurement
+	 */
+	uint64_t max() const
+	{
+		return m_max;
+	};
+
+	/**
+	 * @brief Forget all measurements, keeps the sampling interval
+	 */
+	void clear()
+	{
+		std::fill(m_counts.begin(), m_counts.end(), 0);
+		m_total = 0;
+		m_min = UINT64_MAX;
+		m_max = 0;
+		m_sum = 0;
+	};
+
+private:
+	typedef std::chrono::steady_clock clock;
+
+	// linear buckets per power of two, as a power of two
+	static const int SUB_BITS = 4;
+	static const uint64_t SUB = 1 << SUB_BITS;
+	static const size_t BUCKETS = (64 - SUB_BITS + 1)*SUB;
+
+	std::vector<uint64_t> m_counts;
+	uint64_t m_total;
+	uint64_t m_min;
+	uint64_t m_max;
+	double m_sum;
+	uint64_t m_interval;
+	uint64_t m_countdown;
+
+	/**
+	 * @brief Bucket of a value: values below SUB have their own, above
+	 * that the exponent picks a group of SUB and the next bits the bucket.
+	 */
+	static size_t index(uint64_t v)
+	{
+		if(v < SUB)
+			return (size_t)v;
+		int e = 63 - __builtin_clzll(v);
+		return (size_t)(e - SUB_BITS + 1)*SUB +
+			(size_t)((v >> (e - SUB_BITS)) & (SUB - 1));
+	};
+
+	/**
+	 * @brief Largest value that falls in a bucket
+	 */
+	static uint64_t upper(size_t ii)
+	{
+		if(ii < SUB)
+			return ii;
+		int e = (int)(ii/SUB) + SUB_BITS - 1;
+		uint64_t lo = (SUB + ii%SUB) << (e - SUB_BITS);
+		return lo + ((uint64_t)1 << (e - SUB_BITS)) - 1;
+	};
+};
+
+#endif //LATENCY_HISTOGRAM_H
@@ -0,0 +1,96 @@
+#include <iostream>
+#include <vector>
+#include <thread>
+#include <cmath>
+#include "latency_histogram.h"
+
+using std::cerr;
+using std::endl;
+
+int main()
+{
+	// every value is within a bucket, 1/16, of the truth and exact below 16
+	{
+		latency_histogram hist;
+		for(uint64_t v=1; v<=100000; v++)
+			hist.record(v);
+
+		const double QS[] = {0.01, 0.5, 0.9, 0.99, 0.999, 1};
+		for(double q : QS) {
+			double truth = std::ceil(q*100000);
+			double got = (double)hist.quantile(q);
+			cerr << "p" << q*100 << " " << got << " (exact " << truth << ")"
+				<< endl;
+			if(got < truth || got > truth*(1 + 1./16)) {
+				cerr << "Quantile outside its bucket" << endl;
+				return 1;
+			}
+		}
+
+		latency_histogram small;
+		for(uint64_t v=0; v<16; v++)
+			small.record(v, 2);
+		if(small.quantile(0.5) != 7 || small.count() != 32 ||
+				small.min() != 0 || small.max() != 15 ||
+				hist.mean() != 50000.5 || hist.quantile(1) != 100000) {
+			cerr << "Small values or summary statistics are wrong" << endl;
+			return 1;
+		}
+
+		latency_histogram huge;
+		huge.record(UINT64_MAX);
+		huge.record(1ULL << 63);
+		if(huge.quantile(0.5) < (1ULL << 63) || huge.quantile(1) != UINT64_MAX) {
+			cerr << "Largest values are wrong" << endl;
+			return 1;
+		}
+	}
+
+	// per thread histograms merge into the same one as a single thread's
+	{
+		const int NTHREADS = 4;
+		std::vector<latency_histogram> parts(NTHREADS);
+		std::vector<std::thread> threads;
+		for(int tt=0; tt<NTHREADS; tt++) {
+			threads.push_back(std::thread([&parts, tt]() {
+				for(uint64_t v=tt; v<200000; v+=NTHREADS)
+					parts[tt].record(v*7);
+			}));
+		}
+		for(auto& th : threads)
+			th.join();
+
+		latency_histogram merged, single;
+		for(auto& part : parts)
+			merged.merge(part);
+		for(uint64_t v=0; v<200000; v++)
+			single.record(v*7);
+
+		bool same = merged.count() == single.count() &&
+			merged.min() == single.min() && merged.max() == single.max();
+		for(double q=0.001; q<1; q+=0.001)
+			same = same && merged.quantile(q) == single.quantile(q);
+		if(!same) {
+			cerr << "Merged histogram differs" << endl;
+			return 1;
+		}
+	}
+
+	// timers only measure every n-th operation
+	{
+		latency_histogram hist(10);
+		for(int ii=0; ii<1000; ii++) {
+			latency_histogram::timer t(hist);
+		}
+		cerr << "Timed " << hist.count() << " of 1000, median "
+			<< hist.quantile(0.5) << "ns" << endl;
+		uint64_t timed = hist.count();
+		hist.clear();
+		if(timed != 100 || hist.count() != 0 || hist.sampling() != 10) {
+			cerr << "Sampled timers are wrong" << endl;
+			return 1;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,432 @@
+#ifndef RCU_UNORDERED_BUFFER_H
+#define RCU_UNORDERED_BUFFER_H
+
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <stdexcept>
+#include <cstdint>
+
+#include "unordered_buffer.h"
+
+/**
+ * @brief unordered_buffer owned by one writer thread, read by any number of
+ * threads through immutable snapshots. The writer changes its buffer freely
+ * and calls publish() to make the current contents visible; readers look
+ * keys up in the latest published snapshot without locks, retries or
+ * writes to shared cache lines, so their lookups are wait-free and never
+ * slowed down by the writer.
+ *
+ * A snapshot is a dense array of the key/value pairs plus a small open
+ * addressed index of (hash tag, position) pairs at most half full, so a
+ * lookup usually reads one index slot and one pair.
+ *
+ * Old snapshots are reclaimed by epochs: a reader announces the epoch it
+ * read before loading the snapshot pointer, and publish() frees a retired
+ * snapshot once every reader is idle or has announced a later epoch.
+ *
+ * Readers count their hits locally and hand them over in batches, publish()
+ * applies them to the writer's buffer with touch(), so priorities keep
+ * following the read traffic.
+ *
+ * @tparam Key	Key type
+ * @tparam T	Value Type
+ * @tparam Hash	Hash class
+ * @tparam RNG	Random number generator used for replacement rolls
+ */
+template <class Key, class T, class Hash = std::hash<Key>,
+		 class RNG = std::default_random_engine>
+class rcu_unordered_buffer
+{
+	struct Announce;
+
+public:
+	typedef unordered_buffer<Key, T, Hash, RNG> buffer_type;
+
+	/**
+	 * @brief Immutable, read optimized copy of a buffer's contents
+	 */
+	class snapshot
+	{
+	public:
+		/**
+		 * @brief Pack the contents of a buffer
+		 *
+		 * @param buff		Buffer to copy
+		 * @param version	Number of the publish that made the snapshot
+		 */
+		snapshot(const buffer_type& buff, uint64_t version)
+			: m_version(version)
+		{
+			if(buff.size() >= UINT32_MAX)
+				throw std::length_error("Snapshot too large");
+
+			m_items.reserve(buff.size());
+			for(auto it=buff.cbegin(); it!=buff.cend(); it++) {
+				// iteration still shows expired elements, lookups don't
+				if(buff.count(it->first))
+					m_items.push_back(*it);
+			}
+
+			size_t cap = 2;
+			while(cap < 2*m_items.size())
+				cap *= 2;
+			m_mask = cap-1;
+			m_index.resize(cap, Slot{0, 0});
+
+			for(size_t ii=0; ii<m_items.size(); ii++) {
+				uint64_t h = hash(m_items[ii].first);
+				size_t pp = h & m_mask;
+				while(m_index[pp].pos != 0)
+					pp = (pp+1) & m_mask;
+				m_index[pp].tag = (uint32_t)(h >> 32);
+				m_index[pp].pos = (uint32_t)(ii+1);
+			}
+		};
+
+		/**
+		 * @brief Look up a key.
+		 *
+		 * @param key	Key to look for
+		 *
+		 * @return 		Pointer to the value, NULL if the key isn't stored
+		 */
+		const T* find(const Key& key) const
+		{
+			uint64_t h = hash(key);
+			uint32_t tag = (uint32_t)(h >> 32);
+			for(size_t pp=h & m_mask; m_index[pp].pos != 0;
+					pp=(pp+1) & m_mask) {
+				if(m_index[pp].tag != tag)
+					continue;
+				const std::pair<Key,T>& item = m_items[m_index[pp].pos-1];
+				if(item.first == key)
+					return &item.second;
+			}
+			return NULL;
+		};
+
+		/**
+		 * @brief Number of stored pairs
+		 */
+		size_t size() const
+		{
+			return m_items.size();
+		};
+
+		/**
+		 * @brief Number of the publish() that made this snapshot, starting
+		 * at 1 (0 is the empty snapshot made by the constructor)
+		 */
+		uint64_t version() const
+		{
+			return m_version;
+		};
+
+		/**
+		 * @brief The stored pairs, in no particular order
+		 */
+		const std::vector<std::pair<Key,T>>& items() const
+		{
+			return m_items;
+		};
+
+	private:
+		struct Slot
+		{
+			uint32_t tag;	//high half of the hash
+			uint32_t pos;	//position in m_items + 1, 0 = empty
+		};
+
+		std::vector<std::pair<Key,T>> m_items;
+		std::vector<Slot> m_index;
+		size_t m_mask;
+		uint64_t m_version;
+
+		static uint64_t hash(const Key& key)
+		{
+			return unordered_buffer_mix(Hash()(key), 0x6a09e667f3bcc909ULL);
+		};
+	};
+
+	/**
+	 * @brief A reader thread's handle. Each thread that reads makes its own
+	 * (e.g. a thread_local variable); a reader must not be shared between
+	 * threads and must be destroyed before the rcu_unordered_buffer.
+	 */
+	class reader
+	{
+	public:
+		/**
+		 * @brief Register a reader, takes the registration lock once.
+		 *
+		 * @param rcu	Buffer to read from
+		 * @param batch	Number of hits to count before handing them over
+		 */
+		reader(rcu_unordered_buffer& rcu, size_t batch = 1024)
+			: m_rcu(rcu), m_batch(batch), m_self(rcu.enroll())
+		{
+			m_hits.reserve(m_batch);
+		};
+
+		/**
+		 * @brief Destructor, hands over the pending hits and unregisters
+		 */
+		~reader()
+		{
+			flush();
+			m_self->live.store(false);
+		};
+
+		reader(const reader&) = delete;
+		reader& operator=(const reader&) = delete;
+
+		/**
+		 * @brief Look up a key in the latest snapshot and count a hit for it
+		 * if it is stored.
+		 *
+		 * @param key	Key to look for
+		 * @param value	Output, set to a copy of the value if the key is found
+		 *
+		 * @return 		true if the key was found
+		 */
+		bool get(const Key& key, T& value)
+		{
+			bool found = read([&](const snapshot& snap) {
+				const T* v = snap.find(key);
+				if(v)
+					value = *v;
+				return v != NULL;
+			});
+
+			if(found) {
+				m_hits.push_back(std::make_pair(key, 1));
+				if(m_hits.size() >= m_batch)
+					flush();
+			}
+			return found;
+		};
+
+		/**
+		 * @brief Run a function on the latest snapshot. The snapshot (and
+		 * pointers into it) is only guaranteed to stay alive until f
+		 * returns. No hits are counted.
+		 *
+		 * @param f	Function taking a const snapshot&
+		 *
+		 * @return 	Whatever f returns
+		 */
+		template <class F>
+		auto read(F f) -> decltype(f(std::declval<const snapshot&>()))
+		{
+			Guard guard(m_self->epoch, m_rcu.m_epoch.load());
+			return f(*m_rcu.m_current.load());
+		};
+
+		/**
+		 * @brief Hand the pending hits to the writer, they are applied at
+		 * its next publish().
+		 */
+		void flush()
+		{
+			if(m_hits.empty())
+				return;
+
+			std::lock_guard<std::mutex> lock(m_self->lock);
+			m_self->hits.insert(m_self->hits.end(), m_hits.begin(),
+					m_hits.end());
+			m_hits.clear();
+		};
+
+	private:
+		/**
+		 * @brief Announces an epoch for as long as it exists
+		 */
+		struct Guard
+		{
+			Guard(std::atomic<uint64_t>& e, uint64_t now) : epoch(e)
+			{
+				epoch.store(now);
+			};
+
+			~Guard()
+			{
+				epoch.store(IDLE);
+			};
+
+			std::atomic<uint64_t>& epoch;
+		};
+
+		rcu_unordered_buffer& m_rcu;
+		size_t m_batch;
+		std::shared_ptr<Announce> m_self;
+		std::vector<std::pair<Key, int>> m_hits;
+	};
+
+	/**
+	 * @brief Constructor
+	 *
+	 * @param size	Number of buckets of the writer's buffer
+	 */
+	rcu_unordered_buffer(size_t size = 1024) : m_buff(size), m_epoch(1),
+		m_version(0)
+	{
+		m_current.store(new snapshot(m_buff, 0));
+	};
+
+	/**
+	 * @brief Destructor, all readers must be gone
+	 */
+	~rcu_unordered_buffer()
+	{
+		delete m_current.load();
+		for(size_t ii=0; ii<m_retired.size(); ii++)
+			delete m_retired[ii].first;
+	};
+
+	rcu_unordered_buffer(const rcu_unordered_buffer&) = delete;
+	rcu_unordered_buffer& operator=(const rcu_unordered_buffer&) = delete;
+
+	/**
+	 * @brief The writer's buffer, only the writer thread may use it.
+	 * Changes become visible to readers at the next publish().
+	 */
+	buffer_type& writer()
+	{
+		return m_buff;
+	};
+
+	/**
+	 * @brief Apply the hits readers have handed over, publish a snapshot of
+	 * the writer's buffer and free the snapshots no reader can still see.
+	 * Writer thread only; it never waits for readers.
+	 *
+	 * @return 	Version of the new snapshot
+	 */
+	uint64_t publish()
+	{
+		collect();
+
+		snapshot* next = new snapshot(m_buff, ++m_version);
+		snapshot* old = m_current.exchange(next);
+		m_retired.push_back(std::make_pair(old, m_epoch.fetch_add(1)));
+		reclaim();
+		return m_version;
+	};
+
+	/**
+	 * @brief Number of replaced snapshots that may still be in use by a
+	 * reader and have not been freed yet.
+	 */
+	size_t retired() const
+	{
+		return m_retired.size();
+	};
+
+	/**
+	 * @brief Version of the latest published snapshot
+	 */
+	uint64_t version() const
+	{
+		return m_version;
+	};
+
+private:
+	static const uint64_t IDLE = UINT64_MAX;
+
+	/**
+	 * @brief Shared between a reader and the writer: the epoch the reader
+	 * announced (IDLE outside a read) and the hits it handed over.
+	 */
+	struct Announce
+	{
+		Announce() : epoch(IDLE), live(true) {};
+
+		std::atomic<uint64_t> epoch;
+		std::atomic<bool> live;
+		std::mutex lock;
+		std::vector<std::pair<Key, int>> hits;
+	};
+
+	buffer_type m_buff;
+	std::atomic<snapshot*> m_current;
+	std::atomic<uint64_t> m_epoch;
+	uint64_t m_version;
+
+	// replaced snapshots and the epoch at which they were replaced
+	std::vector<std::pair<snapshot*, uint64_t>> m_retired;
+
+	std::mutex m_enroll;
+	std::vector<std::shared_ptr<Announce>> m_readers;
+	std::vector<std::pair<Key, int>> m_collected;
+
+	/**
+	 * @brief Register a new reader
+	 */
+	std::shared_ptr<Announce> enroll()
+	{
+		auto a = std::make_shared<Announce>();
+		std::lock_guard<std::mutex> lock(m_enroll);
+		m_readers.push_back(a);
+		return a;
+	};
+
+	/**
+	 * @brief Apply the readers' hits to the buffer and forget readers that
+	 * are gone.
+	 */
+	void collect()
+	{
+		std::lock_guard<std::mutex> lock(m_enroll);
+		for(size_t ii=0; ii<m_readers.size(); ) {
+			Announce& a = *m_readers[ii];
+			bool gone = !a.live.load();
+			{
+				std::lock_guard<std::mutex> hl(a.lock);
+				m_collected.swap(a.hits);
+			}
+			for(size_t jj=0; jj<m_collected.size(); jj++)
+				m_buff.touch(m_collected[jj].first, m_collected[jj].second);
+			m_collected.clear();
+
+			if(gone) {
+				m_readers[ii] = m_readers.back();
+				m_readers.pop_back();
+			} else {
+				ii++;
+			}
+		}
+	};
+
+	/**
+	 * @brief Free retired snapshots that were replaced before the oldest
+	 * epoch any reader has announced. A reader that announced a later epoch
+	 * loaded the snapshot pointer after the replacement.
+	 */
+	void reclaim()
+	{
+		uint64_t oldest = IDLE;
+		{
+			std::lock_guard<std::mutex> lock(m_enroll);
+			for(size_t ii=0; ii<m_readers.size(); ii++)
+				oldest = std::min(oldest, m_readers[ii]->epoch.load());
+		}
+
+		size_t kept = 0;
+		for(size_t ii=0; ii<m_retired.size(); ii++) {
+			if(m_retired[ii].second < oldest)
+				delete m_retired[ii].first;
+			else
+				m_retired[kept++] = m_retired[ii];
+		}
+		m_retired.resize(kept);
+	};
+};
+
+template <class Key, class T, class Hash, class RNG>
+const uint64_t rcu_unordered_buffer<Key,T,Hash,RNG>::IDLE;
+
+#endif //RCU_UNORDERED_BUFFER_H
@@ -0,0 +1,91 @@
+#include <utility>
+#include <iostream>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include "rcu_unordered_buffer.h"
+
+using std::cerr;
+using std::endl;
+
+typedef rcu_unordered_buffer<int, long> rcu_buffer;
+
+int main()
+{
+	const int NTHREADS = 3;
+	const int NKEYS = 2000;
+
+	// readers only see published contents, and their hits reach the writer
+	{
+		rcu_buffer rcu(1024);
+		rcu.writer().insert(std::make_pair(5, 50L));
+
+		rcu_buffer::reader r(rcu, 10);
+		long value = 0;
+		bool early = r.get(5, value);
+		rcu.publish();
+		for(int ii=0; ii<25; ii++)
+			r.get(5, value);
+		r.flush();
+		rcu.publish();
+
+		cerr << "Priority after 25 reads: " << rcu.writer().priority(5) << endl;
+		if(early || value != 50 || rcu.writer().priority(5) != 26) {
+			cerr << "Reads are not published or hits were lost" << endl;
+			return 1;
+		}
+	}
+
+	// readers race a writer that keeps changing and publishing, every value
+	// they see is derived from its key and the snapshot version
+	rcu_buffer rcu(4096);
+	std::atomic<bool> stop(false);
+	std::atomic<int> bad(0);
+	std::atomic<long> reads(0);
+
+	std::vector<std::thread> threads;
+	for(int tt=0; tt<NTHREADS; tt++) {
+		threads.push_back(std::thread([&, tt]() {
+			rcu_buffer::reader r(rcu, 64);
+			long n = 0;
+			while(!stop) {
+				for(int kk=tt; kk<NKEYS; kk+=7) {
+					long value = 0;
+					if(r.get(kk, value) && value%NKEYS != kk)
+						bad++;
+				}
+				r.read([&](const rcu_buffer::snapshot& snap) {
+					for(auto& kv : snap.items()) {
+						if(kv.second%NKEYS != kv.first)
+							bad++;
+					}
+					return 0;
+				});
+				n++;
+			}
+			reads += n;
+		}));
+	}
+
+	for(long version=1; version<=300; version++) {
+		for(int kk=0; kk<NKEYS; kk++) {
+			rcu.writer().erase(kk);
+			rcu.writer().insert(std::make_pair(kk, kk + version*NKEYS));
+		}
+		rcu.publish();
+	}
+	stop = true;
+	for(auto& th : threads)
+		th.join();
+
+	// with every reader gone, all replaced snapshots can be freed
+	rcu.publish();
+	cerr << reads << " reader passes over " << rcu.version()
+		<< " versions, " << rcu.retired() << " snapshots left unfreed" << endl;
+	if(bad || rcu.retired() != 0) {
+		cerr << "Readers saw torn data or snapshots leaked" << endl;
+		return 1;
+	}
+
+	return 0;
+}
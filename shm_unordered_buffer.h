@@ -0,0 +1,544 @@
+#ifndef SHM_UNORDERED_BUFFER_H
+#define SHM_UNORDERED_BUFFER_H
+
+#include <string>
+#include <new>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <stdexcept>
+#include <type_traits>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+#include <cmath>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "unordered_buffer.h"
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LLONG_LOCK_FREE == 2,
+		"shm_unordered_buffer needs lock free (address free) atomics");
+
+/**
+ * @brief unordered_buffer whose buckets live in a named POSIX shared memory
+ * segment, so several processes on a host can share one cache instead of
+ * each keeping a copy. The first process to open a name creates and sizes
+ * the segment, later ones map it and must agree on the bucket count and the
+ * key and value sizes.
+ *
+ * The segment holds a small header followed by the bucket array, addressed
+ * by index only (there is no used list and no pointers), so every process
+ * can map it at a different address. Each bucket has a sequence lock:
+ * writers take it by CAS on the sequence number (odd = being written),
+ * readers copy the bucket and retry if the sequence changed underneath them.
+ * Priorities are separate atomics, so a hit is a single CAS and never
+ * blocks readers. Replacement rolls use a generator local to each process.
+ *
+ * Keys and values are copied as raw bytes, so both have to be trivially
+ * copyable, and Hash must give the same result in every process (true for
+ * std::hash of integers, the hash is mixed with a per-segment seed). A
+ * process that dies in the middle of a write leaves that bucket locked, the
+ * segment should then be removed and recreated.
+ *
+ * @tparam Key	Key type, trivially copyable
+ * @tparam T	Value Type, trivially copyable
+ * @tparam Hash	Hash class
+ */
+template <class Key, class T, class Hash = std::hash<Key>>
+class shm_unordered_buffer
+{
+	static_assert(std::is_trivially_copyable<Key>::value &&
+			std::is_trivially_copyable<T>::value,
+			"shm_unordered_buffer stores raw bytes, Key and T must be "
+			"trivially copyable");
+
+/******************************************************************************
+ *
+ * Data
+ *
+ ******************************************************************************/
+private:
+
+	struct Header
+	{
+		uint64_t magic;
+		uint64_t buckets;
+		uint32_t keysize;
+		uint32_t valuesize;
+		uint64_t seed;
+		std::atomic<uint64_t> count;
+		std::atomic<uint32_t> ready;
+	};
+
+	struct Slot
+	{
+		std::atomic<uint32_t> seq;		//odd while being written
+		std::atomic<int32_t> priority;	//0 indicates unused
+		Key key;
+		T value;
+	};
+
+	static const uint64_t MAGIC = 0x7562756666657273ULL;
+	static const int MAX_PRIORITY = 1000;
+
+	std::string m_name;
+	int m_fd;
+	void* m_base;
+	size_t m_bytes;
+	Header* m_header;
+	Slot* m_slots;
+	size_t m_size;
+
+	unordered_buffer_wyrand m_rng;
+	Hash m_hasher;
+
+/******************************************************************************
+ *
+ * Functions
+ *
+ ******************************************************************************/
+public:
+
+	/**
+	 * @brief Open the named buffer, creating it if it doesn't exist yet.
+	 *
+	 * @param name	Shared memory object name, e.g. "/mycache"
+	 * @param size	Number of buckets, must match an existing segment
+	 */
+	shm_unordered_buffer(const std::string& name, size_t size = 1024)
+		: m_name(name), m_fd(-1), m_base(NULL), m_bytes(0), m_header(NULL),
+		m_slots(NULL), m_size(size), m_rng(unordered_buffer_entropy(this)),
+		m_hasher()
+	{
+		if(size == 0)
+			throw std::invalid_argument("shm_unordered_buffer needs buckets");
+
+		m_bytes = slot_offset() + size*sizeof(Slot);
+		bool creator = true;
+		m_fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+		if(m_fd < 0 && errno == EEXIST) {
+			creator = false;
+			m_fd = shm_open(name.c_str(), O_RDWR, 0600);
+		}
+		if(m_fd < 0)
+			fail("shm_open");
+
+		if(creator) {
+			if(ftruncate(m_fd, m_bytes) != 0)
+				fail("ftruncate", true);
+		} else {
+			// the creator may not have sized it yet
+			struct stat st;
+			for(int ii=0; ; ii++) {
+				if(fstat(m_fd, &st) != 0)
+					fail("fstat");
+				if((size_t)st.st_size == m_bytes)
+					break;
+				if(ii > 1000 || (st.st_size != 0 && (size_t)st.st_size != m_bytes))
+					mismatch();
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+		}
+
+		m_base = mmap(NULL, m_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+		if(m_base == MAP_FAILED) {
+			m_base = NULL;
+			fail("mmap", creator);
+		}
+		m_header = (Header*)m_base;
+		m_slots = (Slot*)((char*)m_base + slot_offset());
+
+		if(creator) {
+			new(m_header) Header();
+			m_header->magic = MAGIC;
+			m_header->buckets = size;
+			m_header->keysize = sizeof(Key);
+			m_header->valuesize = sizeof(T);
+			m_header->seed = unordered_buffer_entropy(m_base);
+			m_header->count.store(0, std::memory_order_relaxed);
+			for(size_t ii=0; ii<size; ii++) {
+				new(&m_slots[ii].seq) std::atomic<uint32_t>(0);
+				new(&m_slots[ii].priority) std::atomic<int32_t>(0);
+			}
+			m_header->ready.store(1, std::memory_order_release);
+		} else {
+			for(int ii=0; m_header->ready.load(std::memory_order_acquire) == 0; ii++) {
+				if(ii > 1000)
+					mismatch();
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+			if(m_header->magic != MAGIC || m_header->buckets != size ||
+					m_header->keysize != sizeof(Key) ||
+					m_header->valuesize != sizeof(T))
+				mismatch();
+		}
+	};
+
+	/**
+	 * @brief Unmaps the segment, the segment itself stays until remove()
+	 */
+	~shm_unordered_buffer()
+	{
+		if(m_base)
+			munmap(m_base, m_bytes);
+		if(m_fd >= 0)
+			close(m_fd);
+	};
+
+	shm_unordered_buffer(const shm_unordered_buffer&) = delete;
+	shm_unordered_buffer& operator=(const shm_unordered_buffer&) = delete;
+
+	/**
+	 * @brief Remove a named segment. Processes that have it open keep their
+	 * mapping, new opens create a fresh one.
+	 *
+	 * @param name	Shared memory object name
+	 *
+	 * @return 		true if it existed
+	 */
+	static bool remove(const std::string& name)
+	{
+		return shm_unlink(name.c_str()) == 0;
+	};
+
+	/****************************************
+	 * Const Information Functions
+	 ****************************************/
+
+	/**
+	 * @brief Number of elements stored, by all processes
+	 *
+	 * @return Number of elements currently stored
+	 */
+	size_t size() const
+	{
+		return m_header->count.load(std::memory_order_relaxed);
+	};
+
+	bool empty() const
+	{
+		return size() == 0;
+	};
+
+	/**
+	 * @brief Get Number of buckets.
+	 *
+	 * @return number of buckets
+	 */
+	size_t bucket_count() const
+	{
+		return m_size;
+	};
+
+	/**
+	 * @brief Size of the shared segment, shared by every process mapping it
+	 *
+	 * @return bytes
+	 */
+	size_t memory_usage() const
+	{
+		return m_bytes;
+	};
+
+	/**
+	 * @brief Name of the shared memory object
+	 */
+	const std::string& name() const
+	{
+		return m_name;
+	};
+
+	/**
+	 * @brief Which bucket a particular key is in
+	 *
+	 * @param key	Key
+	 *
+	 * @return 		Bucket index
+	 */
+	size_t bucket(const Key& key) const
+	{
+		return unordered_buffer_mix(m_hasher(key), m_header->seed)%m_size;
+	};
+
+	/**
+	 * @brief Reseed this process's generator for replacement rolls
+	 *
+	 * @param s	Seed
+	 */
+	void seed(uint64_t s)
+	{
+		m_rng.seed(s);
+	};
+
+	/**************************************************************************
+	 * Modifiers
+	 *************************************************************************/
+
+	/**
+	 * @brief Probabilistic insert, see unordered_buffer::insert. A hit
+	 * increments the priority and leaves the value alone.
+	 *
+	 * @param key
+	 * @param value
+	 *
+	 * @return 		true if the key was admitted
+	 */
+	bool insert(const Key& key, const T& value)
+	{
+		Slot& s = m_slots[bucket(key)];
+		uint32_t seq = lock(s);
+
+		int pri = s.priority.load(std::memory_order_relaxed);
+		if(pri > 0 && s.key == key) {
+			hit(s);
+			unlock(s, seq);
+			return false;
+		}
+		if(pri > 0 && !roll(pri)) {
+			unlock(s, seq);
+			return false;
+		}
+
+		if(pri <= 0)
+			m_header->count.fetch_add(1, std::memory_order_relaxed);
+		memcpy((void*)&s.key, &key, sizeof(Key));
+		memcpy((void*)&s.value, &value, sizeof(T));
+		s.priority.store(1, std::memory_order_relaxed);
+		unlock(s, seq);
+		return true;
+	};
+
+	/**
+	 * @brief Remove a key.
+	 *
+	 * @param key	Key to remove
+	 *
+	 * @return 		1 if erased, 0 otherwise
+	 */
+	size_t erase(const Key& key)
+	{
+		Slot& s = m_slots[bucket(key)];
+		uint32_t seq = lock(s);
+
+		size_t erased = 0;
+		if(s.priority.load(std::memory_order_relaxed) > 0 && s.key == key) {
+			s.priority.store(0, std::memory_order_relaxed);
+			m_header->count.fetch_sub(1, std::memory_order_relaxed);
+			erased = 1;
+		}
+		unlock(s, seq);
+		return erased;
+	};
+
+	/**
+	 * @brief Remove every element, for all processes
+	 */
+	void clear()
+	{
+		for(size_t ii=0; ii<m_size; ii++) {
+			Slot& s = m_slots[ii];
+			uint32_t seq = lock(s);
+			if(s.priority.load(std::memory_order_relaxed) > 0) {
+				s.priority.store(0, std::memory_order_relaxed);
+				m_header->count.fetch_sub(1, std::memory_order_relaxed);
+			}
+			unlock(s, seq);
+		}
+	};
+
+	/**************************************************************************
+	 * Lookups, lock free for readers
+	 *************************************************************************/
+
+	/**
+	 * @brief Look up a key and count a hit for it if it is stored.
+	 *
+	 * @param key	Key to look for
+	 * @param value	Output, set to a copy of the value if the key is found
+	 *
+	 * @return 		true if the key is stored
+	 */
+	bool get(const Key& key, T& value)
+	{
+		Slot& s = m_slots[bucket(key)];
+		if(!read(s, key, value))
+			return false;
+		hit(s);
+		return true;
+	};
+
+	/**
+	 * @brief Look up a key without changing its priority.
+	 *
+	 * @param key	Key to look for
+	 * @param value	Output, set to a copy of the value if the key is found
+	 *
+	 * @return 		true if the key is stored
+	 */
+	bool find(const Key& key, T& value) const
+	{
+		return read(m_slots[bucket(key)], key, value);
+	};
+
+	/**
+	 * @brief Number of elements with matching key, 0 or 1.
+	 */
+	size_t count(const Key& key) const
+	{
+		T value;
+		return find(key, value) ? 1 : 0;
+	};
+
+	/**
+	 * @brief Current priority of a stored key, 0 if it isn't stored
+	 */
+	int priority(const Key& key) const
+	{
+		Slot& s = m_slots[bucket(key)];
+		T value;
+		if(!read(s, key, value))
+			return 0;
+		return s.priority.load(std::memory_order_relaxed);
+	};
+
+	/**
+	 * @brief Call f(key, value, priority) with a consistent copy of every
+	 * stored element, in bucket order.
+	 *
+	 * @param f	Function to call
+	 */
+	template <class F>
+	void for_each(F f) const
+	{
+		Key key;
+		T value;
+		int pri;
+		for(size_t ii=0; ii<m_size; ii++) {
+			if(snapshot(m_slots[ii], key, value, pri) && pri > 0)
+				f(key, value, pri);
+		}
+	};
+
+private:
+
+	/**
+	 * @brief Bucket array offset, after the header rounded up to a cache line
+	 */
+	static size_t slot_offset()
+	{
+		return (sizeof(Header) + 63)/64*64;
+	};
+
+	/**
+	 * @brief Clean up a failed open and throw. A segment this buffer created
+	 * is unlinked, so a half made (e.g. unsized) one doesn't stay behind
+	 * for the next open to trip on.
+	 *
+	 * @param what		Call that failed
+	 * @param created	Whether this buffer created the segment
+	 */
+	void fail(const char* what, bool created = false)
+	{
+		int err = errno;
+		if(m_fd >= 0)
+			close(m_fd);
+		if(created)
+			shm_unlink(m_name.c_str());
+		throw std::runtime_error(std::string("shm_unordered_buffer ") + what +
+				" " + m_name + ": " + strerror(err));
+	};
+
+	void mismatch()
+	{
+		if(m_base)
+			munmap(m_base, m_bytes);
+		close(m_fd);
+		throw std::runtime_error("shm_unordered_buffer " + m_name +
+				" exists with a different bucket count or element size");
+	};
+
+	/**
+	 * @brief Take a bucket's write lock, spinning while another writer has it
+	 *
+	 * @return 	Sequence number before the write
+	 */
+	uint32_t lock(Slot& s)
+	{
+		for(int spins=0; ; spins++) {
+			uint32_t seq = s.seq.load(std::memory_order_relaxed);
+			if(!(seq & 1) && s.seq.compare_exchange_weak(seq, seq+1,
+						std::memory_order_acquire, std::memory_order_relaxed))
+				return seq;
+			if(spins > 64)
+				std::this_thread::yield();
+		}
+	};
+
+	void unlock(Slot& s, uint32_t seq)
+	{
+		s.seq.store(seq+2, std::memory_order_release);
+	};
+
+	/**
+	 * @brief Copy a bucket's contents, seqlock read side.
+	 *
+	 * @return 	false if a writer kept the bucket busy
+	 */
+	bool snapshot(const Slot& s, Key& key, T& value, int& pri) const
+	{
+		for(int spins=0; ; spins++) {
+			uint32_t seq = s.seq.load(std::memory_order_acquire);
+			if(!(seq & 1)) {
+				pri = s.priority.load(std::memory_order_relaxed);
+				memcpy((void*)&key, (const void*)&s.key, sizeof(Key));
+				memcpy((void*)&value, (const void*)&s.value, sizeof(T));
+				std::atomic_thread_fence(std::memory_order_acquire);
+				if(s.seq.load(std::memory_order_relaxed) == seq)
+					return true;
+			}
+			if(spins > 64)
+				std::this_thread::yield();
+		}
+	};
+
+	bool read(const Slot& s, const Key& key, T& value) const
+	{
+		Key stored;
+		T tmp;
+		int pri;
+		if(!snapshot(s, stored, tmp, pri) || pri <= 0 || !(stored == key))
+			return false;
+		value = tmp;
+		return true;
+	};
+
+	/**
+	 * @brief Count a hit, capped at MAX_PRIORITY. Never revives a bucket 
+	 * that was emptied since it was read. If the key was replaced in the
+	 * meantime the hit goes to the new key, which is harmless.
+	 */
+	void hit(Slot& s)
+	{
+		int pri = s.priority.load(std::memory_order_relaxed);
+		while(pri > 0 && pri < MAX_PRIORITY && 
+				!s.priority.compare_exchange_weak(pri, pri+1, 
+					std::memory_order_relaxed))
+			;
+	};
+
+	/**
+	 * @brief The die cast on a collision, the higher the incumbent's priority
+	 * the lower the odds of replacement.
+	 */
+	bool roll(int priority)
+	{
+		double u = (m_rng() >> 11)*(1.0/9007199254740992.0);
+		return u < pow(2, -priority);
+	};
+};
+
+#endif //SHM_UNORDERED_BUFFER_H
@@ -0,0 +1,136 @@
+#include <utility>
+#include <iostream>
+#include <string>
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "shm_unordered_buffer.h"
+
+using std::cerr;
+using std::endl;
+
+struct record
+{
+	uint64_t a;
+	uint64_t b;
+	uint64_t c;
+};
+
+typedef shm_unordered_buffer<uint64_t, record> shm_buffer;
+
+/**
+ * @brief Worker process: hammer a shared set of keys with inserts and reads.
+ * Every value is derived from its key, so a torn read shows up as a
+ * mismatch.
+ */
+int worker(const std::string& name, int id)
+{
+	shm_buffer buff(name, 512);
+	buff.seed(id+1);
+	int torn = 0;
+	for(uint64_t ii=0; ii<200000; ii++) {
+		uint64_t key = (ii*7919 + id)%2048;
+		record rec = {key, key*3, ~key};
+		if(ii%4 == 0) {
+			buff.insert(key, rec);
+		} else if(buff.get(key, rec)) {
+			if(rec.a != key || rec.b != key*3 || rec.c != ~key)
+				torn++;
+		}
+	}
+	return torn ? 1 : 0;
+}
+
+int main()
+{
+	const int NPROC = 4;
+	std::string name = "/unordered_buffer_test_" + std::to_string(getpid());
+	shm_buffer::remove(name);
+
+	// a segment too big to size or map is not left behind half made, so a
+	// later open creates it afresh
+	{
+		bool threw = false;
+		try {
+			shm_buffer huge(name, (size_t)1 << 56);
+		} catch(std::runtime_error& e) {
+			cerr << "Huge segment: " << e.what() << endl;
+			threw = true;
+		}
+		bool fresh = true;
+		try {
+			fresh = shm_buffer(name, 512).size() == 0;
+		} catch(std::runtime_error& e) {
+			fresh = false;
+		}
+		if(!threw || !fresh) {
+			cerr << "Failed create left the segment behind" << endl;
+			return 1;
+		}
+	}
+	shm_buffer::remove(name);
+
+	// a second handle (as another process would open it) sees the same data
+	{
+		shm_buffer first(name, 512);
+		shm_buffer second(name, 512);
+		record rec = {1, 2, 3};
+		first.insert(42, rec);
+		record out = {0, 0, 0};
+		if(!second.get(42, out) || out.b != 2 || first.priority(42) != 2) {
+			cerr << "Second mapping does not see the insert" << endl;
+			return 1;
+		}
+
+		bool threw = false;
+		try {
+			shm_buffer wrong(name, 256);
+		} catch(std::runtime_error& e) {
+			threw = true;
+		}
+		if(!threw) {
+			cerr << "Opened with the wrong bucket count" << endl;
+			return 1;
+		}
+		second.clear();
+		if(!first.empty()) {
+			cerr << "Clear not shared" << endl;
+			return 1;
+		}
+	}
+
+	// concurrent writers and readers in separate processes
+	pid_t pids[NPROC];
+	for(int pp=0; pp<NPROC; pp++) {
+		pids[pp] = fork();
+		if(pids[pp] == 0)
+			_exit(worker(name, pp));
+	}
+
+	int failed = 0;
+	for(int pp=0; pp<NPROC; pp++) {
+		int status = 0;
+		waitpid(pids[pp], &status, 0);
+		if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			failed++;
+	}
+
+	shm_buffer buff(name, 512);
+	size_t seen = 0;
+	buff.for_each([&](uint64_t key, const record& rec, int pri) {
+		(void)(pri);
+		if(rec.a != key || rec.b != key*3 || rec.c != ~key)
+			failed++;
+		seen++;
+	});
+	cerr << NPROC << " processes, " << buff.size() << " elements, "
+		<< seen << " visited, " << buff.memory_usage() << " shared bytes"
+		<< endl;
+	shm_buffer::remove(name);
+
+	if(failed || seen != buff.size()) {
+		cerr << "Inconsistent shared buffer" << endl;
+		return 1;
+	}
+	return 0;
+}
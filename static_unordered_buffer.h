@@ -0,0 +1,644 @@
+#ifndef STATIC_UNORDERED_BUFFER_H
+#define STATIC_UNORDERED_BUFFER_H
+
+#include <array>
+#include <utility>
+#include <random>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+
+#include "unordered_buffer.h"
+
+/**
+ * @brief unordered_buffer with the number of buckets fixed at compile time.
+ * The buckets are a std::array inside the object, so the buffer never
+ * allocates and can live on the stack or inside another object. Because N is
+ * a constant the bucket modulus becomes a multiply and shift (a mask for
+ * powers of two).
+ *
+ * Replacement works as in unordered_buffer: a hit increments the key's
+ * priority, a collision replaces the incumbent with probability
+ * 2^-priority. The optional features of unordered_buffer (two_choice,
+ * victim stash, ghost history, byte budget, expiry, on_evict) all need heap
+ * storage or std::function and are not available here. There is no used
+ * list either, iteration walks the buckets and skips empty ones.
+ *
+ * @tparam Key	Key type
+ * @tparam T	Value Type
+ * @tparam N	Number of buckets
+ * @tparam Hash	Hash class
+ * @tparam RNG	Random number generator used for replacement rolls, must
+ * 				provide seed().
+ */
+template <class Key, class T, size_t N, class Hash = std::hash<Key>,
+		 class RNG = std::default_random_engine>
+class static_unordered_buffer
+{
+	static_assert(N > 0, "static_unordered_buffer needs at least one bucket");
+
+/******************************************************************************
+ *
+ * Data
+ *
+ ******************************************************************************/
+private:
+
+	struct Element
+	{
+		int priority;	//hit count, 0 indicates unused
+		std::pair<Key, T> value;
+	};
+
+	std::array<Element, N> m_data;
+	size_t m_size;
+
+	RNG m_rng;
+	std::uniform_real_distribution<double> m_rdist;
+	Hash m_hasher;
+
+	// optional seeded mixing of m_hasher's output, off by default
+	bool m_mixhash;
+	uint64_t m_seed;
+
+	static const int MAX_PRIORITY = 1000;
+
+/******************************************************************************
+ *
+ * Functions
+ *
+ ******************************************************************************/
+public:
+
+	/**
+	 * @brief Iterator, walks the occupied buckets in bucket order
+	 */
+	class iterator {
+	public:
+
+		/**
+		 * @brief Default Constructor
+		 */
+		iterator() : m_buff(NULL), m_ii(0) { };
+
+		/**
+		 * @brief Dereference operator
+		 *
+		 * @return Key/value pair
+		 */
+		std::pair<Key,T>& operator*() const {
+			return m_buff->m_data[m_ii].value;
+		};
+
+		/**
+		 * @brief Dereference and . operator
+		 *
+		 * @return Pointer to key/value pair
+		 */
+		std::pair<Key,T>* operator->() const {
+			return &m_buff->m_data[m_ii].value;
+		};
+
+		/**
+		 * @brief Prefix, advance to the next occupied bucket
+		 */
+		iterator& operator++(){
+			m_ii = m_buff->next(m_ii+1);
+			return *this;
+		};
+
+		/**
+		 * @brief Postfix, advance to the next occupied bucket
+		 */
+		iterator operator++(int unused){
+			(void)(unused);
+			iterator tmp = *this;
+			++*this;
+			return tmp;
+		};
+
+		/**
+		 * @brief Whether two iterators point to the same bucket
+		 */
+		bool operator==(const iterator& other) const {
+			return m_ii == other.m_ii;
+		};
+
+		bool operator!=(const iterator& other) const {
+			return m_ii != other.m_ii;
+		};
+
+	private:
+		friend class static_unordered_buffer<Key,T,N,Hash,RNG>;
+
+		iterator(static_unordered_buffer* buff, size_t ii) : m_buff(buff),
+			m_ii(ii) { };
+
+		static_unordered_buffer* m_buff;
+		size_t m_ii;
+	};
+
+	/**
+	 * @brief Constant iterator, walks the occupied buckets in bucket order
+	 */
+	class const_iterator {
+	public:
+
+		/**
+		 * @brief Default Constructor
+		 */
+		const_iterator() : m_buff(NULL), m_ii(0) { };
+
+		/**
+		 * @brief Conversion from a modifiable iterator
+		 *
+		 * @param other
+		 */
+		const_iterator(const iterator& other) : m_buff(other.m_buff),
+			m_ii(other.m_ii) { };
+
+		/**
+		 * @brief Dereference operator
+		 *
+		 * @return Key/value pair
+		 */
+		const std::pair<Key,T>& operator*() const {
+			return m_buff->m_data[m_ii].value;
+		};
+
+		/**
+		 * @brief Dereference and . operator
+		 *
+		 * @return Pointer to key/value pair
+		 */
+		const std::pair<Key,T>* operator->() const {
+			return &m_buff->m_data[m_ii].value;
+		};
+
+		/**
+		 * @brief Prefix, advance to the next occupied bucket
+		 */
+		const_iterator& operator++(){
+			m_ii = m_buff->next(m_ii+1);
+			return *this;
+		};
+
+		/**
+		 * @brief Postfix, advance to the next occupied bucket
+		 */
+		const_iterator operator++(int unused){
+			(void)(unused);
+			const_iterator tmp = *this;
+			++*this;
+			return tmp;
+		};
+
+		/**
+		 * @brief Whether two iterators point to the same bucket
+		 */
+		bool operator==(const const_iterator& other) const {
+			return m_ii == other.m_ii;
+		};
+
+		bool operator!=(const const_iterator& other) const {
+			return m_ii != other.m_ii;
+		};
+
+	private:
+		friend class static_unordered_buffer<Key,T,N,Hash,RNG>;
+
+		const_iterator(const static_unordered_buffer* buff, size_t ii)
+			: m_buff(buff), m_ii(ii) { };
+
+		const static_unordered_buffer* m_buff;
+		size_t m_ii;
+	};
+
+	/**
+	 * @brief Get begin iterator, O(N) on a sparse buffer
+	 *
+	 * @return A modifiable iterator
+	 */
+	iterator begin()
+	{
+		return iterator(this, next(0));
+	};
+
+	/**
+	 * @brief Get the end iterator.
+	 *
+	 * @return An iterator 1 past the end.
+	 */
+	iterator end()
+	{
+		return iterator(this, N);
+	};
+
+	const_iterator begin() const
+	{
+		return cbegin();
+	};
+
+	const_iterator end() const
+	{
+		return cend();
+	};
+
+	/**
+	 * @brief Get the const_iterator at the beginning.
+	 *
+	 * @return
+	 */
+	const_iterator cbegin() const
+	{
+		return const_iterator(this, next(0));
+	};
+
+	/**
+	 * @brief Get the const_iterator at the end.
+	 *
+	 * @return
+	 */
+	const_iterator cend() const
+	{
+		return const_iterator(this, N);
+	};
+
+	/**************************************************************************
+	 * Constructors
+	**************************************************************************/
+
+	/**
+	 * @brief Constructor, all buckets start empty. The random number
+	 * generator gets the same default seed as unordered_buffer's.
+	 */
+	static_unordered_buffer() : m_size(0),
+		m_rng(unordered_buffer_entropy(this)), m_rdist(0,1), m_hasher(),
+		m_mixhash(false), m_seed(0)
+	{
+		for(size_t ii=0; ii<N; ii++)
+			m_data[ii].priority = 0;
+	};
+
+	/**
+	 * @brief Initializer list based constructor, the key/value pairs are
+	 * inserted in order.
+	 *
+	 * @param il	List of key/value pairs
+	 */
+	static_unordered_buffer(std::initializer_list<std::pair<Key,T>> il)
+		: static_unordered_buffer()
+	{
+		for(auto it=il.begin(); it!=il.end(); it++)
+			admit(it->first, it->second);
+	};
+
+	/****************************************
+	 * Const Information Functions
+	 ****************************************/
+
+	/**
+	 * @brief Does the buffer have any elements?
+	 *
+	 * @return whether the buffer is empty
+	 */
+	bool empty() const
+	{
+		return m_size == 0;
+	};
+
+	/**
+	 * @brief Number of buffer elements stored
+	 *
+	 * @return Number of elements currently stored
+	 */
+	size_t size() const
+	{
+		return m_size;
+	};
+
+	/**
+	 * @brief Get number of buckets.
+	 *
+	 * @return number of buckets
+	 */
+	static constexpr size_t max_size()
+	{
+		return N;
+	};
+
+	/**
+	 * @brief Get Number of buckets.
+	 *
+	 * @return number of buckets
+	 */
+	static constexpr size_t bucket_count()
+	{
+		return N;
+	};
+
+	/**
+	 * @brief Memory used by the buffer, all of it inside the object.
+	 *
+	 * @return bytes
+	 */
+	static constexpr size_t memory_usage()
+	{
+		return sizeof(static_unordered_buffer);
+	};
+
+	/**************************************************************************
+	 * Overall Settings/Changes
+	 *************************************************************************/
+
+	/**
+	 * @brief Completely clears the buffer.
+	 */
+	void clear()
+	{
+		for(size_t ii=0; ii<N; ii++)
+			m_data[ii].priority = 0;
+		m_size = 0;
+	};
+
+	/**
+	 * @brief Enable or disable seeded mixing of the Hash output, see
+	 * unordered_buffer::hash_mixing. Only allowed while the buffer is empty,
+	 * there is nowhere to rehash into.
+	 *
+	 * @param enable	Whether to mix hash values
+	 * @param seed		Seed for the mixer
+	 */
+	void hash_mixing(bool enable, uint64_t seed)
+	{
+		if(m_size != 0)
+			throw std::logic_error("hash_mixing on a non-empty static buffer");
+		m_mixhash = enable;
+		m_seed = seed;
+	};
+
+	/**
+	 * @brief Enable or disable seeded mixing of the Hash output, the seed is
+	 * drawn from the buffer's random number generator.
+	 *
+	 * @param enable	Whether to mix hash values
+	 */
+	void hash_mixing(bool enable)
+	{
+		uint64_t seed = ((uint64_t)m_rng() << 32) ^ (uint64_t)m_rng();
+		hash_mixing(enable, seed);
+	};
+
+	/**
+	 * @brief Whether hash mixing is currently enabled.
+	 *
+	 * @return true if the Hash output is mixed before use
+	 */
+	bool hash_mixing() const
+	{
+		return m_mixhash;
+	};
+
+	/**
+	 * @brief Reseed the random number generator used for replacement rolls.
+	 *
+	 * @param s	Seed
+	 */
+	void seed(uint64_t s)
+	{
+		m_rng.seed((typename RNG::result_type)s);
+	};
+
+	/**
+	 * @brief Direct access to the random number generator
+	 *
+	 * @return Reference to the generator
+	 */
+	RNG& rng()
+	{
+		return m_rng;
+	};
+
+	/**************************************************************************
+	 * deletions
+	 *************************************************************************/
+
+	/**
+	 * @brief Erase a bucket from the datastructure
+	 *
+	 * @param pos Position to erase.
+	 *
+	 * @return Iterator pointing to the next occupied bucket
+	 */
+	iterator erase(iterator pos)
+	{
+		release(m_data[pos.m_ii]);
+		return iterator(this, next(pos.m_ii+1));
+	};
+
+	/**
+	 * @brief Key-based erase. If a key/value pair matches then erase it.
+	 *
+	 * @param key	Key to find and erase
+	 *
+	 * @return 		1 if erased, 0 otherwise
+	 */
+	size_t erase(const Key& key)
+	{
+		auto& data = m_data[bucket(key)];
+		if(!holds(data, key))
+			return 0;
+
+		release(data);
+		return 1;
+	};
+
+	/**************************************************************************
+	 * insertions, these all trigger change in priority in the case of a hit
+	 *************************************************************************/
+
+	/**
+	 * @brief insert an element probabilistically, see
+	 * unordered_buffer::insert.
+	 *
+	 * @param value
+	 *
+	 * @return Iterator, insertion occured (bool) pair.
+	 */
+	std::pair<iterator, bool> insert(const std::pair<Key, T>& value)
+	{
+		return admit(value.first, value.second);
+	};
+
+	/**
+	 * @brief Key/Value pair insertion, the pair is moved from if it is
+	 * admitted.
+	 *
+	 * @param value	Pair of Key/T to insert
+	 *
+	 * @return iterator of inserted value (or old value), bool indicating
+	 * whether insertion occurred.
+	 */
+	std::pair<iterator, bool> insert(std::pair<Key, T>&& value)
+	{
+		return admit(std::move(value.first), std::move(value.second));
+	};
+
+	/**
+	 * @brief Identical to insertion, but the key and value are moved from.
+	 *
+	 * @param key
+	 * @param value
+	 *
+	 * @return
+	 */
+	std::pair<iterator, bool> emplace(Key&& key, T&& value)
+	{
+		return admit(std::move(key), std::move(value));
+	};
+
+	/**
+	 * @brief Operator to get the current value, or insert a new value. On
+	 * a collision the key rolls for the bucket, if it loses the incumbent's
+	 * value is returned (as with unordered_buffer).
+	 *
+	 * @param key Key to lookup, and insert/find
+	 *
+	 * @return Value in the key's bucket
+	 */
+	T& operator[](const Key& key)
+	{
+		return admit(key, T()).first->second;
+	};
+
+	/**************************************************************************
+	 * Accessors that do not trigger change in priority
+	 *************************************************************************/
+
+	/**
+	 * @brief Find a given key without adjusting its priority.
+	 *
+	 * @param key	Key to search for
+	 *
+	 * @return 		Iterator of located key, end() if not stored
+	 */
+	iterator find(const Key& key)
+	{
+		size_t b = bucket(key);
+		return holds(m_data[b], key) ? iterator(this, b) : end();
+	};
+
+	const_iterator find(const Key& key) const
+	{
+		size_t b = bucket(key);
+		return holds(m_data[b], key) ? const_iterator(this, b) : cend();
+	};
+
+	/**
+	 * @brief Value of a stored key, without adjusting its priority.
+	 *
+	 * @param key	Key to find,
+	 *
+	 * @return Value from key/value pair, throws std::out_of_range if the key
+	 * isn't stored
+	 */
+	const T& at(const Key& key) const
+	{
+		auto& data = m_data[bucket(key)];
+		if(!holds(data, key))
+			throw std::out_of_range("Key Not Found");
+		return data.value.second;
+	};
+
+	/**
+	 * @brief Number of elements with matching key, 0 or 1.
+	 *
+	 * @param key	Key to search for.
+	 *
+	 * @return 		0 if key not found, 1 if found
+	 */
+	size_t count(const Key& key) const
+	{
+		return holds(m_data[bucket(key)], key) ? 1 : 0;
+	};
+
+	/**
+	 * @brief Which bucket a particular key is in
+	 *
+	 * @param key	Key to search for
+	 *
+	 * @return 		Bucket index
+	 */
+	size_t bucket(const Key& key) const
+	{
+		uint64_t h = m_hasher(key);
+		if(m_mixhash)
+			h = unordered_buffer_mix(h, m_seed);
+
+		// N is a constant, no division here
+		return h%N;
+	};
+
+private:
+
+	/**
+	 * @brief Shared body of insert, emplace and []. A hit increments the
+	 * priority, an empty bucket takes the key, and a collision rolls against
+	 * the incumbent's priority.
+	 *
+	 * @return 	Iterator to the key's bucket and whether the key was admitted
+	 */
+	template <class K, class V>
+	std::pair<iterator, bool> admit(K&& key, V&& value)
+	{
+		size_t b = bucket(key);
+		auto& data = m_data[b];
+
+		if(data.priority <= 0) {
+			m_size++;
+		} else if(data.value.first == key) {
+			if(data.priority < MAX_PRIORITY)
+				data.priority++;
+			return std::make_pair(iterator(this, b), false);
+		} else if(!roll(data.priority)) {
+			return std::make_pair(iterator(this, b), false);
+		}
+
+		data.priority = 1;
+		data.value.first = std::forward<K>(key);
+		data.value.second = std::forward<V>(value);
+		return std::make_pair(iterator(this, b), true);
+	};
+
+	/**
+	 * @brief The die cast on a collision, the higher the incumbent's priority
+	 * the lower the odds of replacement.
+	 */
+	bool roll(int priority)
+	{
+		return m_rdist(m_rng) < pow(2,-priority);
+	};
+
+	bool holds(const Element& data, const Key& key) const
+	{
+		return data.priority > 0 && data.value.first == key;
+	};
+
+	void release(Element& data)
+	{
+		data.priority = 0;
+		m_size--;
+	};
+
+	/**
+	 * @brief First occupied bucket at or after ii, N if there is none
+	 */
+	size_t next(size_t ii) const
+	{
+		while(ii < N && m_data[ii].priority <= 0)
+			ii++;
+		return ii;
+	};
+};
+
+#endif //STATIC_UNORDERED_BUFFER_H
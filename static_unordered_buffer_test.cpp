@@ -0,0 +1,90 @@
+#include <utility>
+#include <iostream>
+#include <cstdlib>
+#include <new>
+#include "static_unordered_buffer.h"
+
+using std::cerr;
+using std::endl;
+
+// count heap allocations, the static buffer must not make any
+static size_t allocations = 0;
+
+void* operator new(size_t n)
+{
+	allocations++;
+	void* p = malloc(n ? n : 1);
+	if(!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void* p) noexcept
+{
+	free(p);
+}
+
+struct owner
+{
+	int id;
+	static_unordered_buffer<int, double, 64> recent;
+};
+
+int main()
+{
+	const int HOT[3] = {28, 9, 0};
+
+	size_t before = allocations;
+	static_unordered_buffer<int, double, 1000> buff;
+	buff.seed(1);
+
+	// same pattern as unordered_buffer_test, 3 hot keys among random ones
+	for(size_t jj=0; jj<50; jj++) {
+		for(size_t ii=0; ii<1000; ii++)
+			buff.insert(std::make_pair(rand(), rand()/(double)RAND_MAX));
+		for(size_t ii=0; ii<3; ii++)
+			buff.insert(std::make_pair(HOT[ii], (double)HOT[ii]));
+	}
+
+	size_t stored = 0;
+	for(size_t ii=0; ii<3; ii++) {
+		if(buff.count(HOT[ii]))
+			stored++;
+	}
+
+	size_t iterated = 0;
+	for(auto it=buff.begin(); it!=buff.end(); ++it)
+		iterated++;
+
+	owner conn;
+	conn.recent[5] = 1.5;
+	conn.recent.erase(5);
+
+	cerr << "Hot keys stored: " << stored << "/3, size " << buff.size()
+		<< ", iterated " << iterated << ", " << buff.memory_usage()
+		<< " bytes" << endl;
+
+	if(allocations != before) {
+		cerr << allocations-before << " heap allocations" << endl;
+		return 1;
+	}
+	if(iterated != buff.size() || !conn.recent.empty()) {
+		cerr << "Size mismatch" << endl;
+		return 1;
+	}
+	if(stored < 2) {
+		cerr << "Hot keys were lost" << endl;
+		return 1;
+	}
+
+	const auto& cbuff = buff;
+	for(size_t ii=0; ii<3; ii++) {
+		auto it = cbuff.find(HOT[ii]);
+		if(it != cbuff.end() && it->second != cbuff.at(HOT[ii])) {
+			cerr << "Const lookup mismatch" << endl;
+			return 1;
+		}
+	}
+
+	return 0;
+}
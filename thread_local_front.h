@@ -0,0 +1,214 @@
+#ifndef THREAD_LOCAL_FRONT_H
+#define THREAD_LOCAL_FRONT_H
+
+#include <array>
+#include <vector>
+#include <utility>
+#include <cstdint>
+
+#include "unordered_buffer.h"
+
+/**
+ * @brief Small direct mapped cache owned by one thread, in front of a buffer
+ * shared by all threads (e.g. concurrent_unordered_buffer). Hits on keys
+ * held in the front never touch the shared buffer: they are counted locally
+ * and handed to the shared buffer's batch touch() under one lock every
+ * period operations (or when the key leaves the front), so the hottest keys
+ * stop bouncing the shared buffer's lock and buckets between cores.
+ *
+ * Make one per thread, e.g. as a thread_local variable. Values in the front
+ * are copies: writes by other threads become visible here at the next
+ * flush(), which empties the front. insert and erase go through to the
+ * shared buffer and drop the local copy, so a thread sees its own writes.
+ *
+ * Buffer must provide key_type, mapped_type, hasher, get(key, value),
+ * insert(key, value), erase(key) and touch(first, last) over (key, hits)
+ * pairs.
+ *
+ * @tparam Buffer	Shared buffer type
+ * @tparam N		Number of front buckets
+ */
+template <class Buffer, size_t N = 256>
+class thread_local_front
+{
+public:
+	typedef typename Buffer::key_type Key;
+	typedef typename Buffer::mapped_type T;
+
+	/**
+	 * @brief Constructor
+	 *
+	 * @param shared	Buffer to sit in front of, must outlive the front
+	 * @param period	Number of operations between flushes
+	 */
+	thread_local_front(Buffer& shared, size_t period = 4096)
+		: m_shared(shared), m_period(period), m_ops(0),
+		m_rng(unordered_buffer_entropy(this))
+	{
+		for(size_t ii=0; ii<N; ii++)
+			m_slots[ii].used = false;
+		m_batch.reserve(N);
+	};
+
+	/**
+	 * @brief Destructor, hands the pending hits to the shared buffer
+	 */
+	~thread_local_front()
+	{
+		flush();
+	};
+
+	thread_local_front(const thread_local_front&) = delete;
+	thread_local_front& operator=(const thread_local_front&) = delete;
+
+	/**
+	 * @brief Look up a key, in the front first and then in the shared
+	 * buffer. A key found in the shared buffer is copied into the front if it
+	 * wins the roll against the current occupant (which uses the occupant's
+	 * hits since the last flush as its priority).
+	 *
+	 * @param key	Key to look for
+	 * @param value	Output, set if the key is found
+	 *
+	 * @return 		true if the key was found
+	 */
+	bool get(const Key& key, T& value)
+	{
+		if(++m_ops >= m_period)
+			flush();
+
+		Slot& s = slot(key);
+		if(s.used && s.key == key) {
+			s.hits++;
+			value = s.value;
+			return true;
+		}
+
+		if(!m_shared.get(key, value))
+			return false;
+
+		if(s.used) {
+			if(!roll(s.hits))
+				return true;
+			retire(s);
+		}
+		s.key = key;
+		s.value = value;
+		s.hits = 0;
+		s.used = true;
+		return true;
+	};
+
+	/**
+	 * @brief Insert into the shared buffer, dropping any local copy.
+	 *
+	 * @param key
+	 * @param value
+	 *
+	 * @return 		true if the shared buffer admitted the key
+	 */
+	bool insert(const Key& key, const T& value)
+	{
+		Slot& s = slot(key);
+		if(s.used && s.key == key)
+			retire(s);
+		return m_shared.insert(key, value);
+	};
+
+	/**
+	 * @brief Erase from the front and the shared buffer.
+	 *
+	 * @param key	Key to remove
+	 *
+	 * @return 		1 if the shared buffer held the key, 0 otherwise
+	 */
+	size_t erase(const Key& key)
+	{
+		Slot& s = slot(key);
+		if(s.used && s.key == key)
+			s.used = false;
+		return m_shared.erase(key);
+	};
+
+	/**
+	 * @brief Apply all pending hits to the shared buffer and empty the front.
+	 */
+	void flush()
+	{
+		for(size_t ii=0; ii<N; ii++) {
+			if(m_slots[ii].used)
+				retire(m_slots[ii]);
+		}
+		if(!m_batch.empty())
+			m_shared.touch(m_batch.begin(), m_batch.end());
+		m_batch.clear();
+		m_ops = 0;
+	};
+
+	/**
+	 * @brief Number of hits counted locally and not yet applied to the
+	 * shared buffer.
+	 *
+	 * @return hits
+	 */
+	size_t pending() const
+	{
+		size_t n = 0;
+		for(size_t ii=0; ii<N; ii++) {
+			if(m_slots[ii].used)
+				n += m_slots[ii].hits;
+		}
+		for(size_t ii=0; ii<m_batch.size(); ii++)
+			n += m_batch[ii].second;
+		return n;
+	};
+
+private:
+	struct Slot
+	{
+		Key key;
+		T value;
+		int hits;	//hits since the key entered the front
+		bool used;
+	};
+
+	Buffer& m_shared;
+	std::array<Slot, N> m_slots;
+	std::vector<std::pair<Key, int>> m_batch;
+	size_t m_period;
+	size_t m_ops;
+	unordered_buffer_wyrand m_rng;
+	typename Buffer::hasher m_hasher;
+
+	/**
+	 * @brief Front bucket of a key. The hash is mixed so front buckets
+	 * don't line up with the shared buffer's.
+	 */
+	Slot& slot(const Key& key)
+	{
+		return m_slots[unordered_buffer_mix(m_hasher(key),
+				0x8ebc6af09c88c6e3ULL)%N];
+	};
+
+	/**
+	 * @brief Replace an occupant with probability 2^-hits
+	 */
+	bool roll(int hits)
+	{
+		if(hits >= 64)
+			return false;
+		return (m_rng() & ((1ULL << hits) - 1)) == 0;
+	};
+
+	/**
+	 * @brief Empty a slot, queueing its hits for the next flush
+	 */
+	void retire(Slot& s)
+	{
+		if(s.hits > 0)
+			m_batch.push_back(std::make_pair(s.key, s.hits));
+		s.used = false;
+	};
+};
+
+#endif //THREAD_LOCAL_FRONT_H
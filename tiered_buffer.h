@@ -0,0 +1,394 @@
+#ifndef TIERED_BUFFER_H
+#define TIERED_BUFFER_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <stdexcept>
+#include <type_traits>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "unordered_buffer.h"
+
+/**
+ * @brief Log structured key/value store in a local file, with the index kept
+ * in memory. Every put appends a fixed size record (key, live flag, value),
+ * erase appends a tombstone, and the latest record for a key wins. Opening
+ * an existing file replays it to rebuild the index, a torn record at the
+ * end is ignored. Dead records are dropped by compact(), which runs
+ * automatically once they outnumber the live ones.
+ *
+ * Keys and values are written as raw bytes, so both have to be trivially
+ * copyable.
+ *
+ * @tparam Key	Key type
+ * @tparam T	Value Type
+ * @tparam Hash	Hash class for the index
+ */
+template <class Key, class T, class Hash = std::hash<Key>>
+class log_store
+{
+	static_assert(std::is_trivially_copyable<Key>::value &&
+			std::is_trivially_copyable<T>::value,
+			"log_store writes raw bytes, Key and T must be trivially copyable");
+
+public:
+	/**
+	 * @brief Open (or create) a store.
+	 *
+	 * @param path	File to keep the records in
+	 */
+	log_store(const std::string& path) : m_path(path), m_fd(-1), m_end(0),
+		m_dead(0)
+	{
+		open_file();
+	};
+
+	~log_store()
+	{
+		if(m_fd >= 0)
+			close(m_fd);
+	};
+
+	log_store(const log_store&) = delete;
+	log_store& operator=(const log_store&) = delete;
+
+	/**
+	 * @brief Store a key/value pair, replacing any earlier value.
+	 *
+	 * @param key
+	 * @param value
+	 */
+	void put(const Key& key, const T& value)
+	{
+		auto it = m_index.find(key);
+		if(it != m_index.end())
+			m_dead++;
+		m_index[key] = append(key, &value);
+		maybe_compact();
+	};
+
+	/**
+	 * @brief Look up a key.
+	 *
+	 * @param key	Key to look for
+	 * @param value	Output, set if the key is found
+	 *
+	 * @return 		true if the key is in the store
+	 */
+	bool get(const Key& key, T& value) const
+	{
+		auto it = m_index.find(key);
+		if(it == m_index.end())
+			return false;
+
+		read(it->second + sizeof(Key) + 1, &value, sizeof(T));
+		return true;
+	};
+
+	/**
+	 * @brief Remove a key.
+	 *
+	 * @param key	Key to remove
+	 *
+	 * @return 		1 if the key was in the store, 0 otherwise
+	 */
+	size_t erase(const Key& key)
+	{
+		auto it = m_index.find(key);
+		if(it == m_index.end())
+			return 0;
+
+		m_index.erase(it);
+		append(key, NULL);
+		m_dead += 2;
+		maybe_compact();
+		return 1;
+	};
+
+	/**
+	 * @brief Number of live keys.
+	 *
+	 * @return number of keys
+	 */
+	size_t size() const
+	{
+		return m_index.size();
+	};
+
+	/**
+	 * @brief Size of the log file, including dead records.
+	 *
+	 * @return bytes
+	 */
+	size_t file_bytes() const
+	{
+		return m_end;
+	};
+
+	/**
+	 * @brief Rewrite the file with only the live records.
+	 */
+	void compact()
+	{
+		std::string tmp = m_path + ".compact";
+		unlink(tmp.c_str());
+		log_store fresh(tmp);
+		fresh.m_index.reserve(m_index.size());
+
+		T value;
+		for(auto it=m_index.begin(); it!=m_index.end(); it++) {
+			read(it->second + sizeof(Key) + 1, &value, sizeof(T));
+			fresh.m_index[it->first] = fresh.append(it->first, &value);
+		}
+		if(fsync(fresh.m_fd) != 0 || rename(tmp.c_str(), m_path.c_str()) != 0)
+			fail("compact");
+
+		std::swap(m_fd, fresh.m_fd);
+		std::swap(m_index, fresh.m_index);
+		m_end = fresh.m_end;
+		m_dead = 0;
+	};
+
+private:
+	static const size_t RECORD = sizeof(Key) + 1 + sizeof(T);
+
+	std::string m_path;
+	int m_fd;
+	uint64_t m_end;
+	size_t m_dead;
+	std::unordered_map<Key, uint64_t, Hash> m_index;
+
+	void fail(const char* what) const
+	{
+		throw std::runtime_error(std::string("log_store ") + what + " " +
+				m_path + ": " + strerror(errno));
+	};
+
+	void open_file()
+	{
+		m_fd = open(m_path.c_str(), O_RDWR | O_CREAT, 0644);
+		if(m_fd < 0)
+			fail("open");
+
+		struct stat st;
+		if(fstat(m_fd, &st) != 0)
+			fail("stat");
+
+		// replay the log, ignoring a partially written last record
+		m_end = (st.st_size/RECORD)*RECORD;
+		std::vector<char> rec(RECORD);
+		for(uint64_t off=0; off<m_end; off+=RECORD) {
+			read(off, rec.data(), RECORD);
+			Key key;
+			memcpy(&key, rec.data(), sizeof(Key));
+			auto it = m_index.find(key);
+			if(it != m_index.end()) {
+				m_index.erase(it);
+				m_dead++;
+			}
+			if(rec[sizeof(Key)])
+				m_index[key] = off;
+			else
+				m_dead++;
+		}
+	};
+
+	/**
+	 * @brief Append a record, a NULL value writes a tombstone.
+	 *
+	 * @return offset of the record
+	 */
+	uint64_t append(const Key& key, const T* value)
+	{
+		char rec[RECORD];
+		memset(rec, 0, RECORD);
+		memcpy(rec, &key, sizeof(Key));
+		if(value) {
+			rec[sizeof(Key)] = 1;
+			memcpy(rec + sizeof(Key) + 1, value, sizeof(T));
+		}
+
+		if(pwrite(m_fd, rec, RECORD, m_end) != (ssize_t)RECORD)
+			fail("write");
+
+		uint64_t off = m_end;
+		m_end += RECORD;
+		return off;
+	};
+
+	void read(uint64_t off, void* out, size_t n) const
+	{
+		if(pread(m_fd, out, n, off) != (ssize_t)n)
+			fail("read");
+	};
+
+	void maybe_compact()
+	{
+		if(m_dead > 1024 && m_dead > m_index.size())
+			compact();
+	};
+};
+
+/**
+ * @brief Two tier cache: an unordered_buffer in memory in front of a larger
+ * log_store on disk. Elements displaced from the buffer (lost rolls,
+ * evictions to make room, erase) are written to the store through the
+ * buffer's on_evict hook, and lookups that miss in memory fall through to
+ * the store, promoting what they find back into the buffer.
+ *
+ * The disk tier is inclusive: a promoted element keeps its record until it
+ * is evicted again (which appends the current value), changed by put (which
+ * drops the record, memory then holds the only copy) or erased. flush(), 
+ * which the destructor calls, writes the elements held in memory to disk so
+ * that reopening the file sees the latest values.
+ *
+ * @tparam Key	Key type, trivially copyable
+ * @tparam T	Value Type, trivially copyable
+ * @tparam Hash	Hash class
+ */
+template <class Key, class T, class Hash = std::hash<Key>>
+class tiered_buffer
+{
+public:
+	/**
+	 * @brief Constructor
+	 *
+	 * @param path	File for the disk tier, existing contents are kept
+	 * @param size	Number of buckets of the in memory buffer
+	 */
+	tiered_buffer(const std::string& path, size_t size = 1024)
+		: m_ram(size), m_disk(path), m_erasing(false)
+	{
+		m_ram.on_evict([this](const Key& key, const T& value, int priority) {
+			(void)(priority);
+			if(!m_erasing)
+				m_disk.put(key, value);
+		});
+	};
+
+	/**
+	 * @brief Destructor, writes the elements held in memory to disk. Errors
+	 * are swallowed, call flush() first to see them.
+	 */
+	~tiered_buffer()
+	{
+		try {
+			flush();
+		} catch(std::exception&) {
+		}
+	};
+
+	tiered_buffer(const tiered_buffer&) = delete;
+	tiered_buffer& operator=(const tiered_buffer&) = delete;
+
+	/**
+	 * @brief Look up a key in memory, then on disk. A hit in memory counts
+	 * towards the key's priority, a hit on disk tries to promote the key
+	 * back into memory.
+	 *
+	 * @param key	Key to look for
+	 * @param value	Output, set if the key is found
+	 *
+	 * @return 		true if the key was found in either tier
+	 */
+	bool get(const Key& key, T& value)
+	{
+		auto it = m_ram.find(key);
+		if(it != m_ram.end()) {
+			value = it->second;
+			m_ram.insert(std::make_pair(key, value));
+			return true;
+		}
+
+		if(!m_disk.get(key, value))
+			return false;
+
+		m_ram.insert(std::make_pair(key, value));
+		return true;
+	};
+
+	/**
+	 * @brief Store a value. It goes into memory if the key wins its roll (or
+	 * is already there) and straight to disk otherwise. A value kept in
+	 * memory drops the key's older record on disk.
+	 *
+	 * @param key
+	 * @param value
+	 */
+	void put(const Key& key, const T& value)
+	{
+		auto ret = m_ram.insert(std::make_pair(key, value));
+		if(!ret.second) {
+			if(ret.first == m_ram.end() || ret.first->first != key) {
+				m_disk.put(key, value);
+				return;
+			}
+			ret.first->second = value;
+		}
+		m_disk.erase(key);
+	};
+
+	/**
+	 * @brief Remove a key from both tiers.
+	 *
+	 * @param key	Key to remove
+	 *
+	 * @return 		1 if the key was found, 0 otherwise
+	 */
+	size_t erase(const Key& key)
+	{
+		// the erased element must not be spilled to disk on its way out
+		m_erasing = true;
+		size_t n = m_ram.erase(key);
+		m_erasing = false;
+		return m_disk.erase(key) || n;
+	};
+
+	/**
+	 * @brief Write the elements held in memory to disk, skipping those whose
+	 * record already has the same value. They stay in memory.
+	 */
+	void flush()
+	{
+		T old;
+		for(auto it=m_ram.cbegin(); it!=m_ram.cend(); it++) {
+			// iteration still shows expired elements, lookups don't
+			if(!m_ram.count(it->first))
+				continue;
+			if(m_disk.get(it->first, old) &&
+					memcmp(&old, &it->second, sizeof(T)) == 0)
+				continue;
+			m_disk.put(it->first, it->second);
+		}
+	};
+
+	/**
+	 * @brief The in memory tier
+	 */
+	unordered_buffer<Key, T, Hash>& ram()
+	{
+		return m_ram;
+	};
+
+	/**
+	 * @brief The disk tier
+	 */
+	log_store<Key, T, Hash>& disk()
+	{
+		return m_disk;
+	};
+
+private:
+	unordered_buffer<Key, T, Hash> m_ram;
+	log_store<Key, T, Hash> m_disk;
+	bool m_erasing;
+};
+
+#endif //TIERED_BUFFER_H
@@ -0,0 +1,70 @@
+#include <utility>
+#include <iostream>
+#include <cstdio>
+#include "tiered_buffer.h"
+
+using std::cerr;
+using std::endl;
+
+int main()
+{
+	const int NKEYS = 20000;
+	const char* PATH = "tiered_buffer_test.log";
+	remove(PATH);
+	int updated = -1;
+
+	// far more keys than buckets, everything displaced must end up on disk
+	{
+		tiered_buffer<int, double> tiers(PATH, 1000);
+		for(int ii=0; ii<NKEYS; ii++)
+			tiers.put(ii, ii*.5);
+
+		double value = 0;
+		for(int ii=0; ii<NKEYS; ii++) {
+			if(!tiers.get(ii, value) || value != ii*.5) {
+				cerr << "Lost key " << ii << endl;
+				return 1;
+			}
+		}
+		cerr << "In memory: " << tiers.ram().size() << " on disk: " 
+			<< tiers.disk().size() << endl;
+
+		for(int ii=0; ii<NKEYS; ii+=2)
+			tiers.erase(ii);
+		size_t written = tiers.disk().file_bytes();
+		tiers.erase(1001);
+		size_t tombstone = tiers.disk().file_bytes() - written;
+		if(tiers.get(0, value) || !tiers.get(1, value) || 
+				tombstone > sizeof(int) + 1 + sizeof(double)) {
+			cerr << "Erase failed or wrote more than a tombstone" << endl;
+			return 1;
+		}
+
+		// update a key held in memory, only the flush on destruction
+		// writes the new value
+		for(auto it=tiers.ram().begin(); it!=tiers.ram().end(); ++it) {
+			if(it->first != 1) {
+				updated = it->first;
+				break;
+			}
+		}
+		tiers.put(updated, -1.);
+	}
+
+	// reopening replays the log
+	log_store<int, double> store(PATH);
+	double value = 0;
+	double fresh = 0;
+	if(store.get(0, value) || !store.get(1, value) || value != .5 ||
+			updated < 0 || !store.get(updated, fresh) || fresh != -1.) {
+		cerr << "Bad store after reopen" << endl;
+		return 1;
+	}
+	size_t before = store.file_bytes();
+	store.compact();
+	cerr << "Reopened: " << store.size() << " keys, compacted " << before 
+		<< " to " << store.file_bytes() << " bytes" << endl;
+
+	remove(PATH);
+	return 0;
+}
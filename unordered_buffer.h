@@ -7,7 +7,148 @@
 #include <list>
 #include <tuple>
 #include <ctime>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+#include <memory>
+#include <cstring>
+#include <type_traits>
+#include <thread>
 
+/**
+ * @brief Seeded 64-bit finalizer (the rrmxmx avalanche from xxh3) applied to
+ * the output of the user supplied hash. Identity hashes such as
+ * std::hash<int> map sequential or strided keys straight through the bucket
+ * modulus, this spreads every input bit across the whole word first.
+ *
+ * @param h		Hash value to mix
+ * @param seed	Per-buffer seed
+ *
+ * @return 		Mixed hash value
+ */
+inline uint64_t unordered_buffer_mix(uint64_t h, uint64_t seed)
+{
+	h ^= seed;
+	h ^= ((h << 49) | (h >> 15)) ^ ((h << 24) | (h >> 40));
+	h *= 0x9FB21C651E98DF25ULL;
+	h ^= (h >> 35) + 8;
+	h *= 0x9FB21C651E98DF25ULL;
+	return h ^ (h >> 28);
+}
+
+/**
+ * @brief Hash a byte string into one or two independent 64-bit lanes. Each
+ * lane runs its own multiply/rotate round over every 8 byte word (the two
+ * rounds are independent, so they overlap), the tail is zero padded and the
+ * length is mixed into the final avalanche. Not meant to resist deliberately
+ * colliding inputs.
+ *
+ * @param data	Bytes to hash
+ * @param len	Number of bytes
+ * @param out	Output, lanes hashes
+ * @param lanes	1 or 2
+ */
+inline void unordered_buffer_hash_bytes(const void* data, size_t len,
+		uint64_t out[2], int lanes)
+{
+	const uint64_t P1 = 0x9e3779b185ebca87ULL, P2 = 0xc2b2ae3d27d4eb4fULL;
+	const uint64_t P3 = 0x165667b19e3779f9ULL, P4 = 0xd6e8feb86659fd93ULL;
+	const unsigned char* p = (const unsigned char*)data;
+	uint64_t a = 0x243f6a8885a308d3ULL, b = 0x13198a2e03707344ULL;
+
+	auto rotl = [](uint64_t x, int r) { return (x << r) | (x >> (64-r)); };
+	auto round = [&](uint64_t w) {
+		a = rotl(a + w*P2, 31)*P1;
+		if(lanes > 1)
+			b = rotl(b + w*P4, 27)*P3;
+	};
+
+	size_t ii = 0;
+	for(; ii+8<=len; ii+=8) {
+		uint64_t w;
+		memcpy(&w, p+ii, 8);
+		round(w);
+	}
+	if(ii < len) {
+		uint64_t w = 0;
+		memcpy(&w, p+ii, len-ii);
+		round(w);
+	}
+
+	out[0] = unordered_buffer_mix(a, len);
+	out[1] = lanes > 1 ? unordered_buffer_mix(b, ~(uint64_t)len) : 0;
+}
+
+/**
+ * @brief Default seed for a buffer's random number generator. Mixes the
+ * address of the buffer, a high resolution clock and a process wide counter
+ * so buffers built at the same time (or reusing the same address) still get
+ * different streams. Call seed() for reproducible runs.
+ *
+ * @param addr	Address of the object being seeded
+ *
+ * @return 		Seed value
+ */
+inline uint64_t unordered_buffer_entropy(const void* addr)
+{
+	static std::atomic<uint64_t> counter(0);
+	uint64_t t = (uint64_t)std::chrono::high_resolution_clock::now()
+		.time_since_epoch().count();
+	return unordered_buffer_mix(t ^ (uint64_t)(uintptr_t)addr, 
+			counter.fetch_add(1, std::memory_order_relaxed));
+}
+
+/**
+ * @brief Small, fast generator (wyrand) that satisfies the standard's
+ * UniformRandomBitGenerator requirements. A Weyl sequence folded through
+ * one 64x64->128 bit multiply (the two halves xored): one add, one xor and
+ * one wide multiply per number, a cheaper alternative to 
+ * std::default_random_engine for the replacement rolls.
+ */
+class unordered_buffer_wyrand
+{
+public:
+	typedef uint64_t result_type;
+
+	/**
+	 * @brief Constructor
+	 *
+	 * @param s	Initial seed
+	 */
+	explicit unordered_buffer_wyrand(uint64_t s = 0) : m_state(s) {};
+
+	/**
+	 * @brief Restart the sequence from the given seed.
+	 *
+	 * @param s	Seed
+	 */
+	void seed(uint64_t s)
+	{
+		m_state = s;
+	};
+
+	/**
+	 * @brief Next number in the sequence.
+	 *
+	 * @return uniformly distributed 64 bit value
+	 */
+	uint64_t operator()()
+	{
+		m_state += 0xa0761d6478bd642fULL;
+		unsigned __int128 m = (unsigned __int128)m_state * 
+			(m_state ^ 0xe7037ed1a0b428dbULL);
+		return (uint64_t)(m >> 64) ^ (uint64_t)m;
+	};
+
+	static constexpr uint64_t min() { return 0; };
+	static constexpr uint64_t max() { return UINT64_MAX; };
+
+private:
+	uint64_t m_state;
+};
 
 /**
  * @brief Class which is used to store a buffer of values that don't have a 
@@ -24,8 +165,12 @@
  * @tparam Key	Key type
  * @tparam T	Value Type
  * @tparam Hash	Hash class
+ * @tparam RNG	Random number generator used for replacement rolls, must
+ * 				provide seed(). Defaults to a seed mixing the buffer address 
+ * 				and time, use seed() to make a run reproducible.
  */
-template <class Key, class T, class Hash = std::hash<Key>>
+template <class Key, class T, class Hash = std::hash<Key>, 
+		 class RNG = std::default_random_engine>
 class unordered_buffer
 {
 public:
@@ -42,25 +187,141 @@ private:
 	struct Element
 	{
 		int priority;
+		bool pinned;	//never replaced or evicted, see pin()
 		iterator pos; 	//position in used list
 		std::pair<Key, T> value;			//actual values
+		size_t weight;	//weigher's value at admission, 0 without a weigher
+		uint32_t expiry;	//tick at which the element expires, 0 = never
+	};
+
+	// slot in the ghost table, tag 0 marks an empty slot
+	struct Ghost
+	{
+		uint16_t tag;
+		uint8_t count;
 	};
 
 	// big array of the data, 0 = priority, 1 = key, 2 = data
-	// keeps the priority, 0 indicates unused
-	std::vector<Element> m_data;
-	std::list<Element*> m_used;
+	// keeps the priority, 0 indicates unused. The used list holds the
+	// occupied elements, newest first.
+	struct Table
+	{
+		std::vector<Element> data;
+		std::list<Element*> used;
+
+		// buckets being migrated into data by an incremental resize, those
+		// below moved are done. Their elements stay on the used list.
+		std::vector<Element> old;
+		size_t moved = 0;
+
+		// buffers holding the table, see share() and drop_table()
+		std::atomic<long> owners{1};
+	};
 
-	// it = m_used.begin();
-	// *it is a pair
-	// it->first
+	// shared between copies in copy_on_write mode, unshare() before writing
+	std::shared_ptr<Table> m_table;
+	bool m_cow = false;
 
-	std::default_random_engine m_rng;
+	RNG m_rng;
 	std::uniform_real_distribution<double> m_rdist;
 	const Hash m_hasher;
 
+	// optional seeded mixing of m_hasher's output, off by default
+	bool m_mixhash = false;
+	uint64_t m_seed = 0;
+
+	// optional two candidate buckets per key
+	bool m_twochoice = false;
+
+	// pinned elements and the most buckets that may be pinned, as a fraction
+	size_t m_pins = 0;
+	double m_pinlimit = 0.1;
+
+	// optional victim stash, fully associative, m_stashtags holds the key
+	// hashes (0 = empty) so a lookup is a single linear scan
+	std::vector<Element> m_stash;
+	std::vector<uint64_t> m_stashtags;
+	size_t m_stashnext = 0;
+
+	// optional ghost history of keys that lost their roll
+	std::vector<Ghost> m_ghosts;
+	size_t m_ghostlost = 0;
+	const size_t GHOST_AGING = 8;
+
+	// optional byte budget, sum of element weights is kept in m_bytes
+	std::function<size_t(const Key&, const T&)> m_weigher;
+	size_t m_bytes = 0;
+	size_t m_maxbytes = SIZE_MAX;
+
+	// optional expiry, m_now is the current tick as set by tick()
+	uint32_t m_now = 0;
+	uint32_t m_ttl = 0;
+	size_t m_sweep = 0;
+
+	// called with every element that leaves the buffer
+	std::function<void(const Key&, const T&, int)> m_onevict;
+
+	// returned by [] when the key could not be admitted at all
+	T m_detached;
+
+	// number of occupied buckets looked at when picking a victim to make room
+	const int EVICT_SAMPLES = 5;
+
 	const int MAX_PRIORITY = 1000;
 
+	// optional automatic resizing, counters cover the current window
+	struct Tuning
+	{
+		bool enabled = false;
+		double grow = 0.05;			// conflict rate that triggers growth
+		double shrink = 0.25;		// occupancy below which to shrink
+		size_t maxmemory = SIZE_MAX;
+		size_t ops = 0;
+		size_t hits = 0;
+		size_t conflicts = 0;
+		double conflictrate = 0;	// rates of the last full window
+		double hitrate = 0;
+		double grownfrom = -1;		// hit rate before the last growth
+		size_t lowwindows = 0;
+		size_t holdoff = 0;
+	};
+	Tuning m_tune;
+
+	// optional miss ratio curve estimation: miniature copies of the
+	// replacement policy at other sizes, fed with a hash sample of the keys
+	struct Shadow
+	{
+		double scale = 1;				// size relative to bucket_count()
+		std::vector<uint64_t> tags;		// key hash, 0 = empty
+		std::vector<uint16_t> priority;
+		size_t refs = 0;
+		size_t hits = 0;
+	};
+	struct Sampling
+	{
+		double requested = 0;			// 0 = off
+		double rate = 0;				// after raising it for small tables
+		uint64_t threshold = 0;
+		size_t seen = 0;				// references, sampled or not
+		std::vector<Shadow> shadows;
+		unordered_buffer_wyrand rng;
+	};
+	Sampling m_mrc;
+
+	// smallest shadow table, below this the sampling rate is raised
+	const size_t MIN_SHADOW = 64;
+
+	// operations per tuning window (at least), windows of low occupancy
+	// before shrinking, windows without growth after a useless one
+	const size_t TUNE_WINDOW = 1024;
+	const size_t TUNE_LOW = 4;
+	const size_t TUNE_HOLDOFF = 16;
+	const size_t MIN_BUCKETS = 16;
+
+	// old buckets migrated per insert while auto_resize is resizing, enough
+	// to finish a halving well within the next window
+	const size_t MIGRATE_STEP = 4;
+
 /******************************************************************************
  *
  * Functions 
@@ -102,7 +363,7 @@ public:
 		 * @return 
 		 */
 		std::pair<Key,T>& operator*(){
-			return (*it).value;
+			return (*it)->value;
 		};
 		
 		/**
@@ -126,7 +387,7 @@ public:
 		 *
 		 * @return Key/value pair
 		 */
-		std::pair<Key,T> operator++(int unused){
+		iterator operator++(int unused){
 			(void)(unused);
 			iterator tmp = *this;
 			++*this;
@@ -139,7 +400,7 @@ public:
 		 *
 		 * @return Key/value pair
 		 */
-		std::pair<Key,T>& operator++(){
+		iterator& operator++(){
 			it++;
 			return *this;
 		};
@@ -152,7 +413,7 @@ public:
 		 *
 		 * @return Key/value pair
 		 */
-		std::pair<Key,T> operator--(int unused){
+		iterator operator--(int unused){
 			(void)(unused);
 			iterator tmp = *this;
 			--*this;
@@ -164,13 +425,24 @@ public:
 		 *
 		 * @return Key/value pair
 		 */
-		std::pair<Key,T>& operator--(){
+		iterator& operator--(){
 			it--;
 			return *this;
 		};
 
+		/**
+		 * @brief Whether two iterators point to the same element
+		 */
+		bool operator==(const iterator& other) const {
+			return it == other.it;
+		};
+
+		bool operator!=(const iterator& other) const {
+			return it != other.it;
+		};
+
 	private:
-		friend class unordered_buffer<Key,T,Hash>;
+		friend class unordered_buffer<Key,T,Hash,RNG>;
 
 		typename std::list<Element*>::iterator it;
 	};
@@ -211,7 +483,7 @@ public:
 		 * @return 
 		 */
 		const std::pair<Key,T>& operator*() const {
-			return (*it).value;
+			return (*it)->value;
 		};
 		
 		/**
@@ -220,8 +492,8 @@ public:
 		 *
 		 * @return 
 		 */
-		const std::pair<Key,T>* operator->(){
-			return &(*(*it));
+		const std::pair<Key,T>* operator->() const {
+			return &((*it)->value);
 		};
 		
 		////////////////////////
@@ -235,9 +507,9 @@ public:
 		 *
 		 * @return Key/Value Pair
 		 */
-		std::pair<Key,T> operator++(int unused){
+		const_iterator operator++(int unused){
 			(void)(unused);
-			iterator tmp = *this;
+			const_iterator tmp = *this;
 			++*this;
 			return tmp;
 		};
@@ -248,7 +520,7 @@ public:
 		 *
 		 * @return Key/Value Pair
 		 */
-		const std::pair<Key,T>& operator++(){
+		const_iterator& operator++(){
 			it++;
 			return *this;
 		};
@@ -261,9 +533,9 @@ public:
 		 *
 		 * @return Key/Value Pair
 		 */
-		std::pair<Key,T> operator--(int unused){
+		const_iterator operator--(int unused){
 			(void)(unused);
-			iterator tmp = *this;
+			const_iterator tmp = *this;
 			--*this;
 			return tmp;
 		};
@@ -273,13 +545,24 @@ public:
 		 *
 		 * @return Key/Value Pair
 		 */
-		const std::pair<Key,T>& operator--(){
+		const_iterator& operator--(){
 			--it;
 			return *this;
 		};
 
+		/**
+		 * @brief Whether two iterators point to the same element
+		 */
+		bool operator==(const const_iterator& other) const {
+			return it == other.it;
+		};
+
+		bool operator!=(const const_iterator& other) const {
+			return it != other.it;
+		};
+
 	private:
-		friend class unordered_buffer<Key,T,Hash>;
+		friend class unordered_buffer<Key,T,Hash,RNG>;
 		
 		typename std::list<Element*>::const_iterator it;
 	};
@@ -292,8 +575,9 @@ public:
 	 */
 	iterator begin()
 	{
+		unshare();
 		iterator tmp;
-		tmp.it = m_used.begin();
+		tmp.it = m_table->used.begin();
 		return tmp;
 	};
 	
@@ -305,21 +589,23 @@ public:
 	 */
 	iterator end()
 	{
+		unshare();
 		iterator tmp;
-		tmp.it = m_used.end();
+		tmp.it = m_table->used.end();
 		return tmp; 
 	};
 	
 
 	/**
-	 * @brief Get the const_iterator at the beginning.
+	 * @brief Get the const_iterator at the beginning. Reading never unshares
+	 * a copy_on_write table.
 	 *
 	 * @return 
 	 */
-	const_iterator cbegin()
+	const_iterator cbegin() const
 	{
 		const_iterator tmp;
-		tmp.it = m_used.cbegin();
+		tmp.it = m_table->used.cbegin();
 		return tmp;
 	};
 	
@@ -328,13 +614,33 @@ public:
 	 *
 	 * @return 
 	 */
-	const_iterator cend()
+	const_iterator cend() const
 	{
 		const_iterator tmp;
-		tmp.it = m_used.cend();
+		tmp.it = m_table->used.cend();
 		return tmp;
 	};
 
+	/**
+	 * @brief Get begin const_iterator of a const buffer
+	 *
+	 * @return 
+	 */
+	const_iterator begin() const
+	{
+		return cbegin();
+	};
+
+	/**
+	 * @brief Get end const_iterator of a const buffer
+	 *
+	 * @return 
+	 */
+	const_iterator end() const
+	{
+		return cend();
+	};
+
 	/**************************************************************************
 	 * Constructors
 	**************************************************************************/
@@ -346,16 +652,18 @@ public:
 	 * @param size	The number of bins for the hash table, this stays constant
 	 * 				unless resize is called.
 	 */
-	unordered_buffer(size_t size = 1024) : m_rng(time(NULL)), m_rdist(0,1), m_hasher()
+	unordered_buffer(size_t size = 1024) 
+		: m_table(std::make_shared<Table>()), 
+		m_rng(unordered_buffer_entropy(this)), m_rdist(0,1), m_hasher()
 	{
-		m_data.resize(size);
+		m_table->data.resize(size);
 
 		// set used variable to false
-		for(size_t ii=0; ii<m_data.size(); ii++) {
-			m_data[ii].priority = 0;
+		for(size_t ii=0; ii<m_table->data.size(); ii++) {
+			m_table->data[ii].priority = 0;
 		}
 
-		m_used.clear();
+		m_table->used.clear();
 	};
 
 
@@ -370,16 +678,17 @@ public:
 	 */
 	template<class InputIterator>
 	unordered_buffer(InputIterator first, InputIterator last, size_t size=1024) 
-		: m_rng(time(NULL)), m_rdist(0,1), m_hasher()
+		: m_table(std::make_shared<Table>()), 
+		m_rng(unordered_buffer_entropy(this)), m_rdist(0,1), m_hasher()
 	{
-		m_data.resize(size);
+		m_table->data.resize(size);
 
 		// set used variable to false
-		for(size_t ii=0; ii<m_data.size(); ii++) {
-			m_data[ii].priority = 0;
+		for(size_t ii=0; ii<m_table->data.size(); ii++) {
+			m_table->data[ii].priority = 0;
 		}
 
-		m_used.clear();
+		m_table->used.clear();
 		
 		// now emplace the data
 		for(auto it=first; it!=last; it++) {
@@ -397,16 +706,17 @@ public:
 	 * @param size	Size of underlying hash table (number of bins)
 	 */
 	unordered_buffer(std::initializer_list<std::pair<Key,T>> il, size_t size=1024) 
-		: m_rng(time(NULL)), m_rdist(0,1), m_hasher()
+		: m_table(std::make_shared<Table>()), 
+		m_rng(unordered_buffer_entropy(this)), m_rdist(0,1), m_hasher()
 	{
-		m_data.resize(size);
+		m_table->data.resize(size);
 
 		// set used variable to false
-		for(size_t ii=0; ii<m_data.size(); ii++) {
-			m_data[ii].priority = 0;
+		for(size_t ii=0; ii<m_table->data.size(); ii++) {
+			m_table->data[ii].priority = 0;
 		}
 
-		m_used.clear();
+		m_table->used.clear();
 		
 		// now emplace the data
 		for(auto it=il.begin(); it!=il.end(); it++) {
@@ -416,26 +726,69 @@ public:
 	
 
 	/**
-	 * @brief Copy constructor,
+	 * @brief Copy constructor. The table is copied and the used list rebuilt
+	 * to point into the copy, with a single memcpy of the table when Key and
+	 * T are trivially copyable. In copy_on_write mode the table is shared
+	 * instead, until either buffer writes to it.
 	 *
 	 * @param ump	Other buffer to copy
 	 */
-	unordered_buffer(const unordered_buffer& ump) : m_rng(time(NULL)), m_rdist(0,1), m_hasher()
+	unordered_buffer(const unordered_buffer& ump) 
+		: m_rng(unordered_buffer_entropy(this)), m_rdist(0,1), m_hasher()
 	{
-		m_data = ump.m_data;
-		m_used = ump.m_used;
+		m_mixhash = ump.m_mixhash;
+		m_seed = ump.m_seed;
+		m_twochoice = ump.m_twochoice;
+		m_pins = ump.m_pins;
+		m_pinlimit = ump.m_pinlimit;
+		m_stash = ump.m_stash;
+		m_stashtags = ump.m_stashtags;
+		m_stashnext = ump.m_stashnext;
+		m_ghosts = ump.m_ghosts;
+		m_ghostlost = ump.m_ghostlost;
+		m_weigher = ump.m_weigher;
+		m_onevict = ump.m_onevict;
+		m_bytes = ump.m_bytes;
+		m_maxbytes = ump.m_maxbytes;
+		m_now = ump.m_now;
+		m_ttl = ump.m_ttl;
+		m_tune = ump.m_tune;
+		m_mrc = ump.m_mrc;
+		m_cow = ump.m_cow;
+		m_table = m_cow ? share(ump.m_table) : copy_table(*ump.m_table);
 	};
 	
 
 	/**
 	 * @brief Move constructor, old value will be left in inderminant state.
+	 * The random number generator state moves along with the data.
 	 *
 	 * @param ump	Other buffer to move from (will be left un-useable)
 	 */
-	unordered_buffer(unordered_buffer&& ump) : m_rng(time(NULL)), m_rdist(0,1), m_hasher()
+	unordered_buffer(unordered_buffer&& ump) 
+		: m_rng(std::move(ump.m_rng)), m_rdist(0,1), m_hasher()
 	{
-		m_data = std::move(ump.m_data);
-		m_used = std::move(ump.m_used);
+		m_mixhash = ump.m_mixhash;
+		m_seed = ump.m_seed;
+		m_twochoice = ump.m_twochoice;
+		m_pins = ump.m_pins;
+		m_pinlimit = ump.m_pinlimit;
+		m_stash = std::move(ump.m_stash);
+		m_stashtags = std::move(ump.m_stashtags);
+		m_stashnext = ump.m_stashnext;
+		m_ghosts = std::move(ump.m_ghosts);
+		m_ghostlost = ump.m_ghostlost;
+		m_weigher = std::move(ump.m_weigher);
+		m_onevict = std::move(ump.m_onevict);
+		m_bytes = ump.m_bytes;
+		m_maxbytes = ump.m_maxbytes;
+		m_now = ump.m_now;
+		m_ttl = ump.m_ttl;
+		m_tune = ump.m_tune;
+		m_mrc = ump.m_mrc;
+		m_cow = ump.m_cow;
+		m_table = std::move(ump.m_table);
+		ump.m_table = std::make_shared<Table>();
 	};
 
 
@@ -446,8 +799,27 @@ public:
 	 */
 	void swap(unordered_buffer& ump)
 	{
-		std::swap(ump.m_data, m_data);
-		std::swap(ump.m_used, m_used);
+		std::swap(ump.m_table, m_table);
+		std::swap(ump.m_cow, m_cow);
+		std::swap(ump.m_mixhash, m_mixhash);
+		std::swap(ump.m_seed, m_seed);
+		std::swap(ump.m_twochoice, m_twochoice);
+		std::swap(ump.m_pins, m_pins);
+		std::swap(ump.m_pinlimit, m_pinlimit);
+		std::swap(ump.m_stash, m_stash);
+		std::swap(ump.m_stashtags, m_stashtags);
+		std::swap(ump.m_stashnext, m_stashnext);
+		std::swap(ump.m_ghosts, m_ghosts);
+		std::swap(ump.m_ghostlost, m_ghostlost);
+		std::swap(ump.m_rng, m_rng);
+		std::swap(ump.m_weigher, m_weigher);
+		std::swap(ump.m_onevict, m_onevict);
+		std::swap(ump.m_bytes, m_bytes);
+		std::swap(ump.m_maxbytes, m_maxbytes);
+		std::swap(ump.m_now, m_now);
+		std::swap(ump.m_ttl, m_ttl);
+		std::swap(ump.m_tune, m_tune);
+		std::swap(ump.m_mrc, m_mrc);
 	};
 
 
@@ -460,8 +832,30 @@ public:
 	 */
 	unordered_buffer& operator=(const unordered_buffer& ump)
 	{
-		m_data = ump.m_data;
-		m_used = ump.m_used;
+		m_mixhash = ump.m_mixhash;
+		m_seed = ump.m_seed;
+		m_twochoice = ump.m_twochoice;
+		m_pins = ump.m_pins;
+		m_pinlimit = ump.m_pinlimit;
+		m_stash = ump.m_stash;
+		m_stashtags = ump.m_stashtags;
+		m_stashnext = ump.m_stashnext;
+		m_ghosts = ump.m_ghosts;
+		m_ghostlost = ump.m_ghostlost;
+		m_weigher = ump.m_weigher;
+		m_onevict = ump.m_onevict;
+		m_bytes = ump.m_bytes;
+		m_maxbytes = ump.m_maxbytes;
+		m_now = ump.m_now;
+		m_ttl = ump.m_ttl;
+		m_tune = ump.m_tune;
+		m_mrc = ump.m_mrc;
+		m_cow = ump.m_cow;
+		if(this != &ump) {
+			auto table = m_cow ? share(ump.m_table) : copy_table(*ump.m_table);
+			drop_table();
+			m_table = table;
+		}
 
 		return *this;
 	};
@@ -476,8 +870,29 @@ public:
 	 */
 	unordered_buffer& operator=(unordered_buffer&& ump)
 	{
-		m_data = std::move(ump.m_data);
-		m_used = std::move(ump.m_used);
+		m_rng = std::move(ump.m_rng);
+		m_mixhash = ump.m_mixhash;
+		m_seed = ump.m_seed;
+		m_twochoice = ump.m_twochoice;
+		m_pins = ump.m_pins;
+		m_pinlimit = ump.m_pinlimit;
+		m_stash = std::move(ump.m_stash);
+		m_stashtags = std::move(ump.m_stashtags);
+		m_stashnext = ump.m_stashnext;
+		m_ghosts = std::move(ump.m_ghosts);
+		m_ghostlost = ump.m_ghostlost;
+		m_weigher = std::move(ump.m_weigher);
+		m_onevict = std::move(ump.m_onevict);
+		m_bytes = ump.m_bytes;
+		m_maxbytes = ump.m_maxbytes;
+		m_now = ump.m_now;
+		m_ttl = ump.m_ttl;
+		m_tune = ump.m_tune;
+		m_mrc = ump.m_mrc;
+		m_cow = ump.m_cow;
+		drop_table();
+		m_table = std::move(ump.m_table);
+		ump.m_table = std::make_shared<Table>();
 		return *this;
 	};
 	
@@ -499,7 +914,10 @@ public:
 	};
 
 	// destructor
-	~unordered_buffer() {} ;
+	~unordered_buffer()
+	{
+		drop_table();
+	};
 
 	/**************************************** 
 	 * Const Information Functions 
@@ -512,7 +930,7 @@ public:
 	 */
 	bool empty() const
 	{
-		return m_data.empty();
+		return m_table->data.empty();
 	};
 
 
@@ -525,7 +943,7 @@ public:
 	 */
 	size_t size() const
 	{
-		return m_used.size();
+		return m_table->used.size();
 	};
 
 	
@@ -536,7 +954,7 @@ public:
 	 */
 	size_t max_size() const
 	{
-		return m_data.size();
+		return m_table->data.size();
 	};
 	
 
@@ -547,50 +965,185 @@ public:
 	 */
 	size_t bucket_count() const 
 	{
-		return m_data.size();
+		return m_table->data.size();
+	};
+
+	/**
+	 * @brief Approximate memory used by the buffer: the bucket array, a used
+	 * list node per element and the weight reported by the weigher (if any).
+	 *
+	 * @return bytes
+	 */
+	size_t memory_usage() const
+	{
+		return (m_table->data.capacity() + m_table->old.capacity())*
+			sizeof(Element) + 
+			m_table->used.size()*(sizeof(Element*) + 2*sizeof(void*)) + m_bytes;
 	};
 
 	/**************************************************************************
 	 * Overall Settings/Changes
 	 *************************************************************************/
 
+	/**
+	 * @brief Independent copy of the buffer, e.g. a snapshot for analysis.
+	 * Same as the copy constructor: O(buckets) and memcpy speed for 
+	 * trivially copyable Key and T, or O(1) in copy_on_write mode.
+	 *
+	 * @return Copy of the buffer
+	 */
+	unordered_buffer clone() const
+	{
+		return unordered_buffer(*this);
+	};
+
+	/**
+	 * @brief Make copies share the table until one of them writes to it,
+	 * at which point the writer takes its own copy. Copies of a large buffer
+	 * taken now and then (and mostly read) then cost nothing up front. The
+	 * setting is carried over to copies.
+	 *
+	 * Writing includes anything that could write: insert, emplace, [], 
+	 * erase, the non-const find, begin and end, and the settings that
+	 * rehash. Iterators taken before a copy point into the shared table, so
+	 * a write afterwards invalidates them (as with copy on write strings). A
+	 * buffer and its copies may be used from different threads, as long as
+	 * each buffer is only used by one thread at a time: the table counts
+	 * its owners atomically, and a buffer only writes in place once it has
+	 * seen (with acquire ordering) every other copy let go of the table.
+	 * Turning it off takes a private copy of a shared table, so buffers
+	 * not in this mode never share and skip the count on writes.
+	 *
+	 * @param enable	Whether copies share the table
+	 */
+	void copy_on_write(bool enable)
+	{
+		if(!enable)
+			unshare();
+		m_cow = enable;
+	};
+
+	/**
+	 * @brief Whether copies share the table until written
+	 *
+	 * @return true in copy_on_write mode
+	 */
+	bool copy_on_write() const
+	{
+		return m_cow;
+	};
+
 	/**
 	 * @brief Completely clears the buffer.
 	 */
 	void clear()
 	{
-		m_used.clear();
+		// no point copying a shared table just to empty it
+		if(shared_table()) {
+			size_t N = m_table->data.size();
+			drop_table();
+			m_table = std::make_shared<Table>();
+			m_table->data.resize(N);
+		}
+		m_table->used.clear();
+		std::vector<Element>().swap(m_table->old);
+		m_table->moved = 0;
+		m_bytes = 0;
+
+		for(size_t ii=0; ii<m_stash.size(); ii++) {
+			m_stash[ii].priority = 0;
+			m_stashtags[ii] = 0;
+		}
+
+		ghost_history(m_ghosts.size());
 
 		// set used variable to false
-		for(size_t ii=0; ii<m_data.size(); ii++) {
-			m_data[ii].priority = 0;
+		for(size_t ii=0; ii<m_table->data.size(); ii++) {
+			m_table->data[ii].priority = 0;
+			m_table->data[ii].pinned = false;
 		}
+		m_pins = 0;
 	};
 
 	/**
 	 * @brief Resize the hash table data structure to N buckets, and rehash 
-	 * all the current elements.
+	 * all the current elements. Priorities are carried over, if two elements
+	 * land in the same new bucket the one with more hits is kept. Pinned
+	 * elements are always kept; throws std::length_error (and changes
+	 * nothing) if two of them would need the same bucket.
 	 *
 	 * @param N
 	 */
 	void rehash(size_t N)
 	{
+		if(!pins_fit(N))
+			throw std::length_error("Pinned keys do not fit in the new table");
+
+		unshare();
 		std::vector<Element> newdata(N);
-		std::list<Element*> newused(N);
+		std::list<Element*> newused;
+
+		// set used variable to false
+		for(size_t ii=0; ii<newdata.size(); ii++) {
+			newdata[ii].priority = 0;
+		}
+
+		for(auto it=m_table->used.begin(); it!=m_table->used.end(); it++) {
+			Element* src = *it;
+			if(expired(*src)) {
+				m_bytes -= src->weight;
+				continue;
+			}
 
-		for(auto it=m_used.begin(); it!=m_used.end(); it++) {
-			size_t newbucket = m_hasher(std::get<0>(it->value))%N;
-			newdata[newbucket].priority = it->priority;
-			newdata[newbucket].value = std::move(it->value);
+			// empty candidate if there is one, otherwise the least used. A
+			// pinned element takes the first candidate no other pinned
+			// element holds, as pins_fit() checked
+			size_t b[2];
+			int n = candidates(std::get<0>(src->value), N, b);
+			Element* dst = &newdata[b[0]];
+			for(int ii=1; ii<n; ii++) {
+				Element* alt = &newdata[b[ii]];
+				if(src->pinned ? dst->priority > 0 && dst->pinned : 
+						better(*dst, *alt))
+					dst = alt;
+			}
+
+			if(dst->priority > 0) {
+				// collision in the new table, keep the pinned or more used key
+				if(src->pinned || (!dst->pinned && 
+							dst->priority < src->priority)) {
+					evicted(*dst);
+					m_bytes -= dst->weight;
+					transfer(*dst, *src);
+				} else {
+					evicted(*src);
+					m_bytes -= src->weight;
+				}
+				continue;
+			}
 
-			newused.push_front(&newdata[newbucket]);
-			newdata[newbucket].pos = newused.begin();
+			transfer(*dst, *src);
+			newused.push_back(dst);
+			dst->pos.it = std::prev(newused.end());
 		}
 		
-		m_data = std::move(newdata);
-		m_used = std::move(newused);
-	};
+		m_table->data = std::move(newdata);
+		m_table->used = std::move(newused);
 
+		// the used list covered a resize in progress as well
+		std::vector<Element>().swap(m_table->old);
+		m_table->moved = 0;
+
+		// the hash function may have changed
+		for(size_t ii=0; ii<m_stash.size(); ii++) {
+			if(m_stash[ii].priority > 0)
+				m_stashtags[ii] = stashtag(std::get<0>(m_stash[ii].value));
+		}
+
+		// the curve is relative to the bucket count
+		if(m_mrc.requested > 0)
+			size_shadows();
+	};
 
 	/**
 	 * @brief if N is more than the current number of buckets, then rehash
@@ -600,553 +1153,1005 @@ public:
 	 */
 	void reserve(size_t N)
 	{
-		if(N > m_data.size())
+		if(N > m_table->data.size())
 			rehash(N);
 	};
 
-	/**************************************************************************
-	 * deletions
-	 *************************************************************************/
-	
 	/**
-	 * @brief Erase a bucket from the datastructure
-	 *
-	 * @param pos Position to erase. 
-	 *
-	 * @return Iterator pointing to the next position after the removed one
+	 * @brief Rehash to the smallest table that keeps occupancy at or below
+	 * one half (at least 16 buckets), if that is smaller than the current 
+	 * one. Elements that collide in the smaller table keep the one with more
+	 * hits, as in rehash. Does nothing if the pinned keys would not fit.
 	 */
-	iterator erase(iterator pos)
+	void shrink_to_fit()
 	{
-		(*(pos.it))->priority = 0;
-		pos.it = m_used.erase(pos.it);
-		return pos;
+		size_t N = std::max(MIN_BUCKETS, 2*m_table->used.size());
+		if(N < m_table->data.size() && pins_fit(N))
+			rehash(N);
 	};
-	
+
 	/**
-	 * @brief Erase a range of buckets from the datastructure.
-	 *
-	 * @param first Position of first element to erase
-	 * @param last	Position of one past last element being erased.
+	 * @brief Let the buffer size itself. insert, emplace and [] count hits
+	 * and conflicts (lost rolls and replacements). Each window is at least
+	 * bucket_count() operations. At the end of a window:
+	 *  - if conflicts were more than grow of the operations, the table
+	 *    doubles (if the rehash fits in max_memory()),
+	 *  - a doubling that didn't raise the hit rate by at least 1% is undone
+	 *    and growth is held off for a while (e.g. scans, where no table size
+	 *    helps),
+	 *  - after a few windows with occupancy below shrink the table halves,
+	 *  - over max_memory() the table halves.
+	 * Resizes are incremental: the new table starts empty next to the old
+	 * one, and every insert migrates a few old buckets (the key being
+	 * inserted first), so no single operation pays for the whole table.
+	 * Lookups, erase and iteration see both tables until the migration is
+	 * done, well within the next window. Colliding elements are settled as
+	 * in rehash, so priorities are kept. Both tables count towards
+	 * memory_usage() while they coexist. Pinned keys are moved when the
+	 * resize starts, which costs a pass over the elements if there are any.
 	 *
-	 * @return last
+	 * @param enable	Whether to resize automatically
+	 * @param grow		Conflict rate above which to grow
+	 * @param shrink	Occupancy below which to shrink
 	 */
-	iterator erase(iterator first, iterator last)
+	void auto_resize(bool enable, double grow = 0.05, double shrink = 0.25)
 	{
-		while(first.it != m_used.end() && first.it != last.it) {
-			(*(first.it))->priority = 0;
-			first.it = m_used.erase(first.it);
-		}
-		return first;
+		m_tune.enabled = enable;
+		m_tune.grow = grow;
+		m_tune.shrink = shrink;
+		m_tune.ops = 0;
+		m_tune.hits = 0;
+		m_tune.conflicts = 0;
+		m_tune.grownfrom = -1;
+		m_tune.lowwindows = 0;
+		m_tune.holdoff = 0;
 	};
-	
 
 	/**
-	 * @brief Key-based erase. If a key/value pair matches then erase it. 
+	 * @brief Whether the buffer resizes itself
 	 *
-	 * @param key	Key to find and erase
-	 *
-	 * @return 		1 if erased, 0 otherwise
+	 * @return true if auto_resize is on
 	 */
-	size_t erase(const Key& key)
+	bool auto_resize() const
 	{
-		auto& data = m_data[bucket(key)];
+		return m_tune.enabled;
+	};
 
-		// if not found, just return 0
-		if(data.priority <= 0)
-			return 0;
-		
-		erase(data.pos);
-		return 1;
+	/**
+	 * @brief Limit for memory_usage(), including the old and new tables that
+	 * coexist while rehashing or migrating. auto_resize never grows past
+	 * it, and shrinks the table if the buffer is over it.
+	 *
+	 * @param bytes	Memory limit, SIZE_MAX for none
+	 */
+	void max_memory(size_t bytes)
+	{
+		m_tune.maxmemory = bytes;
 	};
 
+	/**
+	 * @brief Limit for memory_usage() used by auto_resize
+	 *
+	 * @return bytes
+	 */
+	size_t max_memory() const
+	{
+		return m_tune.maxmemory;
+	};
 
-	/**************************************************************************
-	 * insertions, these all trigger change in priority in the case of a hit
-	 *************************************************************************/
+	/**
+	 * @brief Conflicts (lost rolls and replacements) per operation during
+	 * the last full auto_resize window.
+	 *
+	 * @return conflict rate, 0 before the first window
+	 */
+	double conflict_rate() const
+	{
+		return m_tune.conflictrate;
+	};
 
-	//////////////////////
-	// Copy Insert
-	//////////////////////
-	
 	/**
-	 * @brief insert an element probabilistically, makes a copy of the input 
-	 * values if the insertion is successful. The probability of insertion is
-	 * 1 if no collision occurs, and exponentially decays with the number of
-	 * re-uses of the given key. This will also decrease the 'hit' count of
-	 * the given key so that if this value were repeated more than the 
-	 * colliding key, it will eventually replace that one.
+	 * @brief Estimate the miss ratio at other table sizes while running. A
+	 * hash selected fraction of the keys passed to insert, emplace, [] and
+	 * upsert (as in SHARDS) is also fed to a miniature simulation per size:
+	 * a table of scale*rate*bucket_count() buckets with the same priority
+	 * and replacement rules. Because a key is either always or never
+	 * sampled, each miniature sees the full reuse pattern of its keys and
+	 * its miss ratio estimates that of a full table of the same scale.
+	 * Misses are divided by the expected number of sampled references
+	 * (rate times all references) rather than the actual one, which keeps
+	 * a very hot key falling in or out of the sample from skewing the curve.
 	 *
-	 * @param value
+	 * The miniatures model the basic policy (no two_choice, victim stash,
+	 * ghost history, expiry or byte budget) and use 10 bytes per bucket.
+	 * They spread keys evenly over buckets, so with a weak Hash and
+	 * structured keys the estimates only hold with hash_mixing().
+	 * The rate is raised for small tables so that the smallest miniature
+	 * has at least 64 buckets. A rehash (including auto_resize) restarts
+	 * the estimates at the new size.
 	 *
-	 * @return Iterator, insertion occured (bool) pair.
+	 * @param rate		Fraction of keys to sample, 0 to turn sampling off
+	 * @param scales	Table sizes to model, relative to bucket_count()
 	 */
-	std::pair<iterator, bool> insert(const std::pair<Key, T>& value)
+	void mrc_sampling(double rate,
+			const std::vector<double>& scales = {0.25, 0.5, 1, 2, 4})
 	{
+		if(rate > 0 && (scales.empty() ||
+					*std::min_element(scales.begin(), scales.end()) <= 0))
+			throw std::invalid_argument("mrc_sampling needs positive scales");
+
+		m_mrc.shadows.clear();
+		if(rate <= 0) {
+			m_mrc.requested = m_mrc.rate = 0;
+			return;
+		}
 
-		auto& data = m_data[bucket(value.first)];
-
-		/************************************
-		 * Miss
-		 ************************************/
-		// if not yet used, set to used and copy key
-		if(data.priority <= 0) {
-
-			// set bin to used
-			data.priority = 1;
-
-			// copy into bin
-			std::get<0>(data.value) = value.first;
-			std::get<1>(data.value) = value.second;
-
-			// add to list of used bins
-			m_used.push_front(&data);
-			data.pos = m_used.begin();
-			
-			return std::make_pair<iterator, bool>(m_used.begin(), true);
-		} 
-		/************************************
-		 * Hit
-		 ************************************/
-		else if(std::get<0>(data.value) == value.first) {
-			/*
-			 * keys are equal, increase priority
-			 */
-			data.priority++;
-			return std::make_pair<iterator, bool>(data.pos, false);
-		} else {
-			/*
-			 * keys are different, probabilistically replace 
-			 */
-			
-			// the higher the probability, the lower the odds of replacement
-			if(m_rdist(m_rng) < pow(2,-data.priority)) {
-				std::get<0>(data.value) = value.first;
-				std::get<1>(data.value) = value.second;
-				data.priority = 1;
-				
-				// return new 
-				return std::make_pair<iterator, bool>(data.pos, true);
-			} else {
-				// return old
-				return std::make_pair<iterator, bool>(data.pos, false);
-			}
+		for(double scale : scales) {
+			Shadow shadow;
+			shadow.scale = scale;
+			m_mrc.shadows.push_back(shadow);
 		}
+		m_mrc.requested = std::min(rate, 1.);
+		m_mrc.rng.seed(m_seed ^ 0x5851f42d4c957f2dULL);
+		size_shadows();
 	};
-	
+
 	/**
-	 * @brief Insert an element probabilistically, identical to normal insertion,
-	 * hints are not used.
-	 *
-	 * @param hint
-	 * @param value
+	 * @brief Fraction of keys sampled for the miss ratio curve
 	 *
-	 * @return 
+	 * @return 	Effective rate, 0 if sampling is off
 	 */
-	std::pair<iterator, bool> insert(const_iterator hint, 
-			const std::pair<Key, T>& value)
+	double mrc_sampling() const
 	{
-		// ignore the hint
-		(void)(hint);
-		return insert(value);
+		return m_mrc.rate;
 	};
-	
-	////////////////////////////
-	// Move Insert 
-	////////////////////////////
-	
+
 	/**
-	 * @brief Identical to normal emplace, hints are not used.
-	 *
-	 * @param it
-	 * @param key
-	 * @param value
+	 * @brief Estimated miss ratio curve since sampling started or the last
+	 * rehash, see mrc_sampling().
 	 *
-	 * @return 
+	 * @return 	(bucket count, miss ratio) per modelled size, in the order
+	 * 			of the scales given. The miss ratio is 1 until a sampled
+	 * 			key arrives.
 	 */
-	std::pair<iterator, bool> emplace_hint(const_iterator it, Key&& key, T&& value)
+	std::vector<std::pair<size_t, double>> miss_ratio_curve() const
 	{
-		return emplace(key, value);
+		std::vector<std::pair<size_t, double>> curve;
+		for(const Shadow& shadow : m_mrc.shadows) {
+			size_t buckets = (size_t)std::llround(shadow.scale*
+					m_table->data.size());
+			double miss = m_mrc.seen ? std::min(1., (shadow.refs -
+						shadow.hits)/(m_mrc.rate*m_mrc.seen)) : 1.;
+			curve.push_back(std::make_pair(buckets, miss));
+		}
+		return curve;
 	};
 
 	/**
-	 * @brief Identical to insertion, but the key and value are left in an 
-	 * inderminant state. Equivalent to moving the key and value
+	 * @brief Enable or disable seeded mixing of the Hash output before the
+	 * bucket is chosen. Use this when Hash is weak (e.g. the identity
+	 * std::hash<int>) and keys are structured (sequential, strided). Changing
+	 * the setting rehashes the current elements.
 	 *
-	 * @param key
-	 * @param value
-	 *
-	 * @return 
+	 * @param enable	Whether to mix hash values
+	 * @param seed		Seed for the mixer
 	 */
-	std::pair<iterator, bool> emplace(Key&& key, T&& value)
+	void hash_mixing(bool enable, uint64_t seed)
 	{
-		auto& data = m_data[bucket(key)];
-
-		/************************************
-		 * Miss
-		 ************************************/
-		// if not yet used, set to used and copy key
-		if(data.priority <= 0) {
-
-			// set bin to used
-			data.priority = 1;
-
-			// copy into bin
-			std::get<0>(data.value) = key;
-			std::get<1>(data.value) = value;
+		bool changed = (enable != m_mixhash) || (enable && seed != m_seed);
+		bool oldmix = m_mixhash;
+		uint64_t oldseed = m_seed;
+		m_mixhash = enable;
+		m_seed = seed;
+		if(changed) {
+			try {
+				rehash(m_table->data.size());
+			} catch(std::length_error&) {
+				// pinned keys would collide, nothing was moved
+				m_mixhash = oldmix;
+				m_seed = oldseed;
+				throw;
+			}
+		}
+	};
 
-			// add to list of used bins
-			m_used.push_front(&data);
-			data.pos = m_used.begin();
+	/**
+	 * @brief Enable or disable seeded mixing of the Hash output, the seed is
+	 * drawn from the buffer's random number generator so every instance
+	 * gets its own.
+	 *
+	 * @param enable	Whether to mix hash values
+	 */
+	void hash_mixing(bool enable)
+	{
+		uint64_t seed = ((uint64_t)m_rng() << 32) ^ (uint64_t)m_rng();
+		hash_mixing(enable, seed);
+	};
 
-			return std::make_pair<iterator, bool>(m_used.begin(), true);
-		} 
-		/************************************
-		 * Hit
-		 ************************************/
-		else if(std::get<0>(data.value) == key) {
-			/*
-			 * keys are equal, increase priority
-			 */
-			data.priority++;
-			return std::make_pair<iterator, bool>(data.pos, false);
-		} else {
-			/*
-			 * keys are different, probabilistically replace 
-			 */
-			
-			// the higher the probability, the lower the odds of replacement
-			if(m_rdist(m_rng) < pow(2,-data.priority)) {
-				std::get<0>(data.value) = key;
-				std::get<1>(data.value) = value;
-				data.priority = 1;
-				
-				// return new 
-				return std::make_pair<iterator, bool>(data.pos, true);
-			} else {
-				// return old
-				return std::make_pair<iterator, bool>(data.pos, false);
+	/**
+	 * @brief Give every key two candidate buckets instead of one (power of
+	 * two choices). Lookups probe both, a new key takes an empty candidate if
+	 * there is one and otherwise rolls against the lower priority occupant.
+	 * Hot keys then only get displaced when both of their buckets are 
+	 * contested, at the cost of a second probe on lookups. Changing the 
+	 * setting rehashes the current elements.
+	 *
+	 * @param enable	Whether to use two candidate buckets
+	 */
+	void two_choice(bool enable)
+	{
+		if(enable != m_twochoice) {
+			m_twochoice = enable;
+			try {
+				rehash(m_table->data.size());
+			} catch(std::length_error&) {
+				m_twochoice = !enable;
+				throw;
 			}
 		}
 	};
-	
 
 	/**
-	 * @brief Key/Value pair insertion. The pair is moved however leaving
-	 * the given key and values in inderminant state. Good if you have created
-	 * r-values for insertion
+	 * @brief Whether keys have two candidate buckets.
 	 *
-	 * @param value	Pair of Key/T to insert
+	 * @return true if two_choice placement is on
+	 */
+	bool two_choice() const
+	{
+		return m_twochoice;
+	};
+
+	/**
+	 * @brief Keep the last n displaced elements in a small fully associative
+	 * victim stash instead of dropping them. insert, emplace, [], find and 
+	 * erase check the stash when the key isn't in its bucket(s); a stash hit
+	 * swaps the element back into the table (and the occupant it displaces
+	 * into the stash). This recovers the ping-pong misses between two hot
+	 * keys sharing a bucket. The const accessors (count, at, const find) and 
+	 * iteration only see the table. Stashed elements keep counting towards 
+	 * size_bytes(), they are the first to go when making room.
 	 *
-	 * @return iterator of inserted value (or old value), bool indicating whether
-	 * insertion occurred.
+	 * @param n		Number of stash entries, 0 (default) to disable, at most 64
 	 */
-	std::pair<iterator, bool> insert(std::pair<Key, T>&& value)
+	void victim_stash(size_t n)
 	{
-		auto& data = m_data[bucket(value.first)];
-		
-		/************************************
-		 * Miss
-		 ************************************/
-		// if not yet used, set to used and copy key
-		if(data.priority <= 0) {
+		if(n > 64)
+			n = 64;
 
-			// set bin to used
-			data.priority = 1;
+		for(size_t ii=n; ii<m_stash.size(); ii++) {
+			if(m_stash[ii].priority > 0)
+				drop_stash(ii);
+		}
+		m_stash.resize(n);
+		m_stashtags.resize(n, 0);
+		for(size_t ii=0; ii<n; ii++) {
+			if(m_stashtags[ii] == 0)
+				m_stash[ii].priority = 0;
+		}
+		m_stashnext = 0;
+	};
 
-			// copy into bin
-			std::get<0>(data.value) = std::move(value.first);
-			std::get<1>(data.value) = std::move(value.second);
+	/**
+	 * @brief Number of victim stash entries.
+	 *
+	 * @return stash capacity, 0 when disabled
+	 */
+	size_t victim_stash() const
+	{
+		return m_stash.size();
+	};
 
-			// add to list of used bins
-			m_used.push_front(&data);
-			data.pos = this->begin();
+	/**
+	 * @brief Remember keys that lose their roll in a compact ghost table of 
+	 * hashed fingerprints and small counters (n slots, 4 bytes each). A key
+	 * that keeps colliding with a busy incumbent then builds up credit: its
+	 * roll succeeds with probability 2^(lost-priority) instead of 
+	 * 2^-priority, and once admitted it starts with its lost rolls as 
+	 * priority. Counters are periodically halved.
+	 *
+	 * @param n		Number of ghost slots, 0 (default) to disable
+	 */
+	void ghost_history(size_t n)
+	{
+		Ghost empty = {0, 0};
+		m_ghosts.assign(n, empty);
+		m_ghostlost = 0;
+	};
 
-			return std::make_pair<iterator, bool>(this->begin(), true);
-		} 
-		/************************************
-		 * Hit
-		 ************************************/
-		else if(std::get<0>(data.value) == value.first) {
-			/*
-			 * keys are equal, increase priority
-			 */
-			data.priority++;
-			return std::make_pair(data.pos, false);
-		} else {
-			/*
-			 * keys are different, probabilistically replace 
-			 */
-			
-			// the higher the probability, the lower the odds of replacement
-			if(m_rdist(m_rng) < pow(2,-data.priority)) {
-				std::get<0>(data.value) = std::move(value.first);
-				std::get<1>(data.value) = std::move(value.second);
-				data.priority = 1;
-				
-				// return new 
-				return std::make_pair(data.pos, true);
-			} else {
-				// return old
-				return std::make_pair(data.pos, false);
-			}
-		}
+	/**
+	 * @brief Number of ghost slots.
+	 *
+	 * @return ghost table size, 0 when disabled
+	 */
+	size_t ghost_history() const
+	{
+		return m_ghosts.size();
 	};
-	
 
 	/**
-	 * @brief Identical to normal insertion, hint is unused.
+	 * @brief Reseed the random number generator used for replacement rolls.
+	 * With a fixed seed and the same sequence of operations a buffer makes
+	 * the same replacement decisions every run. Call this before 
+	 * hash_mixing(true) if the mixer seed should be reproducible as well.
 	 *
-	 * @param hint
-	 * @param value
+	 * @param s	Seed
+	 */
+	void seed(uint64_t s)
+	{
+		m_rng.seed((typename RNG::result_type)s);
+	};
+
+	/**
+	 * @brief Direct access to the random number generator, e.g. to seed it
+	 * from a seed sequence.
 	 *
-	 * @return 
+	 * @return Reference to the generator
 	 */
-	std::pair<iterator, bool> insert(const_iterator hint, 
-			std::pair<Key, T>&& value)
+	RNG& rng()
 	{
-		(void)(hint);
-		return insert(value);
+		return m_rng;
 	};
-	
 
 	/**
-	 * @brief Multiple insertion, all values are emplaced.
+	 * @brief Whether hash mixing is currently enabled.
 	 *
-	 * @tparam InputIterator	Iterator of pairs
-	 * @param first	First value of pairs to insert
-	 * @param last	One after last pair to insert
+	 * @return true if the Hash output is mixed before use
 	 */
-	template <class InputIterator>
-	void insert(InputIterator first, InputIterator last)
+	bool hash_mixing() const
 	{
-		for(auto it=first; it!=last; it++) {
-			emplace(it.first, it.second);
-		}
+		return m_mixhash;
 	};
-	
+
 	/**
-	 * @brief Multiple insertion using initializer list.
-	 * all values are emplaced.
+	 * @brief Seed used by the hash mixer (meaningless when mixing is off).
 	 *
-	 * @param il array of values to insert
+	 * @return seed
 	 */
-	void insert(std::initializer_list<std::pair<Key,T>> il) 
+	uint64_t hash_seed() const
 	{
-		for(auto it=il.begin(); it!=il.end(); it++) {
-			emplace(it.first, it.second);
-		}
+		return m_seed;
 	};
-	
 
 	/**
-	 * @brief Operator to get the current value, or insert a new value. If 
-	 * the given value is a miss, this will create a new key/value pair and 
-	 * return it, if it is a hit (same key already exists) then the hit count
-	 * (priority) is incremented. If it is a collision, then a die is cast
-	 * to determine which key wins out. Thus there will be a probabilistic 
-	 * insertion.
+	 * @brief Weigh elements, e.g. by their size in bytes, and keep the total
+	 * weight of the stored elements at or below max_bytes(). Current elements
+	 * are re-weighed, including those in the victim stash. Pass an empty
+	 * function to go back to counting slots only.
 	 *
-	 * @param key Key to lookup, and insert/find
+	 * The weigher is called with the key and value being admitted, for [] 
+	 * that is a default constructed T.
 	 *
-	 * @return Value matching given key
+	 * @param weigher	Function returning the weight of a key/value pair
 	 */
-	T& operator[](const Key& key)
+	void weigher(std::function<size_t(const Key&, const T&)> weigher)
 	{
-		auto& data = m_data[bucket(key)];
+		unshare();
+		m_weigher = std::move(weigher);
+		m_bytes = 0;
+		for(auto it=m_table->used.begin(); it!=m_table->used.end(); it++) {
+			Element* e = *it;
+			e->weight = weigh(std::get<0>(e->value), std::get<1>(e->value));
+			m_bytes += e->weight;
+		}
+		for(Element& e : m_stash) {
+			if(e.priority != 0) {
+				e.weight = weigh(std::get<0>(e.value), std::get<1>(e.value));
+				m_bytes += e.weight;
+			}
+		}
+		shrink_bytes();
+	};
 
-		/************************************
-		 * Miss
-		 ************************************/
-		// if not yet used, set to used and copy key
-		if(data.priority <= 0) {
+	/**
+	 * @brief Set the budget for the total weight of all elements. Admitting
+	 * an element that would go over the budget first tries to evict low
+	 * priority elements (each of which gets the usual roll to stay), if they
+	 * can't be evicted the new element is rejected. Lowering the budget below
+	 * the current total evicts the lowest priority elements found right away.
+	 *
+	 * @param bytes		Maximum total weight, SIZE_MAX for no limit
+	 */
+	void max_bytes(size_t bytes)
+	{
+		unshare();
+		m_maxbytes = bytes;
+		shrink_bytes();
+	};
 
-			// set bin to used
-			data.priority = 1;
+	/**
+	 * @brief Budget for the total weight of all elements
+	 *
+	 * @return Maximum total weight
+	 */
+	size_t max_bytes() const
+	{
+		return m_maxbytes;
+	};
 
-			// copy into bin
-			std::get<0>(data.value) = key;
-			std::get<1>(data.value) = T();
+	/**
+	 * @brief Total weight of all stored elements, as given by the weigher.
+	 * Tracked incrementally, so this is O(1).
+	 *
+	 * @return Sum of element weights (0 without a weigher)
+	 */
+	size_t size_bytes() const
+	{
+		return m_bytes;
+	};
 
-			// add to list of used bins
-			m_used.push_front(&data);
-			data.pos = m_used.begin();
+	/**
+	 * @brief Set the current time. Time is a coarse uint32_t tick in whatever
+	 * unit the caller likes (e.g. seconds since start), it only has to be
+	 * consistent with the ttl values. Elements whose expiry tick has been 
+	 * reached are treated as empty buckets by insert, emplace, [], find, 
+	 * at, count and equal_range. They still show up in iteration and size() 
+	 * until they are probed or swept.
+	 *
+	 * @param now	Current tick
+	 */
+	void tick(uint32_t now)
+	{
+		m_now = now;
+	};
 
-			return std::get<1>(data.value);
-		} 
-		/************************************
-		 * Hit
-		 ************************************/
-		else if(std::get<0>(data.value) == key) {
-			/*
-			 * keys are equal, increase priority
-			 */
-			data.priority++;
-			return std::get<1>(data.value);
-		} else {
-			/*
-			 * keys are different, probabilistically replace 
-			 */
-			
-			// the higher the probability, the lower the odds of replacement
-			if(m_rdist(m_rng) < pow(2,-data.priority)) {
-				std::get<0>(data.value) = key;
-				std::get<1>(data.value) = T();
-				data.priority = 1;
-				
-				// return new 
-				return std::get<1>(data.value);
-			} else {
-				// return old
-				return std::get<1>(data.value);
-			}
-		}
+	/**
+	 * @brief Current tick, as last given to tick(uint32_t)
+	 *
+	 * @return Current tick
+	 */
+	uint32_t tick() const
+	{
+		return m_now;
 	};
-	
+
 	/**
-	 * @brief Operator to get the current value, or insert a new value. If 
-	 * the given value is a miss, this will create a new key/value pair and 
-	 * return it, if it is a hit (same key already exists) then the hit count
-	 * (priority) is incremented. If it is a collision, then a die is cast
-	 * to determine which key wins out. Thus there will be a probabilistic 
-	 * insertion. In this case the Key will be destroyed.
+	 * @brief Lifetime of newly admitted elements. Hits do not extend the 
+	 * lifetime, replacing an element starts a new one.
 	 *
-	 * @param key Key to lookup, and insert/find
+	 * @param ticks	Lifetime in ticks, 0 for elements that never expire
+	 */
+	void ttl(uint32_t ticks)
+	{
+		m_ttl = ticks;
+	};
+
+	/**
+	 * @brief Lifetime of newly admitted elements.
 	 *
-	 * @return Value matching given key
+	 * @return Lifetime in ticks, 0 if elements never expire
 	 */
-	T& operator[](Key&& key)
+	uint32_t ttl() const
 	{
-		auto& data = m_data[bucket(key)];
+		return m_ttl;
+	};
 
-		/************************************
-		 * Miss
-		 ************************************/
-		// if not yet used, set to used and copy key
-		if(data.priority <= 0) {
+	/**
+	 * @brief Change the lifetime of a stored element, counting from now.
+	 *
+	 * @param key	Key of the element
+	 * @param ticks	Lifetime in ticks, 0 for never
+	 *
+	 * @return 		true if the key was found
+	 */
+	bool expire(const Key& key, uint32_t ticks)
+	{
+		unshare();
+		Element* data = locate(key);
+		if(!data)
+			return false;
 
-			// set bin to used
-			data.priority = 1;
+		data->expiry = deadline(ticks);
+		return true;
+	};
 
-			// copy into bin
-			std::get<0>(data.value) = std::move(key);
-			std::get<1>(data.value) = T();
+	/**
+	 * @brief Incrementally release expired elements, continuing where the
+	 * last call left off. Expired elements are also released lazily when
+	 * their bucket is probed, this just frees them (and their weight) sooner.
+	 *
+	 * @param buckets	Number of buckets to examine
+	 *
+	 * @return 			Number of elements released
+	 */
+	size_t sweep(size_t buckets)
+	{
+		unshare();
+		size_t released = 0;
+		if(m_table->data.empty())
+			return 0;
 
-			// add to list of used bins
-			m_used.push_front(&data);
-			data.pos = m_used.begin();
+		for(size_t ii=0; ii<buckets && ii<m_table->data.size(); ii++) {
+			if(m_sweep >= m_table->data.size())
+				m_sweep = 0;
 
-			return std::get<1>(data.value);
-		} 
-		/************************************
-		 * Hit
-		 ************************************/
-		else if(std::get<0>(data.value) == key) {
-			/*
-			 * keys are equal, increase priority
-			 */
-			data.priority++;
-			return std::get<1>(data.value);
-		} else {
-			/*
-			 * keys are different, probabilistically replace 
-			 */
-			
-			// the higher the probability, the lower the odds of replacement
-			if(m_rdist(m_rng) < pow(2,-data.priority)) {
-				std::get<0>(data.value) = key;
-				std::get<1>(data.value) = T();
-				data.priority = 1;
-				
-				// return new 
-				return std::get<1>(data.value);
-			} else {
-				// return old
-				return std::get<1>(data.value);
+			auto& data = m_table->data[m_sweep++];
+			if(data.priority > 0 && expired(data)) {
+				release(data);
+				released++;
 			}
 		}
+		return released;
+	};
+
+	/**
+	 * @brief Set a function to call with the key, value and priority of every
+	 * element that leaves the buffer: overwritten by a key that won its roll
+	 * (or dropped from the victim stash), erased, evicted to make room in the
+	 * byte budget, or lost in a rehash. Elements that expired and clear() 
+	 * do not call it. The hook runs in the middle of a buffer operation and 
+	 * must not modify the buffer.
+	 *
+	 * @param hook	Function taking (key, value, priority), empty to disable
+	 */
+	void on_evict(std::function<void(const Key&, const T&, int)> hook)
+	{
+		m_onevict = std::move(hook);
 	};
 
 	/**************************************************************************
-	 * Accessors that do not trigger change in priority
+	 * deletions
 	 *************************************************************************/
 	
 	/**
-	 * @brief Find a given key. Note that this is difference from insert/[] 
-	 * operator in that the priority will not be adjusted. It is unlikely that
-	 * you want this function in most buffer use cases.
+	 * @brief Erase a bucket from the datastructure
 	 *
-	 * @param key	Key to search fort
+	 * @param pos Position to erase. 
 	 *
-	 * @return 		Iterator of located key
+	 * @return Iterator pointing to the next position after the removed one
 	 */
-	iterator find(const Key& key)
+	iterator erase(iterator pos)
 	{
-		auto& data = m_data[bucket(key)];
-		
-		/************************************
-		 * Miss
-		 ************************************/
-		// if not yet used, set to used and copy key
-		if(data.priority <= 0) {
-			return this->end();
-		} 
-		/************************************
-		 * Hit
-		 ************************************/
-		else if(std::get<0>(data.value) == key) {
-			/*
-			 * keys are equal, 
-			 */
-			return data.pos;
-		} else {
-			/*
-			 * keys are different, 
-			 */
-			return this->end();
+		auto next = std::next(pos.it);
+		release(**(pos.it));
+		pos.it = next;
+		return pos;
+	};
+	
+	/**
+	 * @brief Erase a range of buckets from the datastructure.
+	 *
+	 * @param first Position of first element to erase
+	 * @param last	Position of one past last element being erased.
+	 *
+	 * @return last
+	 */
+	iterator erase(iterator first, iterator last)
+	{
+		while(first.it != m_table->used.end() && first.it != last.it) {
+			first = erase(first);
 		}
+		return first;
 	};
 	
+
 	/**
-	 * @brief Find a given key. Note that this is difference from insert/[] 
-	 * operator in that the priority will not be adjusted. It is unlikely that
-	 * you want this function in most buffer use cases.
+	 * @brief Key-based erase. If a key/value pair matches then erase it. 
 	 *
-	 * @param key	Key to search fort
+	 * @param key	Key to find and erase
 	 *
-	 * @return 		Constant iterator of located key
+	 * @return 		1 if erased, 0 otherwise
 	 */
-	const_iterator find(const Key& key) const
+	size_t erase(const Key& key)
 	{
-		auto& data = m_data[bucket(key)];
-		
-		/************************************
-		 * Miss
-		 ************************************/
-		// if not yet used, set to used and copy key
-		if(data.priority <= 0) {
-			return this->cend();
-		} 
-		/************************************
-		 * Hit
-		 ************************************/
-		else if(std::get<0>(data.value) == key) {
-			/*
-			 * keys are equal, 
-			 */
-			return data.pos;
-		} else {
-			/*
-			 * keys are different, 
-			 */
-			return this->cend();
+		unshare();
+		Element* data = locate(key);
+
+		// a stashed copy must not come back later
+		if(!data && !m_stash.empty()) {
+			int ii = find_stash(key);
+			if(ii < 0)
+				return 0;
+			drop_stash(ii);
+			return 1;
 		}
+
+		// if not found, just return 0
+		if(!data)
+			return 0;
+		
+		release(*data);
+		return 1;
 	};
 
 
-//	/**
-//	 * @brief Like the [] operator, but won't adjust the priority or create a
-//	 * new value if none exists. May throw out of range exception if key isn't 
-//	 * found.
+	/**************************************************************************
+	 * insertions, these all trigger change in priority in the case of a hit
+	 *************************************************************************/
+
+	//////////////////////
+	// Copy Insert
+	//////////////////////
+	
+	/**
+	 * @brief insert an element probabilistically, makes a copy of the input 
+	 * values if the insertion is successful. The probability of insertion is
+	 * 1 if no collision occurs, and exponentially decays with the number of
+	 * re-uses of the given key. This will also decrease the 'hit' count of
+	 * the given key so that if this value were repeated more than the 
+	 * colliding key, it will eventually replace that one.
+	 *
+	 * @param value
+	 *
+	 * @return Iterator, insertion occured (bool) pair.
+	 */
+	std::pair<iterator, bool> insert(const std::pair<Key, T>& value)
+	{
+		auto ret = admit(value.first, value.second);
+		return std::make_pair(iter(ret.first), admitted(ret.second));
+	};
+	
+	/**
+	 * @brief Insert an element probabilistically, identical to normal insertion,
+	 * hints are not used.
+	 *
+	 * @param hint
+	 * @param value
+	 *
+	 * @return 
+	 */
+	std::pair<iterator, bool> insert(const_iterator hint, 
+			const std::pair<Key, T>& value)
+	{
+		// ignore the hint
+		(void)(hint);
+		return insert(value);
+	};
+	
+	////////////////////////////
+	// Move Insert 
+	////////////////////////////
+	
+	/**
+	 * @brief Identical to normal emplace, hints are not used.
+	 *
+	 * @param it
+	 * @param key
+	 * @param value
+	 *
+	 * @return 
+	 */
+	std::pair<iterator, bool> emplace_hint(const_iterator it, Key&& key, T&& value)
+	{
+		(void)(it);
+		return emplace(std::move(key), std::move(value));
+	};
+
+	/**
+	 * @brief Identical to insertion, but the key and value are left in an 
+	 * inderminant state. Equivalent to moving the key and value
+	 *
+	 * @param key
+	 * @param value
+	 *
+	 * @return 
+	 */
+	std::pair<iterator, bool> emplace(Key&& key, T&& value)
+	{
+		auto ret = admit(std::move(key), std::move(value));
+		return std::make_pair(iter(ret.first), admitted(ret.second));
+	};
+	
+
+	/**
+	 * @brief Key/Value pair insertion. The pair is moved however leaving
+	 * the given key and values in inderminant state. Good if you have created
+	 * r-values for insertion
+	 *
+	 * @param value	Pair of Key/T to insert
+	 *
+	 * @return iterator of inserted value (or old value), bool indicating whether
+	 * insertion occurred.
+	 */
+	std::pair<iterator, bool> insert(std::pair<Key, T>&& value)
+	{
+		auto ret = admit(std::move(value.first), std::move(value.second));
+		return std::make_pair(iter(ret.first), admitted(ret.second));
+	};
+	
+
+	/**
+	 * @brief Identical to normal insertion, hint is unused.
+	 *
+	 * @param hint
+	 * @param value
+	 *
+	 * @return 
+	 */
+	std::pair<iterator, bool> insert(const_iterator hint, 
+			std::pair<Key, T>&& value)
+	{
+		(void)(hint);
+		return insert(std::move(value));
+	};
+	
+
+	/**
+	 * @brief Multiple insertion, all values are inserted in order.
+	 *
+	 * @tparam InputIterator	Iterator of pairs
+	 * @param first	First value of pairs to insert
+	 * @param last	One after last pair to insert
+	 */
+	template <class InputIterator>
+	void insert(InputIterator first, InputIterator last)
+	{
+		for(auto it=first; it!=last; it++) {
+			admit(it->first, it->second);
+		}
+	};
+	
+	/**
+	 * @brief Multiple insertion using initializer list.
+	 * all values are inserted in order.
+	 *
+	 * @param il array of values to insert
+	 */
+	void insert(std::initializer_list<std::pair<Key,T>> il) 
+	{
+		for(auto it=il.begin(); it!=il.end(); it++) {
+			admit(it->first, it->second);
+		}
+	};
+	
+
+	/**
+	 * @brief Insert or merge, for aggregating into the buffer (counts, 
+	 * sums, min/max...). On a hit combine(stored, value) updates the stored
+	 * value in place and the priority goes up as with insert; otherwise the
+	 * key is inserted probabilistically with value as its initial value.
+	 * One bucket lookup either way, unlike find followed by insert.
+	 *
+	 * With a weigher the stored value is weighed again after combining, the
+	 * new weight counts against max_bytes from the next admission on.
+	 *
+	 * @tparam Combine	Callable as combine(T& stored, const T& value)
+	 * @param key		Key
+	 * @param value		Value to merge in, or to store
+	 * @param combine	Merge function
+	 *
+	 * @return 			Iterator to the key's element (end if it wasn't
+	 * 					stored), and whether the key is now stored
+	 */
+	template <class Combine>
+	std::pair<iterator, bool> upsert(const Key& key, const T& value, 
+			Combine combine)
+	{
+		auto ret = admit(key, value);
+		if(ret.second == HIT)
+			merge_into(*ret.first, value, combine);
+
+		bool stored = ret.second == HIT || admitted(ret.second);
+		return std::make_pair(stored ? iter(ret.first) : end(), stored);
+	};
+
+	/**
+	 * @brief Upsert a batch of pairs in order, with the buckets of the 
+	 * next few pairs prefetched while the current one is merged so their 
+	 * cache misses overlap (see find_batch).
+	 *
+	 * @tparam RandomIterator	Random access iterator of (key, value) pairs
+	 * @tparam Combine			Callable as combine(T& stored, const T& value)
+	 * @param first				First pair
+	 * @param last				One past the last pair
+	 * @param combine			Merge function
+	 *
+	 * @return 					Number of pairs that ended up stored (merged 
+	 * 							or admitted)
+	 */
+	template <class RandomIterator, class Combine>
+	size_t upsert(RandomIterator first, RandomIterator last, Combine combine)
+	{
+		const size_t AHEAD = 8;
+		size_t n = last - first;
+		size_t stored = 0;
+		for(size_t ii=0; ii<n; ii++) {
+			if(ii+AHEAD < n)
+				prefetch(first[ii+AHEAD].first);
+
+			auto ret = admit(first[ii].first, first[ii].second);
+			if(ret.second == HIT) {
+				merge_into(*ret.first, first[ii].second, combine);
+				stored++;
+			} else if(admitted(ret.second)) {
+				stored++;
+			}
+		}
+		return stored;
+	};
+
+	/**
+	 * @brief Merge another buffer's elements into this one, e.g. to combine
+	 * per-thread buffers. Unlike inserting them no dice are rolled and no
+	 * hits are lost: a key held by both ends up with the sum of the two
+	 * priorities (capped as usual) and keeps this buffer's value, a key 
+	 * that meets a different key in its bucket takes the bucket only with a
+	 * strictly higher priority. The result doesn't depend on the order of
+	 * the elements or on the number of threads.
+	 *
+	 * Expiry carries over as the time the element had left. Displaced 
+	 * elements go to the victim stash or on_evict as usual, other's expired
+	 * elements are skipped. Elements in other's victim stash are merged
+	 * too, after its table.
+	 *
+	 * @param other	Buffer to merge in, unchanged
+	 */
+	void merge(const unordered_buffer& other)
+	{
+		merge(other, [](T&, const T&) {});
+	};
+
+	/**
+	 * @brief Merge with a value combiner, see merge(other). For keys held by
+	 * both, combine(stored, incoming) merges other's value into this one.
+	 *
+	 * When both buffers have the same bucket count and hash settings,
+	 * direct mapped placement, and no victim stash, weigher or on_evict 
+	 * hook, each bucket only meets the same bucket of the other buffer, so
+	 * ranges of buckets are merged by separate threads and only the newly
+	 * occupied buckets are added to the used list afterwards. combine then
+	 * runs on several threads at once (on different keys), so it must be
+	 * safe to call concurrently: no unguarded shared state. Otherwise, and
+	 * for other's victim stash, the merge runs on the calling thread.
+	 *
+	 * @tparam Combine	Callable as combine(T& stored, const T& incoming)
+	 * @param other		Buffer to merge in, unchanged
+	 * @param combine	Value merge function
+	 * @param threads	Number of threads to split the buckets over
+	 */
+	template <class Combine>
+	void merge(const unordered_buffer& other, Combine combine, 
+			size_t threads = 1)
+	{
+		if(&other == this)
+			throw std::invalid_argument("Can't merge a buffer into itself");
+
+		unshare();
+		finish_resize();
+		if(!bucketwise(other)) {
+			for(auto it=other.m_table->used.begin(); 
+					it!=other.m_table->used.end(); it++) {
+				if(!other.expired(**it))
+					merge_element(other, **it, combine);
+			}
+			merge_stash(other, combine);
+			return;
+		}
+
+		size_t N = m_table->data.size();
+		threads = std::max<size_t>(1, std::min(threads, N/1024 + 1));
+		std::vector<std::vector<Element*>> added(threads);
+		std::vector<std::thread> workers;
+		for(size_t tt=1; tt<threads; tt++) {
+			workers.push_back(std::thread(
+				[this, &other, &combine, &added, tt, threads, N]() {
+					merge_buckets(other, N*tt/threads, N*(tt+1)/threads, 
+							combine, added[tt]);
+				}));
+		}
+		merge_buckets(other, 0, N/threads, combine, added[0]);
+		for(auto& w : workers)
+			w.join();
+
+		for(size_t tt=0; tt<threads; tt++) {
+			for(Element* e : added[tt])
+				link(*e);
+		}
+		merge_stash(other, combine);
+	};
+
+	/**
+	 * @brief Operator to get the current value, or insert a new value. If 
+	 * the given value is a miss, this will create a new key/value pair and 
+	 * return it, if it is a hit (same key already exists) then the hit count
+	 * (priority) is incremented. If it is a collision, then a die is cast
+	 * to determine which key wins out. Thus there will be a probabilistic 
+	 * insertion.
+	 *
+	 * If a byte budget is set the new value is weighed as a default
+	 * constructed T, and if it can't be admitted at all a reference to a
+	 * detached default value is returned.
+	 *
+	 * @param key Key to lookup, and insert/find
+	 *
+	 * @return Value matching given key
+	 */
+	T& operator[](const Key& key)
+	{
+		auto ret = admit(key, T());
+		if(!ret.first) {
+			m_detached = T();
+			return m_detached;
+		}
+		return std::get<1>(ret.first->value);
+	};
+	
+	/**
+	 * @brief Operator to get the current value, or insert a new value. If 
+	 * the given value is a miss, this will create a new key/value pair and 
+	 * return it, if it is a hit (same key already exists) then the hit count
+	 * (priority) is incremented. If it is a collision, then a die is cast
+	 * to determine which key wins out. Thus there will be a probabilistic 
+	 * insertion. In this case the Key will be destroyed.
+	 *
+	 * @param key Key to lookup, and insert/find
+	 *
+	 * @return Value matching given key
+	 */
+	T& operator[](Key&& key)
+	{
+		auto ret = admit(std::move(key), T());
+		if(!ret.first) {
+			m_detached = T();
+			return m_detached;
+		}
+		return std::get<1>(ret.first->value);
+	};
+
+	/**
+	 * @brief Count hits for a stored key without inserting or reading it,
+	 * e.g. to apply hits that were counted elsewhere in one batch. The
+	 * priority is capped as usual.
+	 *
+	 * @param key	Key that was hit
+	 * @param hits	Number of hits to add
+	 *
+	 * @return 		true if the key is stored
+	 */
+	bool touch(const Key& key, int hits = 1)
+	{
+		unshare();
+		Element* data = locate(key);
+		if(!data)
+			return false;
+
+		credit(*data, hits);
+		return true;
+	};
+
+	/**************************************************************************
+	 * Accessors that do not trigger change in priority
+	 *************************************************************************/
+	
+	/**
+	 * @brief Find a given key. Note that this is difference from insert/[] 
+	 * operator in that the priority will not be adjusted. It is unlikely that
+	 * you want this function in most buffer use cases.
+	 *
+	 * @param key	Key to search fort
+	 *
+	 * @return 		Iterator of located key
+	 */
+	iterator find(const Key& key)
+	{
+		unshare();
+		Element* data = locate(key);
+		if(!data && !m_stash.empty())
+			data = unstash(key);
+		return iter(data);
+	};
+	
+	/**
+	 * @brief Find a given key. Note that this is difference from insert/[] 
+	 * operator in that the priority will not be adjusted. It is unlikely that
+	 * you want this function in most buffer use cases.
+	 *
+	 * @param key	Key to search fort
+	 *
+	 * @return 		Constant iterator of located key
+	 */
+	const_iterator find(const Key& key) const
+	{
+		const Element* data = locate(key);
+		if(!data)
+			return this->cend();
+		return data->pos;
+	};
+
+
+//	/**
+//	 * @brief Like the [] operator, but won't adjust the priority or create a
+//	 * new value if none exists. May throw out of range exception if key isn't 
+//	 * found.
 //	 *
 //	 * @param key	Key to find, 
 //	 *
@@ -1154,7 +2159,7 @@ public:
 //	 */
 //	T& at(const Key& key) 
 //	{
-//		auto& data = m_data[bucket(key)];
+//		auto& data = m_table->data[bucket(key)];
 //
 //		/************************************
 //		 * Miss
@@ -1191,43 +2196,130 @@ public:
 	 */
 	const T& at(const Key& key) const
 	{
-		auto& data = m_data[bucket(key)];
-
-		/************************************
-		 * Miss
-		 ************************************/
-		// if not yet used, set to used and copy key
-		if(data.priority <= 0) {
-			throw std::out_of_range("Key Not Found");
-			return T();
-		} 
-		/************************************
-		 * Bin Hit
-		 ************************************/
-		else if(std::get<0>(data.value) == key) {
-			/* keys are equal, Hit */
-			return data.value.second;
-		} else {
-		/************************************
-		 * Key Miss / Bin Hit
-		 ************************************/
-			/* keys are different, Miss */
+		const Element* data = locate(key);
+		if(!data)
 			throw std::out_of_range("Key Not Found");
-			return T();
-		}
+		return std::get<1>(data->value);
+	};
+
+	/**
+	 * @brief Current priority (hit count) of a stored key.
+	 *
+	 * @param key	Key to search for
+	 *
+	 * @return 		Priority, 0 if the key isn't stored
+	 */
+	int priority(const Key& key) const
+	{
+		const Element* data = locate(key);
+		return data ? data->priority : 0;
+	};
+
+	/**
+	 * @brief Pin a stored key so that it stays until it is unpinned or
+	 * erased: colliding keys never replace it (whatever its priority), the
+	 * byte budget never evicts it, it doesn't expire and it keeps its
+	 * bucket through rehashes. Keys that collide with a pinned key can't be
+	 * stored (with two_choice() they use their other bucket), so at most
+	 * pin_limit() of the buckets may be pinned.
+	 *
+	 * @param key	Key to pin
+	 *
+	 * @return 		true if the key is pinned, false if it isn't stored or
+	 * 				the limit is reached
+	 */
+	bool pin(const Key& key)
+	{
+		unshare();
+		settle(key);
+		Element* data = locate(key);
+		if(!data)
+			return false;
+		if(data->pinned)
+			return true;
+		if(m_pins + 1 > m_pinlimit*m_table->data.size())
+			return false;
+
+		data->pinned = true;
+		m_pins++;
+		return true;
+	};
+
+	/**
+	 * @brief Make a pinned key replaceable again, with the priority it had.
+	 * It keeps its expiry tick, so a key pinned past its lifetime expires
+	 * at once.
+	 *
+	 * @param key	Key to unpin
+	 *
+	 * @return 		true if the key was pinned
+	 */
+	bool unpin(const Key& key)
+	{
+		unshare();
+		Element* data = locate(key);
+		if(!data || !data->pinned)
+			return false;
+
+		data->pinned = false;
+		m_pins--;
+		return true;
+	};
+
+	/**
+	 * @brief Whether a key is stored and pinned
+	 */
+	bool pinned(const Key& key) const
+	{
+		const Element* data = locate(key);
+		return data && data->pinned;
+	};
+
+	/**
+	 * @brief Number of pinned keys
+	 */
+	size_t pin_count() const
+	{
+		return m_pins;
+	};
+
+	/**
+	 * @brief Set the largest fraction of the buckets that may be pinned
+	 * (default 0.1). Lowering it below the current share keeps the existing
+	 * pins but refuses new ones.
+	 *
+	 * @param fraction	Between 0 and 1
+	 */
+	void pin_limit(double fraction)
+	{
+		if(fraction < 0 || fraction > 1)
+			throw std::invalid_argument("pin_limit must be between 0 and 1");
+		m_pinlimit = fraction;
+	};
+
+	double pin_limit() const
+	{
+		return m_pinlimit;
 	};
 
 	/**
 	 * @brief Which bucket a particular key is in, not very useful to the end
-	 * user I don't believe.
+	 * user I don't believe. With two_choice() placement this is the bucket
+	 * currently holding the key, or its first candidate if it isn't stored.
 	 *
 	 * @param key	Key to search for
 	 *
 	 * @return 		Int indicating a bucket.
 	 */
-	size_t bucket(const Key& key)
+	size_t bucket(const Key& key) const
 	{
-		return m_hasher(key)%m_data.size();
+		size_t b[2];
+		int n = candidates(key, m_table->data.size(), b);
+		for(int ii=1; ii<n; ii++) {
+			if(holds(m_table->data[b[ii]], key))
+				return b[ii];
+		}
+		return b[0];
 	};
 	
 
@@ -1242,29 +2334,83 @@ public:
 	 */
 	size_t count(const Key& key) const
 	{
-		auto& data = m_data[bucket(key)];
+		return locate(key) ? 1 : 0;
+	};
 
-		/************************************
-		 * Miss
-		 ************************************/
-		// if not yet used, set to used and copy key
-		if(data.priority <= 0) {
-			/* Miss */
-			return 0;
-		} 
-		/************************************
-		 * Bin Hit
-		 ************************************/
-		else if(std::get<0>(data.value) == key) {
-			/* keys are equal, Hit */
-			return 1;
-		} else {
-		/************************************
-		 * Key Miss / Bin Hit
-		 ************************************/
-			/* keys are different, Miss */
-			return 0;
+	/**
+	 * @brief Look up a batch of keys with their memory accesses overlapped.
+	 * Each lookup is a small state machine: the first step hashes the key
+	 * and prefetches its bucket(s), the second compares the keys once the
+	 * bucket has (hopefully) arrived. Up to group lookups are in flight,
+	 * stepped round robin, so on tables much larger than the cache their
+	 * DRAM misses overlap instead of queueing behind each other. Like find
+	 * this does not change priorities. Like count it only sees the table, not
+	 * the victim stash.
+	 *
+	 * @param keys	Keys to look up
+	 * @param n		Number of keys
+	 * @param out	Output, n pointers to the stored values (NULL for keys
+	 * 				that aren't stored), valid until the buffer is modified
+	 * @param group	Number of lookups in flight, 8-16 is usually best
+	 *
+	 * @return 		Number of keys found
+	 */
+	size_t find_batch(const Key* keys, size_t n, const T** out, 
+			size_t group = 8) const
+	{
+		struct lookup
+		{
+			size_t ii;
+			size_t b[2];
+			int nb;
+		};
+
+		const size_t MAX_GROUP = 32;
+		lookup ring[MAX_GROUP];
+		group = std::max<size_t>(1, std::min(group, MAX_GROUP));
+
+		// key ii always uses slot ii%group, so a finished slot is refilled
+		// with the key group places further on
+		auto start = [&](size_t ii) {
+			lookup& l = ring[ii%group];
+			l.ii = ii;
+			l.nb = candidates(keys[ii], m_table->data.size(), l.b);
+			for(int jj=0; jj<l.nb; jj++) {
+				// an element may straddle two cache lines
+				const char* p = (const char*)&m_table->data[l.b[jj]];
+				__builtin_prefetch(p);
+				__builtin_prefetch(p + sizeof(Element) - 1);
+			}
+		};
+
+		size_t next = 0;
+		for(; next<n && next<group; next++)
+			start(next);
+
+		size_t found = 0;
+		for(size_t done=0; done<n; done++) {
+			const lookup& l = ring[done%group];
+			out[l.ii] = NULL;
+			for(int jj=0; jj<l.nb; jj++) {
+				const Element& data = m_table->data[l.b[jj]];
+				if(holds(data, keys[l.ii])) {
+					out[l.ii] = &std::get<1>(data.value);
+					found++;
+					break;
+				}
+			}
+			if(!out[l.ii] && !m_table->old.empty()) {
+				const Element* data = locate_old(keys[l.ii]);
+				if(data) {
+					out[l.ii] = &std::get<1>(data->value);
+					found++;
+				}
+			}
+
+			if(next < n)
+				start(next++);
 		}
+		return found;
 	};
 
 	/**
@@ -1278,28 +2424,8 @@ public:
 	 */
 	std::pair<iterator,iterator> equal_range(const Key& key)
 	{
-		auto& data = m_data[bucket(key)];
-
-		/************************************
-		 * Miss
-		 ************************************/
-		// if not yet used, set to used and copy key
-		if(data.priority <= 0) {
-			return std::make_pair(end(), end());
-		} 
-		/************************************
-		 * Bin Hit
-		 ************************************/
-		else if(std::get<0>(data.value) == key) {
-			/* keys are equal, Hit */
-			return std::make_pair(data.pos, data.pos);
-		} else {
-		/************************************
-		 * Key Miss / Bin Hit
-		 ************************************/
-			/* keys are different, Miss */
-			return std::make_pair(end(), end());
-		}
+		auto it = find(key);
+		return std::make_pair(it, it);
 	}
 
 	/**
@@ -1313,30 +2439,1130 @@ public:
 	 */
 	std::pair<const_iterator,const_iterator> equal_range(const Key& key) const
 	{
-		auto& data = m_data[bucket(key)];
+		auto it = find(key);
+		return std::make_pair(it, it);
+	}
+
+private:
+
+	/**
+	 * @brief Copy a table. Elements are copied in one go, then the used list
+	 * is rebuilt in the same order from the offsets of the source's 
+	 * elements, so the copy never points into the source.
+	 */
+	static std::shared_ptr<Table> copy_table(const Table& src)
+	{
+		auto dst = std::make_shared<Table>();
+		std::integral_constant<bool, std::is_trivially_copyable<Key>::value &&
+			std::is_trivially_copyable<T>::value> trivial;
+		copy_elements(dst->data, src.data, trivial);
+		copy_elements(dst->old, src.old, trivial);
+		dst->moved = src.moved;
+
+		// during a resize an element may sit in either array
+		const Element* lo = src.old.data();
+		const Element* hi = lo + src.old.size();
+		for(auto it=src.used.begin(); it!=src.used.end(); it++) {
+			Element* e = (*it >= lo && *it < hi) ? &dst->old[*it - lo] :
+				&dst->data[*it - src.data.data()];
+			dst->used.push_back(e);
+			e->pos.it = std::prev(dst->used.end());
+		}
+		return dst;
+	};
+
+	/**
+	 * @brief Bulk copy for trivially copyable keys and values. The stale
+	 * used list positions are overwritten by copy_table.
+	 */
+	static void copy_elements(std::vector<Element>& dst, 
+			const std::vector<Element>& src, std::true_type)
+	{
+		dst.resize(src.size());
+		if(!src.empty())
+			memcpy((void*)dst.data(), (const void*)src.data(), 
+					src.size()*sizeof(Element));
+	};
+
+	static void copy_elements(std::vector<Element>& dst, 
+			const std::vector<Element>& src, std::false_type)
+	{
+		dst = src;
+	};
+
+	/**
+	 * @brief Take a private copy of the table if it is shared with a copy
+	 * of this buffer, call before any write.
+	 */
+	void unshare()
+	{
+		if(shared_table()) {
+			auto table = copy_table(*m_table);
+			drop_table();
+			m_table = table;
+		}
+	};
+
+	/**
+	 * @brief Whether another buffer holds the table. The acquire pairs with
+	 * the release in drop_table(), so once the other copies have let go,
+	 * their last reads of the table happen before our writes. Only a
+	 * copy_on_write buffer can share, see copy_on_write().
+	 */
+	bool shared_table() const
+	{
+		return m_cow && m_table->owners.load(std::memory_order_acquire) > 1;
+	};
+
+	/**
+	 * @brief Take another buffer's table as one more owner
+	 */
+	static std::shared_ptr<Table> share(const std::shared_ptr<Table>& table)
+	{
+		table->owners.fetch_add(1, std::memory_order_relaxed);
+		return table;
+	};
+
+	/**
+	 * @brief Give up ownership of the table, after the last read of it
+	 */
+	void drop_table()
+	{
+		if(m_table)
+			m_table->owners.fetch_sub(1, std::memory_order_release);
+	};
+
+	/**
+	 * @brief Hash of a key as used for bucket selection, i.e. m_hasher's
+	 * output passed through the seeded mixer when that is enabled.
+	 *
+	 * @param key	Key to hash
+	 *
+	 * @return 		Hash value
+	 */
+	uint64_t keyhash(const Key& key) const
+	{
+		uint64_t h = m_hasher(key);
+		return m_mixhash ? unordered_buffer_mix(h, m_seed) : h;
+	};
+
+	/**
+	 * @brief What admit() did with a key.
+	 */
+	enum outcome
+	{
+		HIT,		// key was already stored, priority incremented
+		ADMIT,		// key was placed in an empty bucket
+		REPLACE,	// key won the roll and replaced the incumbent
+		LOST,		// key lost the roll, incumbent stays
+		REJECT		// key could not fit in the byte budget
+	};
+
+	static bool admitted(outcome out)
+	{
+		return out == ADMIT || out == REPLACE;
+	};
+
+	/**
+	 * @brief Shared body of insert, emplace and []: place the key and count
+	 * the outcome for auto_resize. Resizing happens before placing, so the
+	 * returned element stays valid.
+	 *
+	 * @param key	Key, forwarded into the bucket if admitted
+	 * @param value	Value, forwarded into the bucket if admitted
+	 *
+	 * @return 		Element now holding the key (or the incumbent if the key
+	 * 				was not admitted, NULL if there is none) and what happened
+	 */
+	template <class K, class V>
+	std::pair<Element*, outcome> admit(K&& key, V&& value)
+	{
+		unshare();
+		if(m_mrc.requested > 0)
+			sample(key);
+		if(m_tune.enabled)
+			retune();
+
+		// after retune, which may have just started a resize
+		if(!m_table->old.empty()) {
+			settle(key);
+			migrate(MIGRATE_STEP);
+		}
+		auto ret = place(std::forward<K>(key), std::forward<V>(value));
+		if(!m_tune.enabled)
+			return ret;
+
+		m_tune.ops++;
+		if(ret.second == HIT)
+			m_tune.hits++;
+		else if(ret.second == LOST || ret.second == REPLACE)
+			m_tune.conflicts++;
+		return ret;
+	};
+
+	/**
+	 * @brief Size the miss ratio miniatures for the current bucket count
+	 * and clear their counts.
+	 */
+	void size_shadows()
+	{
+		double N = (double)m_table->data.size();
+		double smallest = SIZE_MAX;
+		for(const Shadow& shadow : m_mrc.shadows)
+			smallest = std::min(smallest, shadow.scale);
+
+		m_mrc.rate = std::min(1., std::max(m_mrc.requested,
+					MIN_SHADOW/(smallest*N)));
+		m_mrc.threshold = (uint64_t)(m_mrc.rate*4294967296.);
+		m_mrc.seen = 0;
+		for(Shadow& shadow : m_mrc.shadows) {
+			size_t n = std::max<size_t>(1,
+					(size_t)std::llround(shadow.scale*m_mrc.rate*N));
+			shadow.tags.assign(n, 0);
+			shadow.priority.assign(n, 0);
+			shadow.refs = 0;
+			shadow.hits = 0;
+		}
+	};
+
+	/**
+	 * @brief Feed a key to the miss ratio miniatures if it is sampled. The
+	 * high half of the hash picks the sample, the low half the bucket.
+	 */
+	void sample(const Key& key)
+	{
+		m_mrc.seen++;
+		uint64_t h = unordered_buffer_mix(keyhash(key), 0xa0761d6478bd642fULL);
+		if((h >> 32) >= m_mrc.threshold)
+			return;
+
+		uint64_t tag = h | 1;
+		for(Shadow& shadow : m_mrc.shadows) {
+			size_t b = (size_t)(h & 0xffffffffULL) % shadow.tags.size();
+			uint16_t& pri = shadow.priority[b];
+			shadow.refs++;
+			if(shadow.tags[b] == tag) {
+				shadow.hits++;
+				if(pri < MAX_PRIORITY)
+					pri++;
+			} else if(shadow.tags[b] == 0 || (pri < 64 &&
+						(m_mrc.rng() & ((1ULL << pri) - 1)) == 0)) {
+				// an incumbent loses with probability 2^-priority
+				shadow.tags[b] = tag;
+				pri = 1;
+			}
+		}
+	};
+
+	/**
+	 * @brief Start an incremental resize for auto_resize, skipped if the
+	 * pinned keys would not fit. The buckets move to the old array and the
+	 * new table starts empty; elements keep their used list entries and
+	 * are migrated a few buckets per insert (see migrate()), lookups check
+	 * both arrays meanwhile. Pinned elements are moved at once, in used list
+	 * order as pins_fit() placed them, so they always get their bucket.
+	 */
+	void resize(size_t N)
+	{
+		finish_resize();
+		if(!pins_fit(N))
+			return;
+
+		m_table->old.swap(m_table->data);
+		m_table->data = std::vector<Element>(N);
+		m_table->moved = 0;
+		if(m_pins > 0) {
+			std::vector<Element*> pinned;
+			for(auto it=m_table->used.begin(); it!=m_table->used.end(); it++) {
+				if((*it)->pinned)
+					pinned.push_back(*it);
+			}
+			for(Element* e : pinned)
+				move_element(*e);
+		}
+
+		// the curve is relative to the bucket count
+		if(m_mrc.requested > 0)
+			size_shadows();
+	};
+
+	/**
+	 * @brief Migrate up to n of the old buckets into the table, and free
+	 * the old array once they are all done.
+	 */
+	void migrate(size_t n)
+	{
+		Table& t = *m_table;
+		for(size_t ii=0; ii<n && t.moved<t.old.size(); ii++) {
+			Element& e = t.old[t.moved++];
+			if(e.priority > 0)
+				move_element(e);
+		}
+		if(t.moved == t.old.size()) {
+			std::vector<Element>().swap(t.old);
+			t.moved = 0;
+		}
+	};
+
+	/**
+	 * @brief Finish a resize in progress, before anything that needs the
+	 * whole table in one array.
+	 */
+	void finish_resize()
+	{
+		if(!m_table->old.empty())
+			migrate(m_table->old.size());
+	};
+
+	/**
+	 * @brief Migrate a key now if it is still in the old buckets, so that
+	 * placing it only has to look at the table.
+	 */
+	void settle(const Key& key)
+	{
+		if(m_table->old.empty())
+			return;
+		const Element* e = locate_old(key);
+		if(e)
+			move_element(*const_cast<Element*>(e));
+	};
+
+	/**
+	 * @brief Move one old element into the table, settling a collision the
+	 * way rehash does: the pinned or more used element stays, the other one
+	 * is evicted. Expired elements are just released.
+	 */
+	void move_element(Element& src)
+	{
+		if(expired(src)) {
+			release(src);
+			return;
+		}
+
+		size_t b[2];
+		int n = candidates(std::get<0>(src.value), m_table->data.size(), b);
+		Element* dst = &m_table->data[b[0]];
+		for(int ii=1; ii<n; ii++) {
+			Element* alt = &m_table->data[b[ii]];
+			if(src.pinned ? dst->priority > 0 && dst->pinned : 
+					better(*dst, *alt))
+				dst = alt;
+		}
+		if(dst->priority > 0 && expired(*dst))
+			release(*dst);
+
+		if(dst->priority > 0) {
+			if(!src.pinned && (dst->pinned || dst->priority >= src.priority)) {
+				release(src);
+				return;
+			}
+			// the incumbent goes, its list entry is taken over below
+			evicted(*dst);
+			m_bytes -= dst->weight;
+			m_table->used.erase(dst->pos.it);
+		}
+
+		transfer(*dst, src);
+		dst->pos = src.pos;
+		*dst->pos.it = dst;
+		src.priority = 0;
+		src.pinned = false;
+	};
+
+	/**
+	 * @brief Whether rehash(N) can give every pinned element a bucket of
+	 * its own: places them in used list order the way rehash does.
+	 */
+	bool pins_fit(size_t N) const
+	{
+		if(m_pins == 0)
+			return true;
+		if(N == 0)
+			return false;
+
+		std::vector<bool> taken(N, false);
+		for(auto it=m_table->used.begin(); it!=m_table->used.end(); it++) {
+			if(!(*it)->pinned)
+				continue;
+			size_t b[2];
+			int n = candidates(std::get<0>((*it)->value), N, b);
+			int ii = 0;
+			while(ii < n && taken[b[ii]])
+				ii++;
+			if(ii == n)
+				return false;
+			taken[b[ii]] = true;
+		}
+		return true;
+	};
+
+	/**
+	 * @brief End an auto_resize window once it is long enough, and grow,
+	 * undo a growth or shrink as described in auto_resize().
+	 */
+	void retune()
+	{
+		size_t N = m_table->data.size();
+		if(m_tune.ops < std::max(N, TUNE_WINDOW))
+			return;
+
+		finish_resize();
+		double hit = (double)m_tune.hits/m_tune.ops;
+		m_tune.hitrate = hit;
+		m_tune.conflictrate = (double)m_tune.conflicts/m_tune.ops;
+		m_tune.ops = 0;
+		m_tune.hits = 0;
+		m_tune.conflicts = 0;
+
+		// the limit may have been lowered
+		if(memory_usage() > m_tune.maxmemory && N/2 >= MIN_BUCKETS) {
+			m_tune.grownfrom = -1;
+			resize(N/2);
+			return;
+		}
+
+		// a growth that bought nothing is given back
+		if(m_tune.grownfrom >= 0) {
+			bool useless = hit < m_tune.grownfrom + 0.01;
+			m_tune.grownfrom = -1;
+			if(useless) {
+				m_tune.holdoff = TUNE_HOLDOFF;
+				resize(N/2);
+				return;
+			}
+		}
+		if(m_tune.holdoff > 0)
+			m_tune.holdoff--;
+
+		if(m_tune.conflictrate > m_tune.grow && m_tune.holdoff == 0 &&
+				memory_usage() + 2*N*sizeof(Element) <= m_tune.maxmemory) {
+			m_tune.grownfrom = hit;
+			m_tune.lowwindows = 0;
+			resize(2*N);
+			return;
+		}
+
+		if((double)m_table->used.size()/N >= m_tune.shrink) {
+			m_tune.lowwindows = 0;
+		} else if(++m_tune.lowwindows >= TUNE_LOW && N/2 >= MIN_BUCKETS) {
+			m_tune.lowwindows = 0;
+			resize(N/2);
+		}
+	};
+
+	/**
+	 * @brief Put a key in the table. A hit increments the priority, an 
+	 * empty bucket takes the key, and a collision rolls against the 
+	 * incumbent's priority.
+	 */
+	template <class K, class V>
+	std::pair<Element*, outcome> place(K&& key, V&& value)
+	{
+		size_t b[2];
+		int n = candidates(key, m_table->data.size(), b);
+		for(int ii=0; ii<n; ii++) {
+			auto& cand = m_table->data[b[ii]];
+
+			// a stale element is as good as an empty bucket
+			if(cand.priority > 0 && expired(cand))
+				release(cand);
+			else if(cand.priority > 0 && std::get<0>(cand.value) == key) {
+				if(cand.priority < MAX_PRIORITY)
+					cand.priority++;
+				return std::make_pair(&cand, HIT);
+			}
+		}
+
+		// recently displaced keys get their bucket back
+		if(!m_stash.empty()) {
+			Element* back = unstash(key);
+			if(back) {
+				if(back->priority < MAX_PRIORITY)
+					back->priority++;
+				return std::make_pair(back, HIT);
+			}
+		}
+
+		// contest the empty candidate if there is one, else the least used
+		auto& data = *target(b, n);
 
 		/************************************
 		 * Miss
 		 ************************************/
-		// if not yet used, set to used and copy key
 		if(data.priority <= 0) {
-			return std::make_pair(cend(), cend());
+			size_t w = weigh(key, value);
+			if(!make_room(w, NULL))
+				return std::make_pair((Element*)NULL, REJECT);
+
+			int ghost = claim_ghost(key);
+			store(data, std::forward<K>(key), std::forward<V>(value), w);
+			credit(data, ghost);
+			link(data);
+			return std::make_pair(&data, ADMIT);
 		} 
+
 		/************************************
-		 * Bin Hit
+		 * Collision, rolls this key lost before count in its favor
 		 ************************************/
-		else if(std::get<0>(data.value) == key) {
-			/* keys are equal, Hit */
-			auto tmp = (const_iterator)data.pos;
-			return std::make_pair(tmp, tmp);
+		if(!data.pinned && roll(data.priority - ghost_count(key))) {
+			size_t w = weigh(key, value);
+			if(!make_room(w, &data))
+				return std::make_pair(&data, REJECT);
+
+			int ghost = claim_ghost(key);
+			displace(data);
+			store(data, std::forward<K>(key), std::forward<V>(value), w);
+			credit(data, ghost);
+			return std::make_pair(&data, REPLACE);
 		} else {
-		/************************************
-		 * Key Miss / Bin Hit
-		 ************************************/
-			/* keys are different, Miss */
-			return std::make_pair(cend(), cend());
+			add_ghost(key);
+			return std::make_pair(&data, LOST);
 		}
-	}
+	};
+
+	/**
+	 * @brief Ghost table slot and tag for a key. Uses a separately mixed 
+	 * hash so keys contesting the same bucket land in different slots.
+	 */
+	Ghost& ghost_slot(const Key& key, uint16_t& tag)
+	{
+		uint64_t h = unordered_buffer_mix(keyhash(key), m_seed ^ 0x9e3779b97f4a7c15ULL);
+		tag = (uint16_t)(h >> 48);
+		if(tag == 0)
+			tag = 1;
+		return m_ghosts[h%m_ghosts.size()];
+	};
+
+	/**
+	 * @brief Number of rolls the key lost recently, 0 without ghost history
+	 */
+	int ghost_count(const Key& key)
+	{
+		if(m_ghosts.empty())
+			return 0;
+
+		uint16_t tag;
+		Ghost& g = ghost_slot(key, tag);
+		return g.tag == tag ? g.count : 0;
+	};
+
+	/**
+	 * @brief Take a key's ghost count (and clear it) when it gets admitted.
+	 */
+	int claim_ghost(const Key& key)
+	{
+		if(m_ghosts.empty())
+			return 0;
+
+		uint16_t tag;
+		Ghost& g = ghost_slot(key, tag);
+		if(g.tag != tag)
+			return 0;
+
+		int count = g.count;
+		g.tag = 0;
+		g.count = 0;
+		return count;
+	};
+
+	/**
+	 * @brief Record a lost roll. A different key in the same slot is simply
+	 * overwritten. All counts are halved every few times the table's size in
+	 * lost rolls, so old contests fade.
+	 */
+	void add_ghost(const Key& key)
+	{
+		if(m_ghosts.empty())
+			return;
+
+		uint16_t tag;
+		Ghost& g = ghost_slot(key, tag);
+		if(g.tag != tag) {
+			g.tag = tag;
+			g.count = 0;
+		}
+		if(g.count < UINT8_MAX)
+			g.count++;
+
+		if(++m_ghostlost >= GHOST_AGING*m_ghosts.size()) {
+			m_ghostlost = 0;
+			for(size_t ii=0; ii<m_ghosts.size(); ii++)
+				m_ghosts[ii].count /= 2;
+		}
+	};
+
+	/**
+	 * @brief Add hits to an element's priority, capped at MAX_PRIORITY
+	 */
+	void credit(Element& data, int hits)
+	{
+		data.priority = std::min(data.priority + hits, MAX_PRIORITY);
+	};
+
+	/**
+	 * @brief Which of a key's candidate buckets a new key goes to: the first
+	 * empty one, otherwise the unpinned one with the lowest priority.
+	 */
+	Element* target(const size_t* b, int n)
+	{
+		Element* dst = &m_table->data[b[0]];
+		for(int ii=1; ii<n; ii++) {
+			Element* alt = &m_table->data[b[ii]];
+			if(better(*dst, *alt))
+				dst = alt;
+		}
+		return dst;
+	};
+
+	/**
+	 * @brief Whether a new key should go to bucket alt rather than dst: alt
+	 * is empty and dst isn't, or alt isn't pinned and dst is, or alt has
+	 * the lower priority.
+	 */
+	static bool better(const Element& dst, const Element& alt)
+	{
+		if(dst.priority <= 0)
+			return false;
+		if(alt.priority <= 0)
+			return true;
+		if(alt.pinned != dst.pinned)
+			return dst.pinned;
+		return alt.priority < dst.priority;
+	};
+
+	/**
+	 * @brief Get rid of an occupant that lost its bucket to a new key, i.e.
+	 * move it into the victim stash if there is one. Leaves the bucket with
+	 * stale contents for the caller to overwrite, the used list is unchanged.
+	 */
+	void displace(Element& data)
+	{
+		if(m_stash.empty()) {
+			evicted(data);
+			m_bytes -= data.weight;
+			return;
+		}
+
+		size_t ii = m_stashnext;
+		m_stashnext = (m_stashnext+1)%m_stash.size();
+		if(m_stash[ii].priority > 0)
+			drop_stash(ii);
+
+		m_stashtags[ii] = stashtag(std::get<0>(data.value));
+		transfer(m_stash[ii], data);
+	};
+
+	/**
+	 * @brief Tag of a key in the victim stash, never 0 which marks empty
+	 * entries.
+	 */
+	uint64_t stashtag(const Key& key) const
+	{
+		uint64_t h = keyhash(key);
+		return h ? h : 1;
+	};
+
+	/**
+	 * @brief Index of a (live) key in the victim stash.
+	 *
+	 * @return 	Index or -1 if the key isn't stashed
+	 */
+	int find_stash(const Key& key)
+	{
+		// branch free compare of every tag so the scan vectorizes, then
+		// check the keys of the matching entries
+		uint64_t tag = stashtag(key);
+		uint64_t match = 0;
+		for(size_t ii=0; ii<m_stashtags.size(); ii++)
+			match |= (uint64_t)(m_stashtags[ii] == tag) << ii;
+
+		while(match) {
+			int ii = __builtin_ctzll(match);
+			match &= match-1;
+			if(std::get<0>(m_stash[ii].value) == key) {
+				if(expired(m_stash[ii])) {
+					drop_stash(ii);
+					return -1;
+				}
+				return ii;
+			}
+		}
+		return -1;
+	};
+
+	/**
+	 * @brief Remove an entry from the victim stash for good.
+	 */
+	void drop_stash(size_t ii)
+	{
+		evicted(m_stash[ii]);
+		m_bytes -= m_stash[ii].weight;
+		m_stash[ii].priority = 0;
+		m_stashtags[ii] = 0;
+	};
+
+	/**
+	 * @brief Move a stashed key back into the table, swapping it with the
+	 * occupant of its target bucket. No roll, a stash hit means the key was
+	 * displaced recently and is wanted again.
+	 *
+	 * @param key	Key to look for
+	 *
+	 * @return 		Element now holding the key, NULL if it isn't stashed
+	 */
+	Element* unstash(const Key& key)
+	{
+		int ii = find_stash(key);
+		if(ii < 0)
+			return NULL;
+
+		size_t b[2];
+		int n = candidates(key, m_table->data.size(), b);
+		Element* dst = target(b, n);
+		if(dst->priority > 0 && dst->pinned)
+			return NULL;
+		if(dst->priority > 0) {
+			std::swap(dst->priority, m_stash[ii].priority);
+			std::swap(dst->value, m_stash[ii].value);
+			std::swap(dst->weight, m_stash[ii].weight);
+			std::swap(dst->expiry, m_stash[ii].expiry);
+			m_stashtags[ii] = stashtag(std::get<0>(m_stash[ii].value));
+		} else {
+			transfer(*dst, m_stash[ii]);
+			link(*dst);
+			m_stash[ii].priority = 0;
+			m_stashtags[ii] = 0;
+		}
+		return dst;
+	};
+
+	/**
+	 * @brief The die cast on a collision, the higher the incumbent's priority
+	 * the lower the odds of replacement.
+	 *
+	 * @param priority	Priority of the incumbent
+	 *
+	 * @return 			true if the incumbent should be replaced
+	 */
+	bool roll(int priority)
+	{
+		return m_rdist(m_rng) < pow(2,-priority);
+	};
+
+	/**
+	 * @brief Buckets a key may be stored in, one for direct mapped placement
+	 * two with two_choice().
+	 *
+	 * @param key	Key
+	 * @param N		Number of buckets
+	 * @param b		Output, candidate buckets
+	 *
+	 * @return 		Number of candidates
+	 */
+	int candidates(const Key& key, size_t N, size_t b[2]) const
+	{
+		uint64_t h = keyhash(key);
+		b[0] = h%N;
+		if(!m_twochoice)
+			return 1;
+
+		b[1] = unordered_buffer_mix(h, m_seed ^ 0x2d358dccaa6c78a5ULL)%N;
+		return b[1] == b[0] ? 1 : 2;
+	};
+
+	/**
+	 * @brief Whether an element currently (and not expired) holds the key
+	 */
+	bool holds(const Element& data, const Key& key) const
+	{
+		return data.priority > 0 && !expired(data) && 
+			std::get<0>(data.value) == key;
+	};
+
+	/**
+	 * @brief Element holding a key, without changing anything.
+	 *
+	 * @param key	Key to search for
+	 *
+	 * @return 		Element or NULL if the key isn't stored
+	 */
+	const Element* locate(const Key& key) const
+	{
+		size_t b[2];
+		int n = candidates(key, m_table->data.size(), b);
+		for(int ii=0; ii<n; ii++) {
+			if(holds(m_table->data[b[ii]], key))
+				return &m_table->data[b[ii]];
+		}
+		return m_table->old.empty() ? NULL : locate_old(key);
+	};
+
+	/**
+	 * @brief Element holding a key among the buckets a resize has yet to
+	 * migrate, NULL if there is none.
+	 */
+	const Element* locate_old(const Key& key) const
+	{
+		size_t b[2];
+		int n = candidates(key, m_table->old.size(), b);
+		for(int ii=0; ii<n; ii++) {
+			if(holds(m_table->old[b[ii]], key))
+				return &m_table->old[b[ii]];
+		}
+		return NULL;
+	};
+
+	Element* locate(const Key& key)
+	{
+		return const_cast<Element*>(
+				static_cast<const unordered_buffer*>(this)->locate(key));
+	};
+
+	/**
+	 * @brief Whether a merge can pair up buckets by index: both tables
+	 * place every key in the same single bucket, and nothing global (the
+	 * stash, the byte budget, on_evict) is touched while merging.
+	 */
+	bool bucketwise(const unordered_buffer& other) const
+	{
+		return m_table->data.size() == other.m_table->data.size() &&
+			other.m_table->old.empty() &&
+			m_mixhash == other.m_mixhash && 
+			(!m_mixhash || m_seed == other.m_seed) &&
+			!m_twochoice && !other.m_twochoice && m_stash.empty() &&
+			!m_weigher && !m_onevict;
+	};
+
+	/**
+	 * @brief Expiry tick in this buffer for an element of another buffer,
+	 * keeping the time it had left.
+	 */
+	uint32_t carry_expiry(const unordered_buffer& other, const Element& src)
+		const
+	{
+		return src.expiry ? deadline(src.expiry - other.m_now) : 0;
+	};
+
+	/**
+	 * @brief Merge one (live) element of another buffer, see merge().
+	 */
+	template <class Combine>
+	void merge_element(const unordered_buffer& other, const Element& src,
+			Combine& combine)
+	{
+		const Key& key = std::get<0>(src.value);
+		Element* data = locate(key);
+		if(!data && !m_stash.empty())
+			data = unstash(key);
+		if(data) {
+			data->priority = std::min(data->priority + src.priority, 
+					MAX_PRIORITY);
+			merge_into(*data, std::get<1>(src.value), combine);
+			return;
+		}
+
+		size_t b[2];
+		int n = candidates(key, m_table->data.size(), b);
+		for(int ii=0; ii<n; ii++) {
+			auto& cand = m_table->data[b[ii]];
+			if(cand.priority > 0 && expired(cand))
+				release(cand);
+		}
+
+		Element& dst = *target(b, n);
+		size_t w = weigh(key, std::get<1>(src.value));
+		if(dst.priority <= 0) {
+			if(!make_room(w, NULL))
+				return;
+			store(dst, key, std::get<1>(src.value), w);
+			link(dst);
+		} else if(src.priority > dst.priority && !dst.pinned) {
+			if(!make_room(w, &dst))
+				return;
+			displace(dst);
+			store(dst, key, std::get<1>(src.value), w);
+		} else {
+			return;
+		}
+		dst.priority = src.priority;
+		dst.expiry = carry_expiry(other, src);
+	};
+
+	/**
+	 * @brief Merge the live elements of another buffer's victim stash, see
+	 * merge().
+	 */
+	template <class Combine>
+	void merge_stash(const unordered_buffer& other, Combine& combine)
+	{
+		for(const Element& src : other.m_stash) {
+			if(src.priority > 0 && !other.expired(src))
+				merge_element(other, src, combine);
+		}
+	};
+
+	/**
+	 * @brief Bucketwise merge of the buckets in [lo, hi), safe to run on
+	 * disjoint ranges in parallel (see bucketwise()). Newly occupied 
+	 * buckets are collected in added for linking afterwards, replaced ones
+	 * keep their used list entry.
+	 */
+	template <class Combine>
+	void merge_buckets(const unordered_buffer& other, size_t lo, size_t hi,
+			Combine& combine, std::vector<Element*>& added)
+	{
+		for(size_t ii=lo; ii<hi; ii++) {
+			const Element& src = other.m_table->data[ii];
+			if(src.priority <= 0 || other.expired(src))
+				continue;
+
+			Element& dst = m_table->data[ii];
+			bool live = dst.priority > 0 && !expired(dst);
+			if(live && std::get<0>(dst.value) == std::get<0>(src.value)) {
+				dst.priority = std::min(dst.priority + src.priority, 
+						MAX_PRIORITY);
+				combine(std::get<1>(dst.value), std::get<1>(src.value));
+				continue;
+			}
+			if(live && (dst.pinned || src.priority <= dst.priority))
+				continue;
+
+			if(dst.priority <= 0)
+				added.push_back(&dst);
+			dst.value = src.value;
+			dst.priority = src.priority;
+			dst.pinned = false;
+			dst.weight = 0;
+			dst.expiry = carry_expiry(other, src);
+		}
+	};
+
+	/**
+	 * @brief Apply an upsert's combine to a stored element and keep its 
+	 * weight current.
+	 */
+	template <class Combine>
+	void merge_into(Element& data, const T& value, Combine& combine)
+	{
+		combine(std::get<1>(data.value), value);
+		if(m_weigher) {
+			size_t w = weigh(std::get<0>(data.value), std::get<1>(data.value));
+			m_bytes += w;
+			m_bytes -= data.weight;
+			data.weight = w;
+		}
+	};
+
+	/**
+	 * @brief Prefetch the bucket(s) a key may be stored in.
+	 */
+	void prefetch(const Key& key) const
+	{
+		size_t b[2];
+		int n = candidates(key, m_table->data.size(), b);
+		for(int ii=0; ii<n; ii++) {
+			// an element may straddle two cache lines
+			const char* p = (const char*)&m_table->data[b[ii]];
+			__builtin_prefetch(p);
+			__builtin_prefetch(p + sizeof(Element) - 1);
+		}
+	};
+
+	/**
+	 * @brief Move the contents and bookkeeping of one element into another
+	 * (used when moving elements between tables), the used list position is
+	 * left alone.
+	 */
+	void transfer(Element& dst, Element& src)
+	{
+		dst.priority = src.priority;
+		dst.pinned = src.pinned;
+		dst.value = std::move(src.value);
+		dst.weight = src.weight;
+		dst.expiry = src.expiry;
+	};
+
+	/**
+	 * @brief Copy/move a key and value into a bucket and restart its
+	 * priority. Does not touch the used list.
+	 */
+	template <class K, class V>
+	void store(Element& data, K&& key, V&& value, size_t weight)
+	{
+		data.priority = 1;
+		data.pinned = false;
+		std::get<0>(data.value) = std::forward<K>(key);
+		std::get<1>(data.value) = std::forward<V>(value);
+		data.weight = weight;
+		data.expiry = deadline(m_ttl);
+		m_bytes += weight;
+	};
+
+	/**
+	 * @brief Whether an (occupied) element has reached its expiry tick,
+	 * pinned elements never expire.
+	 */
+	bool expired(const Element& data) const
+	{
+		return !data.pinned && data.expiry != 0 && data.expiry <= m_now;
+	};
+
+	/**
+	 * @brief Expiry tick for a lifetime starting now, 0 (never) for a 0
+	 * lifetime. Saturates rather than wrapping.
+	 */
+	uint32_t deadline(uint32_t ticks) const
+	{
+		if(ticks == 0)
+			return 0;
+		return (ticks > UINT32_MAX - m_now) ? UINT32_MAX : m_now + ticks;
+	};
+
+	/**
+	 * @brief Add a newly occupied bucket to the used list.
+	 */
+	void link(Element& data)
+	{
+		m_table->used.push_front(&data);
+		data.pos.it = m_table->used.begin();
+	};
+
+	/**
+	 * @brief Empty an occupied bucket and drop it from the used list.
+	 */
+	void release(Element& data)
+	{
+		evicted(data);
+		if(data.pinned) {
+			data.pinned = false;
+			m_pins--;
+		}
+		data.priority = 0;
+		m_bytes -= data.weight;
+		m_table->used.erase(data.pos.it);
+	};
+
+	/**
+	 * @brief Call the on_evict hook for an element about to leave the
+	 * buffer, unless it expired.
+	 */
+	void evicted(const Element& data)
+	{
+		if(m_onevict && !expired(data))
+			m_onevict(std::get<0>(data.value), std::get<1>(data.value), 
+					data.priority);
+	};
+
+	/**
+	 * @brief Iterator for an element, end() for NULL
+	 */
+	iterator iter(Element* data)
+	{
+		return data ? data->pos : end();
+	};
+
+	size_t weigh(const Key& key, const T& value) const
+	{
+		return m_weigher ? m_weigher(key, value) : 0;
+	};
+
+	/**
+	 * @brief Make sure an element of the given weight fits in the budget by 
+	 * evicting the lowest priority of a few sampled elements, as long as it
+	 * loses its roll.
+	 *
+	 * @param weight	Weight about to be added
+	 * @param replacing	Element whose weight is about to be freed (not
+	 * 					considered for eviction), or NULL
+	 *
+	 * @return 			true if there is room
+	 */
+	bool make_room(size_t weight, Element* replacing)
+	{
+		if(weight > m_maxbytes)
+			return false;
+
+		// a replaced element only frees its weight if it isn't stashed
+		size_t freed = (replacing && m_stash.empty()) ? replacing->weight : 0;
+		while(m_bytes - freed > m_maxbytes - weight) {
+			if(drop_oldest_stash())
+				continue;
+
+			Element* victim = sample_victim(replacing);
+			if(!victim || (!expired(*victim) && !roll(victim->priority)))
+				return false;
+			release(*victim);
+		}
+		return true;
+	};
+
+	/**
+	 * @brief Drop the oldest entry from the victim stash.
+	 *
+	 * @return false if the stash is empty
+	 */
+	bool drop_oldest_stash()
+	{
+		for(size_t jj=0; jj<m_stash.size(); jj++) {
+			size_t ii = (m_stashnext+jj)%m_stash.size();
+			if(m_stash[ii].priority > 0) {
+				drop_stash(ii);
+				return true;
+			}
+		}
+		return false;
+	};
+
+	/**
+	 * @brief Evict the lowest priority sampled elements until the total 
+	 * weight is within the budget, no rolls.
+	 */
+	void shrink_bytes()
+	{
+		while(m_bytes > m_maxbytes) {
+			if(drop_oldest_stash())
+				continue;
+
+			Element* victim = sample_victim(NULL);
+			if(!victim)
+				break;
+			release(*victim);
+		}
+	};
+
+	/**
+	 * @brief Pick the lowest priority of EVICT_SAMPLES randomly chosen 
+	 * occupied buckets. Falls back on the oldest entry of the used list when
+	 * the table is too sparse for sampling to find anything.
+	 *
+	 * @param skip	Element to never pick, may be NULL
+	 *
+	 * @return 		Victim or NULL if nothing can be evicted
+	 */
+	Element* sample_victim(Element* skip)
+	{
+		Element* victim = NULL;
+		int found = 0;
+		std::uniform_int_distribution<size_t> pick(0, m_table->data.size()-1);
+		for(int ii=0; ii<4*EVICT_SAMPLES && found<EVICT_SAMPLES; ii++) {
+			Element* e = &m_table->data[pick(m_rng)];
+			if(e->priority <= 0 || e == skip || e->pinned)
+				continue;
+			if(expired(*e))
+				return e;
+			found++;
+			if(!victim || e->priority < victim->priority)
+				victim = e;
+		}
+
+		if(!victim) {
+			for(auto it=m_table->used.rbegin(); it!=m_table->used.rend(); it++) {
+				if(*it != skip && !(*it)->pinned)
+					return *it;
+			}
+		}
+		return victim;
+	};
 };
 
 #include "unordered_buffer.hpp"
@@ -0,0 +1,936 @@
+#include <utility>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <random>
+#include <thread>
+#include "unordered_buffer.h"
+#include "static_unordered_buffer.h"
+#include "concurrent_unordered_buffer.h"
+#include "thread_local_front.h"
+#include "frozen_unordered_buffer.h"
+#include "inline_string.h"
+#include "latency_histogram.h"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#endif
+
+using std::cout;
+using std::cerr;
+using std::endl;
+
+typedef std::chrono::steady_clock bclock;
+
+/**
+ * @brief Hardware event counters of the calling thread through
+ * perf_event_open, user space only. A counter the kernel refuses (no PMU as
+ * in many VMs, perf_event_paranoid above 2, or not on this CPU) stays
+ * unavailable and reads 0.
+ */
+class perf_counters
+{
+public:
+	static const int N = 3;
+
+	perf_counters()
+	{
+		for(int ii=0; ii<N; ii++)
+			m_fd[ii] = -1;
+#ifdef __linux__
+		const uint32_t TYPES[N] = {PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE,
+			PERF_TYPE_HW_CACHE};
+		const uint64_t CONFIGS[N] = {PERF_COUNT_HW_CACHE_MISSES,
+			PERF_COUNT_HW_BRANCH_MISSES, PERF_COUNT_HW_CACHE_DTLB |
+				(PERF_COUNT_HW_CACHE_OP_READ << 8) |
+				(PERF_COUNT_HW_CACHE_RESULT_MISS << 16)};
+		for(int ii=0; ii<N; ii++) {
+			struct perf_event_attr attr;
+			memset(&attr, 0, sizeof(attr));
+			attr.size = sizeof(attr);
+			attr.type = TYPES[ii];
+			attr.config = CONFIGS[ii];
+			attr.disabled = 1;
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+			m_fd[ii] = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+		}
+#endif
+	};
+
+	~perf_counters()
+	{
+#ifdef __linux__
+		for(int ii=0; ii<N; ii++) {
+			if(m_fd[ii] >= 0)
+				close(m_fd[ii]);
+		}
+#endif
+	};
+
+	perf_counters(const perf_counters&) = delete;
+	perf_counters& operator=(const perf_counters&) = delete;
+
+	static const char* name(int ii)
+	{
+		const char* NAMES[N] = {"cache-miss", "branch-miss", "dTLB-miss"};
+		return NAMES[ii];
+	};
+
+	bool available(int ii) const
+	{
+		return m_fd[ii] >= 0;
+	};
+
+	/**
+	 * @brief Zero and start the counters
+	 */
+	void start()
+	{
+#ifdef __linux__
+		for(int ii=0; ii<N; ii++) {
+			if(m_fd[ii] >= 0) {
+				ioctl(m_fd[ii], PERF_EVENT_IOC_RESET, 0);
+				ioctl(m_fd[ii], PERF_EVENT_IOC_ENABLE, 0);
+			}
+		}
+#endif
+	};
+
+	/**
+	 * @brief Stop the counters and read them
+	 *
+	 * @param counts	Output, events since start()
+	 */
+	void stop(uint64_t counts[N])
+	{
+		for(int ii=0; ii<N; ii++) {
+			counts[ii] = 0;
+#ifdef __linux__
+			if(m_fd[ii] >= 0) {
+				ioctl(m_fd[ii], PERF_EVENT_IOC_DISABLE, 0);
+				if(read(m_fd[ii], &counts[ii], sizeof(uint64_t)) !=
+						sizeof(uint64_t))
+					counts[ii] = 0;
+			}
+#endif
+		}
+	};
+
+private:
+	int m_fd[N];
+};
+
+/**
+ * @brief Generate the keys for a given access pattern.
+ *
+ * @param pattern	"sequential", "strided" or "random"
+ * @param n			Number of keys
+ * @param stride	Step between keys for the strided pattern
+ *
+ * @return 			Keys
+ */
+std::vector<int> make_keys(const std::string& pattern, size_t n, int stride)
+{
+	std::vector<int> keys(n);
+	for(size_t ii=0; ii<n; ii++) {
+		if(pattern == "sequential")
+			keys[ii] = (int)ii;
+		else if(pattern == "strided")
+			keys[ii] = (int)ii*stride;
+		else
+			keys[ii] = rand();
+	}
+	return keys;
+}
+
+/**
+ * @brief Insert each key once into an empty buffer and count how many of
+ * them could not get their own bucket. Under an ideal uniform hash the
+ * expected number of collisions is n - m(1-(1-1/m)^n).
+ */
+void bench_collisions()
+{
+	const size_t BUCKETS = 1024;
+	const char* PATTERNS[] = {"sequential", "strided", "random"};
+
+	cout << "collisions: " << BUCKETS << " buckets, strided step = "
+		<< BUCKETS << endl;
+	cout << std::setw(12) << "pattern" << std::setw(8) << "keys"
+		<< std::setw(8) << "mix" << std::setw(12) << "collisions"
+		<< std::setw(12) << "uniform" << std::setw(12) << "ns/insert" << endl;
+
+	for(size_t nkeys = BUCKETS/2; nkeys <= BUCKETS; nkeys *= 2) {
+		double uniform = nkeys - BUCKETS*(1-pow(1-1./BUCKETS, nkeys));
+		for(size_t pp=0; pp<3; pp++) {
+			auto keys = make_keys(PATTERNS[pp], nkeys, BUCKETS);
+			for(int mix=0; mix<2; mix++) {
+				unordered_buffer<int, double> buff(BUCKETS);
+				buff.seed(1);
+				buff.hash_mixing(mix != 0);
+
+				auto t0 = bclock::now();
+				for(size_t ii=0; ii<keys.size(); ii++)
+					buff.insert(std::make_pair(keys[ii], (double)ii));
+				auto t1 = bclock::now();
+				double ns = std::chrono::duration<double, std::nano>(t1-t0).count();
+
+				cout << std::setw(12) << PATTERNS[pp] << std::setw(8) << nkeys
+					<< std::setw(8) << (mix ? "on" : "off")
+					<< std::setw(12) << nkeys - buff.size()
+					<< std::setw(12) << std::setprecision(4) << uniform
+					<< std::setw(12) << ns/nkeys << endl;
+			}
+		}
+	}
+	cout << endl;
+}
+
+/**
+ * @brief Draws keys 0..n-1 with probability proportional to 1/(k+1)^alpha.
+ */
+class zipf_keys
+{
+public:
+	zipf_keys(size_t n, double alpha) : m_cdf(n)
+	{
+		double sum = 0;
+		for(size_t ii=0; ii<n; ii++) {
+			sum += 1/pow(ii+1, alpha);
+			m_cdf[ii] = sum;
+		}
+		for(size_t ii=0; ii<n; ii++)
+			m_cdf[ii] /= sum;
+	};
+
+	template <class RNG>
+	int operator()(RNG& rng)
+	{
+		double u = std::uniform_real_distribution<double>(0, 1)(rng);
+		return std::lower_bound(m_cdf.begin(), m_cdf.end(), u) - m_cdf.begin();
+	};
+
+private:
+	std::vector<double> m_cdf;
+};
+
+/**
+ * @brief Compare direct mapped placement with two_choice placement on a
+ * Zipfian workload over a key space 4x the largest table. Zipf ranks are the
+ * keys themselves, so hashes are mixed in both modes. Reports hit ratio,
+ * hit ratio per MB of buffer, and the cost of find() for stored and absent 
+ * keys.
+ */
+void bench_twochoice()
+{
+	const size_t NREQ = 1000000;
+	const size_t UNIVERSE = 64*1024;
+
+	std::default_random_engine rng(1);
+	zipf_keys zipf(UNIVERSE, 0.9);
+	std::vector<int> trace(NREQ);
+	for(size_t ii=0; ii<NREQ; ii++)
+		trace[ii] = zipf(rng);
+
+	cout << "twochoice: zipf(0.9) over " << UNIVERSE << " keys, " << NREQ 
+		<< " requests" << endl;
+	cout << std::setw(10) << "buckets" << std::setw(8) << "mode" 
+		<< std::setw(10) << "hit" << std::setw(10) << "MB"
+		<< std::setw(10) << "hit/MB" << std::setw(14) << "find hit ns"
+		<< std::setw(14) << "find miss ns" << endl;
+
+	for(size_t buckets = 2048; buckets <= 16384; buckets *= 2) {
+		for(int two=0; two<2; two++) {
+			unordered_buffer<int, double> buff(buckets);
+			buff.seed(1);
+			buff.hash_mixing(true);
+			buff.two_choice(two != 0);
+
+			size_t hits = 0;
+			for(size_t ii=0; ii<NREQ; ii++) {
+				auto ret = buff.insert(std::make_pair(trace[ii], 1.));
+				if(!ret.second && ret.first->first == trace[ii])
+					hits++;
+			}
+
+			// lookup cost, keys in the buffer and keys outside the universe
+			std::vector<int> present;
+			for(int kk=0; kk<(int)UNIVERSE && present.size()<1000; kk++) {
+				if(buff.count(kk))
+					present.push_back(kk);
+			}
+			const size_t REPS = 1000;
+			size_t found = 0;
+			auto t0 = bclock::now();
+			for(size_t rr=0; rr<REPS; rr++) {
+				for(size_t ii=0; ii<present.size(); ii++)
+					found += buff.count(present[ii]);
+			}
+			auto t1 = bclock::now();
+			for(size_t rr=0; rr<REPS; rr++) {
+				for(size_t ii=0; ii<present.size(); ii++)
+					found += buff.count(present[ii]+UNIVERSE);
+			}
+			auto t2 = bclock::now();
+			double nlook = (double)REPS*present.size();
+			double mb = buff.memory_usage()/(1024.*1024.);
+
+			cout << std::setw(10) << buckets << std::setw(8) << (two ? "two" : "direct")
+				<< std::setw(10) << std::setprecision(4) << (double)hits/NREQ
+				<< std::setw(10) << mb
+				<< std::setw(10) << (double)hits/NREQ/mb
+				<< std::setw(14) << std::chrono::duration<double, std::nano>(t1-t0).count()/nlook
+				<< std::setw(14) << std::chrono::duration<double, std::nano>(t2-t1).count()/nlook
+				<< (found == 0 ? " !" : "") << endl;
+		}
+	}
+	cout << endl;
+}
+
+/**
+ * @brief Hit ratio with and without ghost history (and the victim stash) on
+ * Zipfian workloads of varying skew.
+ */
+void bench_ghost()
+{
+	const size_t NREQ = 1000000;
+	const size_t UNIVERSE = 64*1024;
+	const size_t BUCKETS = 4096;
+
+	cout << "ghost: " << BUCKETS << " buckets, " << UNIVERSE << " keys, " 
+		<< NREQ << " requests" << endl;
+	cout << std::setw(8) << "alpha" << std::setw(10) << "plain" 
+		<< std::setw(10) << "ghost" << std::setw(14) << "ghost+stash" << endl;
+
+	const double ALPHAS[] = {0.6, 0.8, 1.0, 1.2};
+	for(double alpha : ALPHAS) {
+		std::default_random_engine rng(1);
+		zipf_keys zipf(UNIVERSE, alpha);
+		std::vector<int> trace(NREQ);
+		for(size_t ii=0; ii<NREQ; ii++)
+			trace[ii] = zipf(rng);
+
+		cout << std::setw(8) << alpha;
+		for(int mode=0; mode<3; mode++) {
+			unordered_buffer<int, double> buff(BUCKETS);
+			buff.seed(1);
+			buff.hash_mixing(true);
+			if(mode >= 1)
+				buff.ghost_history(BUCKETS);
+			if(mode >= 2)
+				buff.victim_stash(16);
+
+			size_t hits = 0;
+			for(size_t ii=0; ii<NREQ; ii++) {
+				auto ret = buff.insert(std::make_pair(trace[ii], 1.));
+				if(!ret.second && ret.first->first == trace[ii])
+					hits++;
+			}
+			cout << std::setw(mode == 2 ? 14 : 10) << std::setprecision(4) 
+				<< (double)hits/NREQ;
+		}
+		cout << endl;
+	}
+	cout << endl;
+}
+
+/**
+ * @brief Time a Zipf trace of inserts into a buffer and print one row.
+ */
+template <class Buffer>
+void time_inserts(const char* name, Buffer& buff, const std::vector<int>& trace)
+{
+	size_t hits = 0;
+	auto t0 = bclock::now();
+	for(size_t ii=0; ii<trace.size(); ii++) {
+		auto ret = buff.insert(std::make_pair(trace[ii], 1.));
+		if(!ret.second && ret.first->first == trace[ii])
+			hits++;
+	}
+	auto t1 = bclock::now();
+
+	cout << std::setw(10) << buff.bucket_count() << std::setw(10) << name 
+		<< std::setw(10) << std::setprecision(4) << (double)hits/trace.size()
+		<< std::setw(12) << std::chrono::duration<double, std::nano>(t1-t0)
+		.count()/trace.size() << endl;
+}
+
+/**
+ * @brief Cost of an insert into a heap allocated unordered_buffer and a
+ * static_unordered_buffer of the same size, where the bucket modulus is a
+ * compile time constant. A power of two and an odd bucket count.
+ */
+void bench_static()
+{
+	const size_t NREQ = 4000000;
+	const size_t BUCKETS = 4096;
+
+	std::default_random_engine rng(1);
+	zipf_keys zipf(4*BUCKETS, 0.9);
+	std::vector<int> trace(NREQ);
+	for(size_t ii=0; ii<NREQ; ii++)
+		trace[ii] = zipf(rng);
+
+	cout << "static: zipf(0.9) over " << 4*BUCKETS << " keys, " << NREQ 
+		<< " requests" << endl;
+	cout << std::setw(10) << "buckets" << std::setw(10) << "buffer" 
+		<< std::setw(10) << "hit" << std::setw(12) << "ns/insert" << endl;
+
+	unordered_buffer<int, double> dyn(BUCKETS);
+	dyn.seed(1);
+	time_inserts("dynamic", dyn, trace);
+
+	static_unordered_buffer<int, double, BUCKETS> fixed;
+	fixed.seed(1);
+	time_inserts("static", fixed, trace);
+
+	unordered_buffer<int, double> dynodd(BUCKETS-1);
+	dynodd.seed(1);
+	time_inserts("dynamic", dynodd, trace);
+
+	static_unordered_buffer<int, double, BUCKETS-1> fixedodd;
+	fixedodd.seed(1);
+	time_inserts("static", fixedodd, trace);
+	cout << endl;
+}
+
+/**
+ * @brief Lookup throughput of a locked shared buffer from several threads,
+ * with and without a thread_local_front per thread. Zipf(1.0) keys that are
+ * all preloaded, so the difference is the lock and cacheline traffic.
+ */
+void bench_front()
+{
+	typedef concurrent_unordered_buffer<int, double> shared_buffer;
+	const size_t NREQ = 2000000;
+	const int UNIVERSE = 4096;
+
+	std::default_random_engine rng(1);
+	zipf_keys zipf(UNIVERSE, 1.0);
+	std::vector<int> trace(NREQ);
+	for(size_t ii=0; ii<NREQ; ii++)
+		trace[ii] = zipf(rng);
+
+	cout << "front: zipf(1.0) over " << UNIVERSE << " keys, " << NREQ 
+		<< " gets per thread" << endl;
+	cout << std::setw(10) << "threads" << std::setw(14) << "shared ns/get"
+		<< std::setw(14) << "front ns/get" << endl;
+
+	for(size_t nthreads = 1; nthreads <= 8; nthreads *= 2) {
+		cout << std::setw(10) << nthreads;
+		for(int front=0; front<2; front++) {
+			shared_buffer shared(4*UNIVERSE);
+			shared.with([](shared_buffer::buffer_type& b) { 
+					b.seed(1); b.hash_mixing(true); });
+			for(int kk=0; kk<UNIVERSE; kk++)
+				shared.insert(kk, kk);
+
+			std::vector<std::thread> threads;
+			auto t0 = bclock::now();
+			for(size_t tt=0; tt<nthreads; tt++) {
+				threads.push_back(std::thread([&, tt]() {
+					thread_local_front<shared_buffer, 1024> local(shared, 1<<16);
+					double value, sum = 0;
+					for(size_t ii=0; ii<NREQ; ii++) {
+						int key = trace[(ii + tt*NREQ/nthreads)%NREQ];
+						if(front ? local.get(key, value) : shared.get(key, value))
+							sum += value;
+					}
+					if(sum < 0)
+						cerr << sum;
+				}));
+			}
+			for(auto& th : threads)
+				th.join();
+			auto t1 = bclock::now();
+			cout << std::setw(14) << std::setprecision(4) 
+				<< std::chrono::duration<double, std::nano>(t1-t0).count()/NREQ;
+		}
+		cout << endl;
+	}
+	cout << endl;
+}
+
+/**
+ * @brief Per key lookup cost of find() against find_batch() with different
+ * numbers of lookups in flight, on tables from cache sized to far larger than
+ * the last level cache. Half the keys are stored, half are not.
+ */
+void bench_interleave()
+{
+	const size_t NLOOK = 1 << 22;
+	typedef unordered_buffer<uint64_t, uint64_t> big_buffer;
+	const size_t GROUPS[] = {1, 4, 8, 16, 32};
+
+	cout << "interleave: " << NLOOK << " lookups, ns/key" << endl;
+	cout << std::setw(10) << "buckets" << std::setw(10) << "MB" 
+		<< std::setw(10) << "find";
+	for(size_t group : GROUPS)
+		cout << std::setw(8) << "g=" << std::setw(2) << std::left << group 
+			<< std::right;
+	cout << endl;
+
+	for(size_t buckets = 1 << 14; buckets <= (1 << 22); buckets <<= 4) {
+		big_buffer buff(buckets);
+		buff.seed(1);
+		buff.hash_mixing(true);
+		unordered_buffer_wyrand rng(1);
+		for(size_t ii=0; ii<buckets; ii++) {
+			uint64_t key = rng();
+			buff.insert(std::make_pair(key, key));
+		}
+
+		std::vector<uint64_t> keys;
+		keys.reserve(NLOOK);
+		for(auto it=buff.begin(); it!=buff.end() && keys.size()<NLOOK/2; ++it)
+			keys.push_back(it->first);
+		while(keys.size() < NLOOK)
+			keys.push_back(rng());
+		std::shuffle(keys.begin(), keys.end(), std::default_random_engine(1));
+
+		const big_buffer& cbuff = buff;
+		uint64_t sum = 0;
+		auto t0 = bclock::now();
+		for(size_t ii=0; ii<keys.size(); ii++)
+			sum += cbuff.count(keys[ii]);
+		auto t1 = bclock::now();
+
+		cout << std::setw(10) << buckets << std::setw(10) << std::setprecision(4)
+			<< buff.memory_usage()/(1024.*1024.) << std::setw(10) 
+			<< std::chrono::duration<double, std::nano>(t1-t0).count()/keys.size();
+
+		std::vector<const uint64_t*> out(keys.size());
+		for(size_t group : GROUPS) {
+			auto t2 = bclock::now();
+			size_t found = cbuff.find_batch(keys.data(), keys.size(), out.data(), 
+					group);
+			auto t3 = bclock::now();
+			cout << std::setw(10) << std::chrono::duration<double, std::nano>(
+					t3-t2).count()/keys.size();
+			if(found != sum)
+				cout << " !";
+		}
+		cout << endl;
+	}
+	cout << endl;
+}
+
+/**
+ * @brief Time a plain copy, a copy_on_write copy and the first write to the
+ * original after it, print one row.
+ */
+template <class Buffer, class V>
+void time_clone(const char* name, Buffer& buff, V value)
+{
+	auto ms = [](bclock::time_point a, bclock::time_point b) {
+		return std::chrono::duration<double, std::milli>(b-a).count();
+	};
+
+	auto t0 = bclock::now();
+	Buffer copy = buff.clone();
+	auto t1 = bclock::now();
+
+	buff.copy_on_write(true);
+	auto t2 = bclock::now();
+	Buffer cow = buff.clone();
+	auto t3 = bclock::now();
+	buff.insert(std::make_pair(buff.bucket_count(), value));
+	auto t4 = bclock::now();
+	buff.copy_on_write(false);
+
+	cout << std::setw(14) << name << std::setw(10) << std::setprecision(4)
+		<< buff.memory_usage()/(1024.*1024.) << std::setw(12) << ms(t0, t1) 
+		<< std::setw(12) << ms(t2, t3) << std::setw(16) << ms(t3, t4) 
+		<< (copy.size() == cow.size() ? "" : " !") << endl;
+}
+
+/**
+ * @brief Time to copy a full buffer: trivially copyable elements (one
+ * memcpy), std::string values (element wise), and a copy_on_write copy
+ * followed by the first write to the original.
+ */
+void bench_clone()
+{
+	const size_t BUCKETS = 1 << 22;
+
+	cout << "clone: " << BUCKETS << " buckets, full" << endl;
+	cout << std::setw(14) << "elements" << std::setw(10) << "MB" 
+		<< std::setw(12) << "copy ms" << std::setw(12) << "cow ms"
+		<< std::setw(16) << "first write ms" << endl;
+
+	unordered_buffer<uint64_t, uint64_t> ints(BUCKETS);
+	unordered_buffer<uint64_t, std::string> strings(BUCKETS);
+	ints.seed(1);
+	strings.seed(1);
+	for(size_t ii=0; ii<BUCKETS; ii++) {
+		ints.insert(std::make_pair(ii, ii));
+		strings.insert(std::make_pair(ii, std::string("value")));
+	}
+
+	time_clone("uint64", ints, (uint64_t)0);
+	time_clone("string", strings, std::string("x"));
+	cout << endl;
+}
+
+/**
+ * @brief Time to freeze a full buffer and the cost of a lookup (half hits,
+ * half misses) in the buffer and in its frozen copy.
+ */
+void bench_frozen()
+{
+	const size_t NLOOK = 1 << 22;
+	typedef unordered_buffer<uint64_t, uint64_t> big_buffer;
+	auto ns = [](bclock::time_point a, bclock::time_point b, size_t n) {
+		return std::chrono::duration<double, std::nano>(b-a).count()/n;
+	};
+
+	cout << "frozen: " << NLOOK << " lookups" << endl;
+	cout << std::setw(10) << "elements" << std::setw(12) << "MB" 
+		<< std::setw(12) << "frozen MB" << std::setw(14) << "freeze ns/el"
+		<< std::setw(10) << "find ns" << std::setw(12) << "frozen ns" 
+		<< endl;
+
+	for(size_t buckets = 1 << 14; buckets <= (1 << 22); buckets <<= 4) {
+		big_buffer buff(buckets);
+		buff.seed(1);
+		buff.hash_mixing(true);
+		unordered_buffer_wyrand rng(1);
+		for(size_t ii=0; ii<buckets; ii++) {
+			uint64_t key = rng();
+			buff.insert(std::make_pair(key, key));
+		}
+
+		std::vector<uint64_t> keys;
+		keys.reserve(NLOOK);
+		for(auto it=buff.begin(); it!=buff.end() && keys.size()<NLOOK/2; ++it)
+			keys.push_back(it->first);
+		while(keys.size() < NLOOK)
+			keys.push_back(rng());
+		std::shuffle(keys.begin(), keys.end(), std::default_random_engine(1));
+
+		auto t0 = bclock::now();
+		auto frozen = freeze(buff);
+		auto t1 = bclock::now();
+
+		const big_buffer& cbuff = buff;
+		uint64_t sum = 0;
+		auto t2 = bclock::now();
+		for(size_t ii=0; ii<keys.size(); ii++)
+			sum += cbuff.count(keys[ii]);
+		auto t3 = bclock::now();
+		uint64_t fsum = 0;
+		for(size_t ii=0; ii<keys.size(); ii++)
+			fsum += frozen.count(keys[ii]);
+		auto t4 = bclock::now();
+
+		cout << std::setw(10) << frozen.size() << std::setw(12) 
+			<< std::setprecision(4) << buff.memory_usage()/(1024.*1024.)
+			<< std::setw(12) << frozen.memory_usage()/(1024.*1024.) 
+			<< std::setw(14) << ns(t0, t1, frozen.size()) 
+			<< std::setw(10) << ns(t2, t3, keys.size())
+			<< std::setw(12) << ns(t3, t4, keys.size()) 
+			<< (sum == fsum ? "" : " !") << endl;
+	}
+	cout << endl;
+}
+
+/**
+ * @brief Insert a zipf trace of string keys/values into a buffer.
+ */
+template <class Str>
+void time_strings(const char* name, const std::vector<int>& trace, 
+		size_t buckets)
+{
+	std::vector<std::pair<Str, Str>> items;
+	for(size_t ii=0; ii<4*buckets; ii++) {
+		std::string s = "session:" + std::to_string(100000000+ii);
+		items.push_back(std::make_pair(Str(s), Str("value:" + s)));
+	}
+
+	unordered_buffer<Str, Str> buff(buckets);
+	buff.seed(1);
+	auto t0 = bclock::now();
+	for(size_t ii=0; ii<trace.size(); ii++)
+		buff.insert(items[trace[ii]]);
+	auto t1 = bclock::now();
+
+	cout << std::setw(10) << buckets << std::setw(16) << name 
+		<< std::setw(12) << std::setprecision(4) 
+		<< std::chrono::duration<double, std::nano>(t1-t0).count()/trace.size()
+		<< endl;
+}
+
+/**
+ * @brief Inserts with short string keys and values, std::string (17 and 23
+ * characters, past the small string optimization) against inline_string.
+ */
+void bench_inline()
+{
+	const size_t NREQ = 4000000;
+
+	cout << "inline: zipf(0.9) over 4x buckets keys, " << NREQ 
+		<< " requests" << endl;
+	cout << std::setw(10) << "buckets" << std::setw(16) << "strings" 
+		<< std::setw(12) << "ns/insert" << endl;
+
+	for(size_t buckets = 1 << 12; buckets <= (1 << 20); buckets <<= 4) {
+		std::default_random_engine rng(1);
+		zipf_keys zipf(4*buckets, 0.9);
+		std::vector<int> trace(NREQ);
+		for(size_t ii=0; ii<NREQ; ii++)
+			trace[ii] = zipf(rng);
+
+		time_strings<std::string>("std::string", trace, buckets);
+		time_strings<inline_string<23>>("inline_string", trace, buckets);
+	}
+	cout << endl;
+}
+
+/**
+ * @brief Heavy hitter counting over a zipf trace: find then insert or 
+ * update, upsert, and batched upsert.
+ */
+void bench_upsert()
+{
+	const size_t NREQ = 4000000;
+	typedef unordered_buffer<uint64_t, uint64_t> counter;
+	auto ns = [](bclock::time_point a, bclock::time_point b, size_t n) {
+		return std::chrono::duration<double, std::nano>(b-a).count()/n;
+	};
+	auto add = [](uint64_t& stored, const uint64_t& v) { stored += v; };
+
+	cout << "upsert: zipf(0.9) over 4x buckets keys, " << NREQ 
+		<< " requests, ns/update" << endl;
+	cout << std::setw(10) << "buckets" << std::setw(14) << "find+insert"
+		<< std::setw(10) << "upsert" << std::setw(10) << "batched" << endl;
+
+	for(size_t buckets = 1 << 12; buckets <= (1 << 22); buckets <<= 5) {
+		std::default_random_engine rng(1);
+		zipf_keys zipf(4*buckets, 0.9);
+		std::vector<std::pair<uint64_t, uint64_t>> trace(NREQ);
+		for(size_t ii=0; ii<NREQ; ii++)
+			trace[ii] = std::make_pair((uint64_t)zipf(rng)*0x9e3779b97f4a7c15ULL,
+					(uint64_t)1);
+
+		counter a(buckets), b(buckets), c(buckets);
+		a.seed(1);
+		b.seed(1);
+		c.seed(1);
+
+		auto t0 = bclock::now();
+		for(size_t ii=0; ii<NREQ; ii++) {
+			auto it = a.find(trace[ii].first);
+			if(it != a.end()) {
+				it->second += trace[ii].second;
+				a.touch(trace[ii].first);
+			} else {
+				a.insert(trace[ii]);
+			}
+		}
+		auto t1 = bclock::now();
+		for(size_t ii=0; ii<NREQ; ii++)
+			b.upsert(trace[ii].first, trace[ii].second, add);
+		auto t2 = bclock::now();
+		c.upsert(trace.begin(), trace.end(), add);
+		auto t3 = bclock::now();
+
+		cout << std::setw(10) << buckets << std::setw(14) << std::setprecision(4)
+			<< ns(t0, t1, NREQ) << std::setw(10) << ns(t1, t2, NREQ) 
+			<< std::setw(10) << ns(t2, t3, NREQ) << endl;
+	}
+	cout << endl;
+}
+
+/**
+ * @brief Sampled miss ratio curve against the miss ratios of real buffers
+ * of each size, and the cost of sampling on inserts.
+ */
+void bench_mrc()
+{
+	const size_t NREQ = 2000000;
+	const size_t UNIVERSE = 256*1024;
+	const size_t BUCKETS = 16384;
+	auto ns = [](bclock::time_point a, bclock::time_point b, size_t n) {
+		return std::chrono::duration<double, std::nano>(b-a).count()/n;
+	};
+
+	cout << "mrc: " << BUCKETS << " buckets sampled at 1%, " << UNIVERSE 
+		<< " keys, " << NREQ << " requests" << endl;
+	cout << std::setw(8) << "alpha" << std::setw(10) << "buckets" 
+		<< std::setw(12) << "estimated" << std::setw(10) << "actual" << endl;
+
+	const double ALPHAS[] = {0.8, 1.0};
+	for(double alpha : ALPHAS) {
+		std::default_random_engine rng(1);
+		zipf_keys zipf(UNIVERSE, alpha);
+		std::vector<int> trace(NREQ);
+		for(size_t ii=0; ii<NREQ; ii++)
+			trace[ii] = zipf(rng);
+
+		unordered_buffer<int, double> plain(BUCKETS), sampled(BUCKETS);
+		plain.seed(1);
+		plain.hash_mixing(true);
+		sampled.seed(1);
+		sampled.hash_mixing(true);
+		sampled.mrc_sampling(0.01);
+
+		auto t0 = bclock::now();
+		for(size_t ii=0; ii<NREQ; ii++)
+			plain.insert(std::make_pair(trace[ii], 1.));
+		auto t1 = bclock::now();
+		for(size_t ii=0; ii<NREQ; ii++)
+			sampled.insert(std::make_pair(trace[ii], 1.));
+		auto t2 = bclock::now();
+
+		for(auto& point : sampled.miss_ratio_curve()) {
+			unordered_buffer<int, double> real(point.first);
+			real.seed(2);
+			real.hash_mixing(true);
+			size_t misses = 0;
+			for(size_t ii=0; ii<NREQ; ii++) {
+				misses += !real.count(trace[ii]);
+				real.insert(std::make_pair(trace[ii], 1.));
+			}
+			cout << std::setw(8) << alpha << std::setw(10) << point.first
+				<< std::setw(12) << std::setprecision(4) << point.second 
+				<< std::setw(10) << (double)misses/NREQ << endl;
+		}
+		cout << "ns/insert without sampling " << std::setprecision(4) 
+			<< ns(t0, t1, NREQ) << ", with " << ns(t1, t2, NREQ) 
+			<< " (rate " << sampled.mrc_sampling() << ")" << endl;
+	}
+	cout << endl;
+}
+
+/**
+ * @brief Latency percentiles of insert, find and operator[] from sampled
+ * histograms, and hardware events per operation where the kernel allows
+ * perf_event_open. The timed operations include the timer's own cost,
+ * shown on the first line.
+ */
+void bench_latency()
+{
+	const size_t NREQ = 2000000;
+	const size_t BUCKETS = 65536;
+	const uint64_t INTERVAL = 16;
+	typedef unordered_buffer<int, double> buffer;
+
+	latency_histogram empty(1);
+	for(int ii=0; ii<100000; ii++) {
+		latency_histogram::timer t(empty);
+	}
+
+	std::default_random_engine rng(1);
+	zipf_keys zipf(4*BUCKETS, 0.9);
+	std::vector<int> trace(NREQ);
+	for(size_t ii=0; ii<NREQ; ii++)
+		trace[ii] = zipf(rng);
+
+	cout << "latency: " << BUCKETS << " buckets, zipf(0.9) over " 
+		<< 4*BUCKETS << " keys, " << NREQ << " requests, 1 in " << INTERVAL
+		<< " timed, ns (timer alone: p50 " << empty.quantile(0.5) << ")" 
+		<< endl;
+	cout << std::setw(12) << "op" << std::setw(8) << "p50" << std::setw(8)
+		<< "p90" << std::setw(8) << "p99" << std::setw(8) << "p99.9" 
+		<< std::setw(10) << "max";
+	for(int cc=0; cc<perf_counters::N; cc++)
+		cout << std::setw(13) << perf_counters::name(cc);
+	cout << endl;
+
+	buffer a(BUCKETS), b(BUCKETS);
+	a.seed(1);
+	a.hash_mixing(true);
+	b.seed(1);
+	b.hash_mixing(true);
+
+	perf_counters counters;
+	double sink = 0;
+	for(int op=0; op<3; op++) {
+		const char* OPS[] = {"insert", "find", "operator[]"};
+		latency_histogram hist(INTERVAL);
+		counters.start();
+		for(size_t ii=0; ii<NREQ; ii++) {
+			latency_histogram::timer t(hist);
+			if(op == 0) {
+				a.insert(std::make_pair(trace[ii], 1.));
+			} else if(op == 1) {
+				auto it = a.find(trace[ii]);
+				if(it != a.end())
+					sink += it->second;
+			} else {
+				sink += b[trace[ii]];
+			}
+		}
+		uint64_t counts[perf_counters::N];
+		counters.stop(counts);
+
+		cout << std::setw(12) << OPS[op] << std::setw(8) << hist.quantile(0.5)
+			<< std::setw(8) << hist.quantile(0.9) << std::setw(8) 
+			<< hist.quantile(0.99) << std::setw(8) << hist.quantile(0.999)
+			<< std::setw(10) << hist.max();
+		for(int cc=0; cc<perf_counters::N; cc++) {
+			if(counters.available(cc))
+				cout << std::setw(13) << std::setprecision(3) 
+					<< (double)counts[cc]/NREQ;
+			else
+				cout << std::setw(13) << "n/a";
+		}
+		cout << endl;
+	}
+	if(sink < 0)
+		cout << sink << endl;
+	cout << endl;
+}
+
+int main(int argc, char** argv)
+{
+	srand(1);
+
+	// run every benchmark if none are named on the command line
+	std::vector<std::string> names(argv+1, argv+argc);
+	auto run = [&](const std::string& name) {
+		if(names.empty())
+			return true;
+		for(auto& n : names) {
+			if(n == name)
+				return true;
+		}
+		return false;
+	};
+
+	if(run("collisions"))
+		bench_collisions();
+	if(run("twochoice"))
+		bench_twochoice();
+	if(run("ghost"))
+		bench_ghost();
+	if(run("static"))
+		bench_static();
+	if(run("front"))
+		bench_front();
+	if(run("interleave"))
+		bench_interleave();
+	if(run("clone"))
+		bench_clone();
+	if(run("frozen"))
+		bench_frozen();
+	if(run("inline"))
+		bench_inline();
+	if(run("upsert"))
+		bench_upsert();
+	if(run("mrc"))
+		bench_mrc();
+	if(run("latency"))
+		bench_latency();
+
+	return 0;
+}
@@ -0,0 +1,76 @@
+#ifndef UNORDERED_BUFFER_REDUCE_H
+#define UNORDERED_BUFFER_REDUCE_H
+
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <stdexcept>
+
+#include "unordered_buffer.h"
+
+/**
+ * @brief Merge a set of buffers (e.g. one per worker thread) into the first
+ * one by a tree reduction: in each round buffer i takes in buffer i+stride,
+ * for stride 1, 2, 4..., so n buffers are combined in log2(n) rounds. The
+ * merges of a round run in parallel, and when a round has fewer merges than
+ * threads each merge splits its buckets over the spare threads (see
+ * unordered_buffer::merge). The other buffers are left as they were part
+ * way through, only the first one holds the result. combine is called
+ * from several threads at once, so it must be thread safe.
+ *
+ * @tparam Buffer	unordered_buffer type
+ * @tparam Combine	Callable as combine(T& stored, const T& incoming)
+ * @param buffers	Buffers to combine, at least one
+ * @param combine	Value merge function for keys held by both sides
+ * @param threads	Number of threads to use
+ *
+ * @return 			The first buffer, holding everything
+ */
+template <class Buffer, class Combine>
+Buffer& merge_reduce(const std::vector<Buffer*>& buffers, Combine combine,
+		size_t threads = std::max(1u, std::thread::hardware_concurrency()))
+{
+	if(buffers.empty())
+		throw std::invalid_argument("merge_reduce needs a buffer");
+	threads = std::max<size_t>(1, threads);
+
+	size_t n = buffers.size();
+	for(size_t stride=1; stride<n; stride*=2) {
+		std::vector<size_t> dst;
+		for(size_t ii=0; ii+stride<n; ii+=2*stride)
+			dst.push_back(ii);
+
+		size_t workers = std::min(threads, dst.size());
+		size_t split = std::max<size_t>(1, threads/dst.size());
+		std::atomic<size_t> next(0);
+		auto work = [&]() {
+			for(size_t pp=next++; pp<dst.size(); pp=next++) {
+				buffers[dst[pp]]->merge(*buffers[dst[pp]+stride], combine, 
+						split);
+			}
+		};
+
+		std::vector<std::thread> pool;
+		for(size_t ww=1; ww<workers; ww++)
+			pool.push_back(std::thread(work));
+		work();
+		for(auto& th : pool)
+			th.join();
+	}
+	return *buffers[0];
+}
+
+/**
+ * @brief merge_reduce keeping the first buffer's value for keys held by
+ * several buffers
+ */
+template <class Buffer>
+Buffer& merge_reduce(const std::vector<Buffer*>& buffers)
+{
+	typedef typename std::remove_reference<decltype(
+			buffers[0]->begin()->second)>::type T;
+	return merge_reduce(buffers, [](T&, const T&) {});
+}
+
+#endif //UNORDERED_BUFFER_REDUCE_H
@@ -0,0 +1,82 @@
+#include <utility>
+#include <iostream>
+#include <vector>
+#include <thread>
+#include <memory>
+#include "unordered_buffer_reduce.h"
+
+using std::cerr;
+using std::endl;
+
+typedef unordered_buffer<int, long> counter;
+
+/**
+ * @brief One window of per-thread counters: every worker counts the same
+ * hot keys plus its own cold ones.
+ */
+std::vector<std::unique_ptr<counter>> fill(size_t nworkers)
+{
+	const size_t BUCKETS = 1 << 14;
+	std::vector<std::unique_ptr<counter>> workers;
+	for(size_t ww=0; ww<nworkers; ww++) {
+		workers.emplace_back(new counter(BUCKETS));
+		workers.back()->seed(ww+1);
+	}
+
+	std::vector<std::thread> threads;
+	for(size_t ww=0; ww<nworkers; ww++) {
+		threads.push_back(std::thread([&workers, ww]() {
+			counter& c = *workers[ww];
+			auto add = [](long& stored, const long& v) { stored += v; };
+			for(int ii=0; ii<200000; ii++) {
+				// cold keys share buckets with each other, not with hot keys
+				int key = ii%5 ? ii%100 : 100 + 16384*(int)(ww+1) + ii%16000;
+				c.upsert(key, 1L, add);
+			}
+		}));
+	}
+	for(auto& th : threads)
+		th.join();
+	return workers;
+}
+
+int main()
+{
+	const size_t NWORKERS = 7;
+	auto add = [](long& stored, const long& v) { stored += v; };
+
+	auto one = fill(NWORKERS);
+	auto many = fill(NWORKERS);
+	std::vector<counter*> a, b;
+	for(size_t ww=0; ww<NWORKERS; ww++) {
+		a.push_back(one[ww].get());
+		b.push_back(many[ww].get());
+	}
+
+	counter& serial = merge_reduce(a, add, 1);
+	counter& parallel = merge_reduce(b, add, 4);
+
+	// hot keys (the ones not a multiple of 5) got 2000 hits from each 
+	// worker, and kept their buckets
+	size_t hot = 0;
+	for(int kk=0; kk<100; kk++) {
+		if(kk%5)
+			hot += (parallel.count(kk) && parallel.at(kk) == 2000*(long)NWORKERS);
+	}
+
+	bool same = serial.size() == parallel.size();
+	for(auto it=serial.begin(); it!=serial.end(); ++it) {
+		same = same && parallel.count(it->first) && 
+			parallel.at(it->first) == it->second &&
+			parallel.priority(it->first) == serial.priority(it->first);
+	}
+
+	cerr << NWORKERS << " buffers reduced to " << parallel.size() 
+		<< " elements, " << hot << "/80 hot keys exact" << endl;
+	if(!same || hot != 80) {
+		cerr << "Parallel reduction differs" << endl;
+		return 1;
+	}
+
+	return 0;
+}
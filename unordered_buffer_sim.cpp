@@ -0,0 +1,493 @@
+#include <utility>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <sstream>
+#include <vector>
+#include <algorithm>
+#include <list>
+#include <set>
+#include <unordered_map>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <cstdint>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "unordered_buffer.h"
+
+using std::cout;
+using std::cerr;
+using std::endl;
+
+typedef unordered_buffer<uint64_t, uint64_t> sim_buffer;
+
+/**
+ * @brief Settings applied to a fresh buffer before a replay, one row of the
+ * sweep per policy and bucket count. The policies are the cross product of
+ * the parameter lists given on the command line.
+ */
+struct policy
+{
+	std::string name;
+	bool mix;
+	bool two;
+	size_t stash;
+	double ghost;	// ghost slots per bucket
+};
+
+/**
+ * @brief Outcome of replaying a trace through one cache.
+ */
+struct result
+{
+	size_t hits = 0;
+	size_t admissions = 0;
+	size_t evictions = 0;
+	double ns = 0;
+};
+
+/**
+ * @brief Read-only memory map of a whole file.
+ */
+class mapped_file
+{
+public:
+	mapped_file(const char* path) : m_data(NULL), m_size(0)
+	{
+		int fd = open(path, O_RDONLY);
+		if(fd < 0)
+			return;
+
+		struct stat st;
+		if(fstat(fd, &st) == 0 && st.st_size > 0) {
+			void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if(p != MAP_FAILED) {
+				madvise(p, st.st_size, MADV_SEQUENTIAL);
+				m_data = (const char*)p;
+				m_size = st.st_size;
+			}
+		}
+		close(fd);
+	};
+
+	~mapped_file()
+	{
+		if(m_data)
+			munmap((void*)m_data, m_size);
+	};
+
+	const char* data() const { return m_data; };
+	size_t size() const { return m_size; };
+
+private:
+	const char* m_data;
+	size_t m_size;
+};
+
+/**
+ * @brief Reads the keys of a mapped trace in place, a chunk at a time, so
+ * memory doesn't grow with the trace. Keys are either raw little endian 
+ * uint64s or one decimal key per line; when binary is negative the format
+ * is guessed from the first few kilobytes.
+ */
+class trace_reader
+{
+public:
+	// keys per chunk handed out by read()
+	static const size_t CHUNK = 4096;
+
+	/**
+	 * @brief Constructor
+	 *
+	 * @param file		Mapped trace file
+	 * @param binary	1 = binary, 0 = text, -1 = guess
+	 */
+	trace_reader(const mapped_file& file, int binary)
+		: m_data(file.data()), m_size(file.size()), m_pos(0)
+	{
+		if(binary < 0) {
+			binary = 0;
+			for(size_t ii=0; ii<m_size && ii<4096; ii++) {
+				unsigned char c = m_data[ii];
+				if(!isdigit(c) && !isspace(c)) {
+					binary = 1;
+					break;
+				}
+			}
+		}
+		m_binary = binary != 0;
+	};
+
+	/**
+	 * @brief Start again from the first key
+	 */
+	void rewind()
+	{
+		m_pos = 0;
+	};
+
+	/**
+	 * @brief Next keys in request order
+	 *
+	 * @param out	Output, room for max keys
+	 * @param max	Most keys to read
+	 *
+	 * @return 		Number of keys read, 0 at the end of the trace
+	 */
+	size_t read(uint64_t* out, size_t max)
+	{
+		size_t n = 0;
+		if(m_binary) {
+			n = std::min(max, (m_size - m_pos)/sizeof(uint64_t));
+			memcpy(out, m_data + m_pos, n*sizeof(uint64_t));
+			m_pos += n*sizeof(uint64_t);
+			return n;
+		}
+
+		uint64_t key = 0;
+		bool inkey = false;
+		for(; m_pos<m_size && n<max; m_pos++) {
+			if(isdigit((unsigned char)m_data[m_pos])) {
+				key = key*10 + (m_data[m_pos]-'0');
+				inkey = true;
+			} else if(inkey) {
+				out[n++] = key;
+				key = 0;
+				inkey = false;
+			}
+		}
+		if(inkey)
+			out[n++] = key;
+		return n;
+	};
+
+private:
+	const char* m_data;
+	size_t m_size;
+	size_t m_pos;
+	bool m_binary;
+};
+
+/**
+ * @brief Replay the trace through an unordered_buffer. Every request is an
+ * insert: a hit bumps the priority, a miss rolls for admission. Evictions
+ * are counted by on_evict, so an incumbent moved into the victim stash 
+ * (still cached) is not one.
+ */
+result replay(trace_reader& trace, size_t buckets, const policy& pol, 
+		uint64_t seed)
+{
+	result res;
+	sim_buffer buff(buckets);
+	buff.seed(seed);
+	buff.hash_mixing(pol.mix);
+	buff.two_choice(pol.two);
+	buff.victim_stash(pol.stash);
+	buff.ghost_history((size_t)(pol.ghost*buckets));
+	buff.on_evict([&](const uint64_t&, const uint64_t&, int) {
+			res.evictions++;
+		});
+
+	// only the inserts are timed, not reading the trace
+	uint64_t keys[trace_reader::CHUNK];
+	trace.rewind();
+	for(size_t n; (n = trace.read(keys, trace_reader::CHUNK)) > 0; ) {
+		auto t0 = std::chrono::steady_clock::now();
+		for(size_t ii=0; ii<n; ii++) {
+			auto ret = buff.insert(std::make_pair(keys[ii], keys[ii]));
+			if(ret.second) {
+				res.admissions++;
+			} else if(ret.first->first == keys[ii]) {
+				res.hits++;
+			}
+		}
+		auto t1 = std::chrono::steady_clock::now();
+		res.ns += std::chrono::duration<double, std::nano>(t1-t0).count();
+	}
+	return res;
+}
+
+/**
+ * @brief Exact fully associative LRU cache with the given capacity.
+ */
+result replay_lru(trace_reader& trace, size_t capacity)
+{
+	result res;
+	std::list<uint64_t> order;
+	std::unordered_map<uint64_t, std::list<uint64_t>::iterator> index;
+
+	uint64_t keys[trace_reader::CHUNK];
+	trace.rewind();
+	for(size_t n; (n = trace.read(keys, trace_reader::CHUNK)) > 0; ) {
+		for(size_t ii=0; ii<n; ii++) {
+			uint64_t key = keys[ii];
+			auto it = index.find(key);
+			if(it != index.end()) {
+				res.hits++;
+				order.splice(order.begin(), order, it->second);
+				continue;
+			}
+
+			res.admissions++;
+			if(order.size() >= capacity) {
+				index.erase(order.back());
+				order.pop_back();
+				res.evictions++;
+			}
+			order.push_front(key);
+			index[key] = order.begin();
+		}
+	}
+	return res;
+}
+
+/**
+ * @brief Belady's optimal replacement, evict the key whose next use is
+ * furthest in the future. Upper bound on the hit ratio for any cache of the
+ * given capacity. Needs the next use of every request (see next_uses()),
+ * the one part of the tool whose memory grows with the trace.
+ */
+result replay_opt(trace_reader& trace, const std::vector<size_t>& next, 
+		size_t capacity)
+{
+	result res;
+	std::set<std::pair<size_t, uint64_t>> bynext;
+	std::unordered_map<uint64_t, size_t> cached;
+
+	uint64_t keys[trace_reader::CHUNK];
+	size_t ii = 0;
+	trace.rewind();
+	for(size_t n; (n = trace.read(keys, trace_reader::CHUNK)) > 0; ) {
+		for(size_t jj=0; jj<n; jj++, ii++) {
+			uint64_t key = keys[jj];
+			auto it = cached.find(key);
+			if(it != cached.end()) {
+				res.hits++;
+				bynext.erase(std::make_pair(it->second, key));
+				it->second = next[ii];
+				bynext.insert(std::make_pair(next[ii], key));
+				continue;
+			}
+
+			// never used again, caching it can't help
+			if(next[ii] == next.size())
+				continue;
+
+			if(cached.size() >= capacity) {
+				auto victim = std::prev(bynext.end());
+				if(victim->first < next[ii])
+					continue;
+				cached.erase(victim->second);
+				bynext.erase(victim);
+				res.evictions++;
+			}
+			res.admissions++;
+			cached[key] = next[ii];
+			bynext.insert(std::make_pair(next[ii], key));
+		}
+	}
+	return res;
+}
+
+/**
+ * @brief Position of the next request for the same key, for every request
+ * (the trace length if there is none), found in one forward pass.
+ *
+ * @param trace		Trace
+ * @param distinct	Output, number of distinct keys
+ *
+ * @return 			Next use per request
+ */
+std::vector<size_t> next_uses(trace_reader& trace, size_t& distinct)
+{
+	std::vector<size_t> next;
+	std::unordered_map<uint64_t, size_t> last;
+	uint64_t keys[trace_reader::CHUNK];
+	trace.rewind();
+	for(size_t n; (n = trace.read(keys, trace_reader::CHUNK)) > 0; ) {
+		for(size_t jj=0; jj<n; jj++) {
+			auto ins = last.insert(std::make_pair(keys[jj], next.size()));
+			if(!ins.second) {
+				next[ins.first->second] = next.size();
+				ins.first->second = next.size();
+			}
+			next.push_back(0);
+		}
+	}
+
+	// keys whose last request is still open are never used again
+	for(auto& kv : last)
+		next[kv.second] = next.size();
+	distinct = last.size();
+	return next;
+}
+
+/**
+ * @brief Split a comma separated list.
+ */
+std::vector<std::string> split(const std::string& str)
+{
+	std::vector<std::string> out;
+	size_t start = 0;
+	while(start <= str.size()) {
+		size_t end = str.find(',', start);
+		if(end == std::string::npos)
+			end = str.size();
+		if(end > start)
+			out.push_back(str.substr(start, end-start));
+		start = end+1;
+	}
+	return out;
+}
+
+/**
+ * @brief Split a comma separated list of numbers.
+ */
+template <class Num>
+std::vector<Num> split_numbers(const std::string& str)
+{
+	std::vector<Num> out;
+	for(auto& s : split(str))
+		out.push_back((Num)strtod(s.c_str(), NULL));
+	return out;
+}
+
+void print_row(const std::string& name, size_t buckets, const result& res,
+		size_t n)
+{
+	cout << std::setw(10) << buckets << std::setw(16) << name
+		<< std::fixed << std::setprecision(4)
+		<< std::setw(10) << (double)res.hits/n
+		<< std::setw(12) << res.admissions
+		<< std::setw(12) << res.evictions;
+	if(res.ns > 0)
+		cout << std::setprecision(1) << std::setw(10) << res.ns/n;
+	else
+		cout << std::setw(10) << "-";
+	cout << endl;
+}
+
+void usage()
+{
+	cerr << "unordered_buffer_sim [options] trace\n"
+		"Replays a key trace through unordered_buffer and reference caches.\n"
+		"  -b          trace is binary little endian uint64 keys\n"
+		"  -t          trace is text, one decimal key per line\n"
+		"              (default: guess from the first 4KB)\n"
+		"  -s N,N,...  bucket counts to sweep (default 1024,4096,16384)\n"
+		"  -m B,B,...  hash mixing off (0) and/or on (1) (default 0)\n"
+		"  -2 B,B,...  two choice placement off and/or on (default 0,1)\n"
+		"  -S N,N,...  victim stash sizes, at most 64 (default 0,16)\n"
+		"  -g R,R,...  ghost slots per bucket, 0 for none (default 0,1)\n"
+		"              every combination of the lists is replayed\n"
+		"  -r SEED     seed for the replacement rolls (default 1)\n"
+		"  -n          skip the LRU and OPT reference caches\n";
+}
+
+int main(int argc, char** argv)
+{
+	int binary = -1;
+	bool bounds = true;
+	uint64_t seed = 1;
+	std::vector<size_t> sizes = {1024, 4096, 16384};
+	std::vector<int> mixes = {0};
+	std::vector<int> twos = {0, 1};
+	std::vector<size_t> stashes = {0, 16};
+	std::vector<double> ghosts = {0, 1};
+	const char* path = NULL;
+
+	for(int ii=1; ii<argc; ii++) {
+		std::string arg = argv[ii];
+		if(arg == "-b") {
+			binary = 1;
+		} else if(arg == "-t") {
+			binary = 0;
+		} else if(arg == "-n") {
+			bounds = false;
+		} else if(arg == "-s" && ii+1 < argc) {
+			sizes = split_numbers<size_t>(argv[++ii]);
+		} else if(arg == "-m" && ii+1 < argc) {
+			mixes = split_numbers<int>(argv[++ii]);
+		} else if(arg == "-2" && ii+1 < argc) {
+			twos = split_numbers<int>(argv[++ii]);
+		} else if(arg == "-S" && ii+1 < argc) {
+			stashes = split_numbers<size_t>(argv[++ii]);
+		} else if(arg == "-g" && ii+1 < argc) {
+			ghosts = split_numbers<double>(argv[++ii]);
+		} else if(arg == "-r" && ii+1 < argc) {
+			seed = strtoull(argv[++ii], NULL, 10);
+		} else if(arg[0] != '-' && !path) {
+			path = argv[ii];
+		} else {
+			usage();
+			return 1;
+		}
+	}
+	if(!path) {
+		usage();
+		return 1;
+	}
+
+	mapped_file file(path);
+	if(!file.data()) {
+		cerr << "Could not map " << path << endl;
+		return 1;
+	}
+	trace_reader trace(file, binary);
+	size_t requests = 0;
+	uint64_t keys[trace_reader::CHUNK];
+	for(size_t n; (n = trace.read(keys, trace_reader::CHUNK)) > 0; )
+		requests += n;
+	if(requests == 0) {
+		cerr << "Empty trace" << endl;
+		return 1;
+	}
+
+	std::vector<policy> policies;
+	for(int mix : mixes) {
+		for(int two : twos) {
+			for(size_t stash : stashes) {
+				for(double ghost : ghosts) {
+					std::ostringstream name;
+					name << "m" << mix << " t" << two << " s" << stash 
+						<< " g" << ghost;
+					policies.push_back(policy{name.str(), mix != 0, two != 0, 
+							stash, ghost});
+				}
+			}
+		}
+	}
+
+	// next use of each request, for Belady
+	std::vector<size_t> next;
+	if(bounds) {
+		size_t distinct = 0;
+		next = next_uses(trace, distinct);
+		cout << requests << " requests, " << distinct << " distinct keys" 
+			<< endl;
+	} else {
+		cout << requests << " requests" << endl;
+	}
+
+	cout << std::setw(10) << "buckets" << std::setw(16) << "policy"
+		<< std::setw(10) << "hit" << std::setw(12) << "admitted"
+		<< std::setw(12) << "evicted" << std::setw(10) << "ns/op" << endl;
+	for(auto buckets : sizes) {
+		for(auto& pol : policies)
+			print_row(pol.name, buckets, replay(trace, buckets, pol, seed),
+					requests);
+		if(bounds) {
+			print_row("lru", buckets, replay_lru(trace, buckets), requests);
+			print_row("opt", buckets, replay_opt(trace, next, buckets),
+					requests);
+		}
+	}
+
+	return 0;
+}
@@ -1,6 +1,12 @@
 #include <utility>
 #include <unordered_map>
 #include <iostream>
+#include <string>
+#include <vector>
+#include <random>
+#include <cmath>
+#include <thread>
+#include <atomic>
 #include "unordered_buffer.h"
 
 using std::cerr;
@@ -81,5 +87,562 @@ int main()
 				<< value << endl;
 		}
 	}
-	
+
+	// identically seeded buffers must make identical replacement decisions
+	unordered_buffer<int, double> seeded1(INNNERCOUNT), seeded2(INNNERCOUNT);
+	unordered_buffer<int, double, std::hash<int>, unordered_buffer_wyrand> 
+		fast1(INNNERCOUNT), fast2(INNNERCOUNT);
+	seeded1.seed(1234);
+	seeded2.seed(1234);
+	fast1.seed(1234);
+	fast2.seed(1234);
+	for(size_t ii=0; ii<OUTERCOUNT*INNNERCOUNT; ii++) {
+		key = rand()%(4*INNNERCOUNT);
+		value = ii;
+		if(seeded1.insert(std::make_pair(key, value)).second != 
+				seeded2.insert(std::make_pair(key, value)).second ||
+				fast1.insert(std::make_pair(key, value)).second != 
+				fast2.insert(std::make_pair(key, value)).second) {
+			cerr << "Seeded buffers diverged at " << ii << endl;
+			return 1;
+		}
+	}
+	cerr << "Seeded buffers agree" << endl;
+
+	// the total weight must stay in budget under skewed value sizes
+	const size_t BUDGET = 64*1024;
+	unordered_buffer<int, std::string> weighted(INNNERCOUNT);
+	weighted.weigher([](const int&, const std::string& v) { return v.size(); });
+	weighted.max_bytes(BUDGET);
+	for(size_t ii=0; ii<OUTERCOUNT*INNNERCOUNT; ii++) {
+		key = rand()%(4*INNNERCOUNT);
+		weighted.insert(std::make_pair(key, std::string(key%7 ? 16 : 4096, 'x')));
+		if(weighted.size_bytes() > BUDGET) {
+			cerr << "Weighted buffer over budget: " << weighted.size_bytes() 
+				<< endl;
+			return 1;
+		}
+	}
+	cerr << "Weighted buffer: " << weighted.size() << " elements, " 
+		<< weighted.size_bytes() << " bytes" << endl;
+
+	// swapping the weigher re-weighs the victim stash too, so dropping the
+	// stash afterwards leaves the total at the table's weight
+	{
+		unordered_buffer<int, int> small(4);
+		small.victim_stash(8);
+		small.weigher([](const int&, const int&) { return (size_t)1; });
+		for(int ii=0; ii<2000; ii++)
+			small.insert(std::make_pair(ii, ii));
+		small.weigher([](const int&, const int&) { return (size_t)10; });
+		size_t before = small.size_bytes();
+		small.victim_stash(0);
+		if(before <= 10*small.size() || small.size_bytes() != 10*small.size()) {
+			cerr << "Re-weighing skipped the victim stash: " << before 
+				<< " then " << small.size_bytes() << endl;
+			return 1;
+		}
+	}
+
+	// a hot key must stop occupying its bucket once it expires
+	unordered_buffer<int, double> expiring(INNNERCOUNT);
+	expiring.ttl(10);
+	for(size_t ii=0; ii<INNNERCOUNT; ii++)
+		expiring.insert(std::make_pair(KEYS[0], VALUES[0]));
+	expiring.tick(10);
+	if(!expiring.insert(std::make_pair(KEYS[0]+INNNERCOUNT, 1.)).second ||
+			expiring.sweep(INNNERCOUNT) != 0 || expiring.size() != 1) {
+		cerr << "Expired key still buffered" << endl;
+		return 1;
+	}
+	cerr << "Expired key released" << endl;
+
+	// once one of two hot keys sharing a bucket displaces the other, the
+	// victim stash should turn every following request into a hit
+	unordered_buffer<int, double> stashed(INNNERCOUNT);
+	stashed.victim_stash(8);
+	size_t pingpong = 0;
+	bool displaced = false;
+	for(int base=0; base<(int)INNNERCOUNT && !displaced; base++) {
+		for(size_t ii=0; ii<2*INNNERCOUNT; ii++) {
+			key = base + (ii%2)*INNNERCOUNT;
+			auto ret = stashed.insert(std::make_pair(key, 1.));
+			if(displaced && !(!ret.second && ret.first->first == key)) {
+				cerr << "Victim stash missed " << key << endl;
+				return 1;
+			}
+			displaced |= (ret.second && ii > 0);
+			pingpong += displaced;
+		}
+	}
+	cerr << "Victim stash hits: " << pingpong << endl;
+
+	// batched lookups must agree with one at a time lookups, for every group
+	std::vector<int> batch(3*INNNERCOUNT+5);
+	for(size_t ii=0; ii<batch.size(); ii++)
+		batch[ii] = rand()%(4*INNNERCOUNT);
+	std::vector<const double*> found(batch.size());
+	for(size_t group=1; group<=32; group*=2) {
+		size_t nfound = seeded1.find_batch(batch.data(), batch.size(), 
+				found.data(), group);
+		size_t expect = 0;
+		for(size_t ii=0; ii<batch.size(); ii++) {
+			expect += seeded1.count(batch[ii]);
+			if(found[ii] ? *found[ii] != seeded1.at(batch[ii]) : 
+					seeded1.count(batch[ii]) != 0) {
+				cerr << "Batched lookup of " << batch[ii] << " disagrees" << endl;
+				return 1;
+			}
+		}
+		if(nfound != expect) {
+			cerr << "Batched lookup found " << nfound << " of " << expect << endl;
+			return 1;
+		}
+	}
+	cerr << "Batched lookups agree" << endl;
+
+	// an undersized buffer grows, an emptied one shrinks back, and a scan
+	// (which no size can help) doesn't grow it
+	unordered_buffer<int, double> tuned(64);
+	tuned.seed(1);
+	tuned.auto_resize(true);
+	for(size_t ii=0; ii<OUTERCOUNT*INNNERCOUNT; ii++)
+		tuned.insert(std::make_pair(rand()%INNNERCOUNT, 1.));
+	size_t grown = tuned.bucket_count();
+	for(size_t kk=0; kk<INNNERCOUNT; kk++) {
+		if(kk >= 10)
+			tuned.erase(kk);
+	}
+	for(size_t ii=0; ii<OUTERCOUNT*INNNERCOUNT; ii++)
+		tuned.insert(std::make_pair(ii%10, 1.));
+	size_t shrunk = tuned.bucket_count();
+	for(size_t ii=0; ii<OUTERCOUNT*INNNERCOUNT; ii++)
+		tuned.insert(std::make_pair(INNNERCOUNT+ii, 1.));
+	size_t scanned = tuned.bucket_count();
+	cerr << "Auto resize: grew to " << grown << ", shrank to " << shrunk 
+		<< ", " << scanned << " after a scan" << endl;
+	if(grown < INNNERCOUNT || shrunk > 64 || scanned > 2*shrunk) {
+		cerr << "Auto resize did not adapt" << endl;
+		return 1;
+	}
+
+	// an automatic resize migrates a few buckets per insert: while it does,
+	// lookups, iteration, batches and copies agree, and hot and pinned keys
+	// come through with their priorities
+	{
+		unordered_buffer<int, int> growing(64);
+		growing.seed(5);
+		growing.pin_limit(1);
+		growing.insert(std::make_pair(-1, -1));
+		growing.pin(-1);
+		growing.insert(std::make_pair(-2, -2));
+		growing.touch(-2, 50);
+		growing.auto_resize(true);
+
+		auto agree = [](unordered_buffer<int, int>& b) {
+			size_t n = 0;
+			std::vector<int> keys;
+			for(auto it=b.begin(); it!=b.end(); ++it, n++) {
+				keys.push_back(it->first);
+				if(!b.count(it->first) || b.at(it->first) != it->second ||
+						b.find(it->first) != it || b.priority(it->first) <= 0)
+					return false;
+			}
+			std::vector<const int*> found(keys.size());
+			return n == b.size() && b.find_batch(keys.data(), keys.size(),
+					found.data()) == keys.size();
+		};
+
+		size_t resizes = 0, checked = 0;
+		size_t buckets = growing.bucket_count();
+		for(int ii=0; ii<40000; ii++) {
+			int key = (int)(rand()%4096);
+			growing.insert(std::make_pair(key, key));
+			if(growing.bucket_count() != buckets) {
+				buckets = growing.bucket_count();
+				resizes++;
+			}
+
+			// look closely right after a resize started
+			bool fresh = resizes > 0 && checked < resizes*8;
+			if(fresh || ii%997 == 0) {
+				checked += fresh;
+				auto copy = growing.clone();
+				if(!agree(growing) || !agree(copy) || 
+						copy.size() != growing.size()) {
+					cerr << "Lookups disagree during a resize at " << ii << endl;
+					return 1;
+				}
+			}
+		}
+		cerr << "Incremental resizes: " << resizes << ", now " << buckets
+			<< " buckets" << endl;
+		if(resizes == 0 || !growing.pinned(-1) || growing.at(-1) != -1 ||
+				growing.priority(-2) < 51 || !agree(growing)) {
+			cerr << "Incremental resize lost keys or priorities" << endl;
+			return 1;
+		}
+	}
+
+	// copies must be independent of the original, both the memcpy path 
+	// (int/double) and the element wise one (std::string), with and without
+	// copy on write
+	for(int cow=0; cow<2; cow++) {
+		seeded1.copy_on_write(cow != 0);
+		weighted.copy_on_write(cow != 0);
+		for(size_t ii=0; ii<INNNERCOUNT; ii++)
+			weighted.insert(std::make_pair((int)ii, std::string(ii%50, 'y')));
+
+		auto copy = seeded1.clone();
+		auto wcopy = weighted;
+		std::vector<std::pair<int, std::string>> wbefore;
+		for(auto it=weighted.begin(); it!=weighted.end(); ++it)
+			wbefore.push_back(*it);
+		std::vector<std::pair<int, double>> before;
+		for(auto it=copy.begin(); it!=copy.end(); ++it)
+			before.push_back(*it);
+
+		seeded1.clear();
+		weighted.clear();
+		for(size_t ii=0; ii<INNNERCOUNT; ii++)
+			seeded1.insert(std::make_pair((int)ii, -1.));
+
+		size_t same = 0;
+		for(auto& kv : before)
+			same += (copy.count(kv.first) && copy.at(kv.first) == kv.second);
+		size_t wsame = 0;
+		for(auto& kv : wbefore)
+			wsame += (wcopy.count(kv.first) && wcopy.at(kv.first) == kv.second);
+		if(same != before.size() || copy.size() != before.size() || 
+				wsame != wbefore.size() || wcopy.size() != wbefore.size()) {
+			cerr << "Copy " << (cow ? "(copy on write) " : "") 
+				<< "is not independent" << endl;
+			return 1;
+		}
+	}
+	cerr << "Copies are independent" << endl;
+
+	// the whole lookup API works through a const reference
+	{
+		unordered_buffer<int, double> fresh(64);
+		fresh.insert(std::make_pair(3, 4.5));
+		const unordered_buffer<int, double>& cref = fresh;
+		auto it = cref.find(3);
+		auto range = cref.equal_range(3);
+		size_t n = 0;
+		for(auto& kv : cref) {
+			(void)(kv);
+			n++;
+		}
+		if(it == cref.cend() || it->second != 4.5 || range.first != it || 
+				cref.count(3) != 1 || cref.at(3) != 4.5 || 
+				cref.find(-3) != cref.end() || n != cref.size() ||
+				cref.bucket(3) != fresh.bucket(3)) {
+			cerr << "Const lookups are wrong" << endl;
+			return 1;
+		}
+	}
+
+	// upsert aggregates on hits, single and batched give the same counts
+	{
+		std::vector<std::pair<int, long>> stream;
+		for(int ii=0; ii<20000; ii++)
+			stream.push_back(std::make_pair(ii%37, (long)ii));
+		auto add = [](long& stored, const long& v) { stored += v; };
+
+		unordered_buffer<int, long> one(4096), batch(4096);
+		for(auto& kv : stream)
+			one.upsert(kv.first, kv.second, add);
+		size_t stored = batch.upsert(stream.begin(), stream.end(), add);
+
+		size_t right = 0;
+		for(int kk=0; kk<37; kk++) {
+			long expect = 0;
+			for(auto& kv : stream)
+				expect += (kv.first == kk ? kv.second : 0);
+			right += (one.count(kk) && one.at(kk) == expect && 
+					batch.count(kk) && batch.at(kk) == expect);
+		}
+
+		unordered_buffer<int, std::string> sized(64);
+		sized.weigher([](const int&, const std::string& v) { return v.size(); });
+		for(int ii=0; ii<10; ii++)
+			sized.upsert(1, std::string("ab"), [](std::string& s, 
+						const std::string& v) { s += v; });
+
+		if(right != 37 || stored != stream.size() || one.priority(3) <= 1 ||
+				sized.at(1).size() != 20 || sized.size_bytes() != 20) {
+			cerr << "Upsert did not aggregate" << endl;
+			return 1;
+		}
+	}
+
+	// merge sums the priorities of shared keys and settles conflicts by
+	// priority, the same way with one thread or several
+	{
+		unordered_buffer<int, int> a(64), b(64);
+		a.insert(std::make_pair(1, 10));	// shared key
+		a.touch(1, 2);
+		b.insert(std::make_pair(1, 20));
+		b.touch(1, 3);
+		a.insert(std::make_pair(2, 10));	// loses to 66 (same bucket)
+		b.insert(std::make_pair(66, 20));
+		b.touch(66, 4);
+		a.insert(std::make_pair(3, 10));	// keeps its bucket on a tie
+		b.insert(std::make_pair(67, 20));
+		b.insert(std::make_pair(4, 20));	// empty bucket in a
+
+		auto c = a.clone();
+		size_t evicted = 0;
+		c.on_evict([&](const int&, const int&, int) { evicted++; });
+		a.merge(b, [](int& stored, const int& v) { stored += v; }, 4);
+		c.merge(b, [](int& stored, const int& v) { stored += v; });
+
+		bool same = a.size() == c.size();
+		for(auto it=a.begin(); it!=a.end(); ++it) {
+			same = same && c.count(it->first) && 
+				c.at(it->first) == it->second && 
+				c.priority(it->first) == a.priority(it->first);
+		}
+		if(!same || a.size() != 4 || a.at(1) != 30 || a.priority(1) != 7 ||
+				a.count(2) || a.priority(66) != 5 || !a.count(3) || 
+				a.count(67) || a.at(4) != 20 || evicted != 1) {
+			cerr << "Merge is wrong" << endl;
+			return 1;
+		}
+	}
+
+	// keys in the victim stash of the merged buffer are merged too, whether
+	// the merge pairs up buckets or not
+	{
+		unordered_buffer<int, int> b(64);
+		b.victim_stash(4);
+		b.insert(std::make_pair(5, 50));
+		b.touch(5, 5);
+		while(!b.insert(std::make_pair(69, 690)).second)
+			;
+
+		unordered_buffer<int, int> direct(64), spread(128);
+		direct.merge(b);
+		spread.merge(b);
+		if(!direct.count(5) || direct.priority(5) != 6 || direct.count(69) ||
+				spread.at(5) != 50 || spread.priority(5) != 6 || 
+				!spread.count(69)) {
+			cerr << "Merge lost the victim stash" << endl;
+			return 1;
+		}
+	}
+
+	// the sampled miss ratio curve follows real buffers of those sizes and
+	// falls with size
+	{
+		std::mt19937 gen(7);
+		std::uniform_real_distribution<double> unif(0, 1);
+		std::vector<int> trace;
+		for(int ii=0; ii<400000; ii++)
+			trace.push_back((int)std::exp(unif(gen)*std::log(200000.)));
+
+		unordered_buffer<int, int> sampled(4096);
+		sampled.hash_mixing(true, 1);
+		sampled.mrc_sampling(0.01, {0.5, 1, 2});
+		for(int kk : trace)
+			sampled.insert(std::make_pair(kk, 0));
+
+		auto curve = sampled.miss_ratio_curve();
+		bool close = curve.size() == 3 && sampled.mrc_sampling() > 0.01;
+		for(size_t ii=0; close && ii<curve.size(); ii++) {
+			unordered_buffer<int, int> real(curve[ii].first);
+			real.hash_mixing(true, 99);
+			size_t misses = 0;
+			for(int kk : trace) {
+				misses += !real.count(kk);
+				real.insert(std::make_pair(kk, 0));
+			}
+			double actual = (double)misses/trace.size();
+			cerr << curve[ii].first << " buckets, estimated miss ratio "
+				<< curve[ii].second << ", actual " << actual << endl;
+			close = std::abs(curve[ii].second - actual) < 0.05 &&
+				(ii == 0 || curve[ii].second < curve[ii-1].second);
+		}
+
+		sampled.mrc_sampling(0);
+		if(!close || sampled.mrc_sampling() != 0 ||
+				!sampled.miss_ratio_curve().empty()) {
+			cerr << "Miss ratio curve is off" << endl;
+			return 1;
+		}
+	}
+
+	// pinned keys are never replaced, evicted or expired and keep their pin
+	// through rehashes, the limit caps how many can be pinned
+	{
+		unordered_buffer<int, int> buff(64);
+		buff.ttl(10);
+		buff.weigher([](const int&, const int&) { return (size_t)1; });
+		buff.insert(std::make_pair(1, 10));
+		bool pinned = buff.pin(1) && buff.pin(1) && !buff.pin(2);
+
+		// every key below lands in bucket 1
+		for(int ii=1; ii<5000; ii++)
+			buff.insert(std::make_pair(1 + 64*ii, ii));
+		for(int ii=0; ii<32; ii++)
+			buff.insert(std::make_pair(100 + ii, ii));
+		buff.max_bytes(2);
+		buff.tick(100);
+		buff.sweep(64);
+		bool kept = buff.count(1) && buff.at(1) == 10 && buff.size() == 1 &&
+			!buff.count(65);
+
+		size_t limited = 0;
+		buff.max_bytes(SIZE_MAX);
+		for(int ii=2; ii<64; ii++) {
+			buff.insert(std::make_pair(ii, ii));
+			limited += buff.pin(ii);
+		}
+
+		buff.rehash(256);
+		bool rehashed = buff.pinned(1) && buff.at(1) == 10 && 
+			buff.pin_count() == 1 + limited;
+		bool refused = false;
+		unordered_buffer<int, int> tight(64);
+		tight.insert(std::make_pair(3, 3));
+		tight.insert(std::make_pair(35, 35));
+		tight.pin(3);
+		tight.pin(35);
+		try {
+			tight.rehash(32);
+		} catch(std::length_error&) {
+			refused = tight.bucket_count() == 64 && tight.pinned(3) &&
+				tight.pinned(35);
+		}
+
+		bool unpinned = buff.unpin(1) && !buff.unpin(1) && !buff.pinned(1);
+		buff.erase(2);
+		cerr << "Pinned 1 + " << limited << " keys of 64 buckets" << endl;
+		if(!pinned || !kept || limited != 5 || !rehashed || !refused ||
+				!unpinned || buff.pin_count() != limited - 1) {
+			cerr << "Pinned keys were displaced or miscounted" << endl;
+			return 1;
+		}
+	}
+
+	// with two_choice switched on and off on a filled buffer, every stored
+	// key is found in a bucket of its own, and growing keeps them all
+	{
+		unordered_buffer<int, int> buff(512);
+		buff.seed(3);
+		for(int ii=0; ii<3000; ii++)
+			buff.insert(std::make_pair((ii*7919)%1500, (ii*7919)%1500*3));
+
+		auto agree = [&]() {
+			std::vector<bool> seen(buff.bucket_count(), false);
+			size_t n = 0;
+			for(auto it=buff.cbegin(); it!=buff.cend(); ++it) {
+				int kk = it->first;
+				size_t b = buff.bucket(kk);
+				auto found = buff.find(kk);
+				if(b >= seen.size() || seen[b] || found == buff.end() ||
+						found->second != kk*3 || buff.count(kk) != 1 ||
+						buff.at(kk) != kk*3)
+					return false;
+				seen[b] = true;
+				n++;
+			}
+			return n == buff.size();
+		};
+
+		bool ok = agree();
+		const bool MODES[] = {true, false, true};
+		for(bool mode : MODES) {
+			buff.two_choice(mode);
+			ok = ok && buff.two_choice() == mode && agree();
+			for(int ii=0; ii<1000; ii++)
+				buff.insert(std::make_pair(ii*11%1500, ii*11%1500*3));
+			ok = ok && agree();
+		}
+
+		size_t before = buff.size();
+		buff.rehash(4*buff.bucket_count());
+		ok = ok && buff.size() == before && agree();
+
+		size_t erased = 0;
+		for(int kk=0; kk<1500; kk+=2) {
+			size_t stored = buff.count(kk);
+			size_t n = buff.erase(kk);
+			ok = ok && n == stored && !buff.count(kk);
+			erased += n;
+		}
+		ok = ok && buff.size() == before - erased && agree();
+		cerr << "Two choice: " << before << " keys kept through toggles and "
+			<< "a rehash, " << erased << " erased" << endl;
+		if(!ok) {
+			cerr << "Two choice lookups disagree" << endl;
+			return 1;
+		}
+	}
+
+	// a key that lost k rolls against a (pinned, so always winning)
+	// incumbent is admitted with priority 1+k, and every GHOST_AGING*n lost
+	// rolls (8*4 here) the counts are halved
+	{
+		const int LOSSES[] = {5, 31, 32};
+		const int EXPECT[] = {6, 32, 17};
+		bool ok = true;
+		for(int tt=0; tt<3; tt++) {
+			unordered_buffer<int, int> buff(64);
+			buff.seed(11);
+			buff.ghost_history(4);
+			buff.pin_limit(1);
+			buff.insert(std::make_pair(0, 0));
+			buff.pin(0);
+			for(int ii=0; ii<LOSSES[tt]; ii++)
+				ok = ok && !buff.insert(std::make_pair(64, 1)).second;
+
+			buff.unpin(0);
+			buff.erase(0);
+			ok = ok && buff.insert(std::make_pair(64, 1)).second &&
+				buff.priority(64) == EXPECT[tt];
+			cerr << "Admitted after " << LOSSES[tt] << " lost rolls with "
+				<< "priority " << buff.priority(64) << endl;
+		}
+		if(!ok) {
+			cerr << "Ghost credit or aging is wrong" << endl;
+			return 1;
+		}
+	}
+
+	// copy on write copies read on other threads while the original keeps
+	// writing, and it writes in place only once they have let go
+	{
+		unordered_buffer<int, int> orig(4096);
+		orig.copy_on_write(true);
+		for(int kk=0; kk<2000; kk++)
+			orig.insert(std::make_pair(kk, kk));
+
+		std::atomic<long> sum(0);
+		std::vector<std::thread> threads;
+		for(int tt=0; tt<4; tt++) {
+			threads.push_back(std::thread([&sum](
+							unordered_buffer<int, int> copy) {
+				long s = 0;
+				for(int kk=0; kk<2000; kk++)
+					s += copy.count(kk) ? copy.at(kk) : 0;
+				sum += s;
+			}, orig.clone()));
+		}
+		for(int kk=0; kk<2000; kk++)
+			orig[kk] = -kk;
+		for(auto& th : threads)
+			th.join();
+		for(int kk=0; kk<2000; kk++)
+			orig[kk] = 0;
+
+		long expect = 0;
+		for(int kk=0; kk<2000; kk++)
+			expect += orig.count(kk) ? kk : 0;
+		if(sum != 4*expect) {
+			cerr << "Copies read the original's writes" << endl;
+			return 1;
+		}
+	}
 }